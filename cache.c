@@ -0,0 +1,370 @@
+/*
+ *  uHID Universal MCU Bootloader. Library.
+ *  Copyright (C) 2016  Andrew 'Necromant' Andrianov
+ *
+ *  This file is part of uHID project. uHID was initially based
+ *  on bootloadHID avr bootloader by Christian Starkjohann
+ *  Since no original userspace code remains, all userspace code
+ *  is now LGPLv2.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Decoded image cache. Parsing a big Intel HEX file takes longer than
+ * starting the write, and the same few files get flashed over and over.
+ * So the images uhidWritePartFromFile() and uhidVerifyPartFromFile() decode
+ * are kept under ~/.uHID/cache, one file per source file and partition
+ * layout, named by the SHA-256 of its full path, the partition, the fill
+ * byte and the Intel HEX base address:
+ *
+ *   struct cacheHeader
+ *   CRC32 of each page, as verifyPages() would compute it
+ *   the image, padded to whole pages with the fill byte
+ *
+ * all in host byte order. Entries are mapped, not read. An entry is used
+ * while the source file has the same size, mtime and inode as when it was
+ * made, with UHID_FLAG_CACHE_HASH its contents have to hash the same too.
+ * Files that changed in the last few seconds aren't cached at all: another
+ * change might not show in an mtime that coarse, and it might have come in
+ * while the file was being decoded. Hits bump the entry's mtime, and the
+ * least recently used entries go once the cache outgrows its limit.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#include <libuhid.h>
+
+#define CACHE_MAGIC     "UHC2"
+/* Sources changed less than this long (s) ago aren't cached, see above */
+#define CACHE_SETTLE_S  2
+
+struct cacheHeader {
+	char          magic[4];
+	uint32_t      pageSize;
+	uint32_t      partSize;
+	uint32_t      fill;
+	uint32_t      len;        /* Of the image, without the padding */
+	uint32_t      numPages;
+	uint32_t      crc;        /* CRC32 of the padded image */
+	uint32_t      hexBase;
+	uint64_t      srcSize;
+	uint64_t      srcIno;
+	int64_t       srcMtime;   /* ns */
+	char          srcHash[UHID_HASH_LEN + 1];
+	char          part[UISP_PART_NAME_LEN];
+};
+
+struct cacheFile {
+	char         *path;
+	uint64_t      size;
+	int64_t       mtime;      /* ns, when it was last used */
+};
+
+static uint64_t cacheLimit = UHID_CACHE_DEFAULT_LIMIT;
+
+/**
+ * Limit the decoded image cache to bytes. 0 turns it off, entries that are
+ * already there stay until uhidCacheClear().
+ */
+UHID_API void uhidSetCacheLimit(uint64_t bytes)
+{
+	cacheLimit = bytes;
+}
+
+static int64_t mtimeNs(const struct stat *st)
+{
+#if defined(__APPLE__)
+	return st->st_mtimespec.tv_sec * 1000000000LL + st->st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+	return st->st_mtime * 1000000000LL;
+#else
+	return st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+#endif
+}
+
+/* Only regular files can be told apart by their metadata */
+static int sourceStat(const char *filename, struct stat *st)
+{
+	if (!cacheLimit || !strcmp(filename, "-"))
+		return -ENOENT;
+	if (stat(filename, st))
+		return -errno;
+	return S_ISREG(st->st_mode) ? 0 : -ENOENT;
+}
+
+/* Caller frees */
+static char *entryPath(const char *filename, struct uHidDeviceInfo *inf, int part,
+		       uint8_t fill)
+{
+	struct uHidPartInfo *p = &inf->parts[part];
+	char full[PATH_MAX], hash[UHID_HASH_LEN + 1], sub[UHID_HASH_LEN + 8];
+	uint32_t base = uhidGetHexBase();
+	struct uhidSha256 c;
+
+#ifdef _WIN32
+	if (!_fullpath(full, filename, sizeof(full)))
+		return NULL;
+#else
+	if (!realpath(filename, full))
+		return NULL;
+#endif
+	sha256Init(&c);
+	sha256Update(&c, full, strlen(full) + 1);
+	sha256Update(&c, p->name, UISP_PART_NAME_LEN);
+	sha256Update(&c, &p->size, sizeof(p->size));
+	sha256Update(&c, &p->pageSize, sizeof(p->pageSize));
+	sha256Update(&c, &fill, 1);
+	sha256Update(&c, &base, sizeof(base));
+	sha256Final(&c, hash);
+	snprintf(sub, sizeof(sub), "cache/%s", hash);
+	return uhidmgrGetAppHomeDir(sub);
+}
+
+static int fileHash(const char *filename, char hash[UHID_HASH_LEN + 1])
+{
+	unsigned char buf[16384];
+	struct uhidSha256 c;
+	FILE *fd = fopen(filename, "rb");
+	size_t n;
+	int ret;
+
+	if (!fd)
+		return -errno;
+	sha256Init(&c);
+	while ((n = fread(buf, 1, sizeof(buf), fd)))
+		sha256Update(&c, buf, n);
+	ret = ferror(fd) ? -EIO : 0;
+	fclose(fd);
+	sha256Final(&c, hash);
+	return ret;
+}
+
+static int headerMatches(const struct cacheHeader *h, size_t maplen, const struct stat *st,
+			 struct uHidPartInfo *p, uint8_t fill)
+{
+	if (maplen < sizeof(*h))
+		return 0;
+	return !memcmp(h->magic, CACHE_MAGIC, 4) && h->pageSize == p->pageSize &&
+		h->partSize == p->size && h->fill == fill && h->hexBase == uhidGetHexBase() &&
+		!memcmp(h->part, p->name, UISP_PART_NAME_LEN) &&
+		h->len && h->len <= p->size &&
+		h->numPages == (h->len + h->pageSize - 1) / h->pageSize &&
+		maplen == sizeof(*h) + (uint64_t) h->numPages * (4 + h->pageSize) &&
+		h->srcSize == (uint64_t) st->st_size && h->srcIno == (uint64_t) st->st_ino &&
+		h->srcMtime == mtimeNs(st);
+}
+
+/*
+ * Maps the cached image of filename for partition part into img, with
+ * img->pageCrcs set. Gaps and the last page are filled with fill.
+ *
+ * @return the image length or -ENOENT if there is no usable entry
+ */
+UHID_NO_EXPORT ssize_t cacheGet(const char *filename, struct uHidDeviceInfo *inf, int part,
+				uint8_t fill, struct uhidImage *img)
+{
+	const struct cacheHeader *h;
+	char hash[UHID_HASH_LEN + 1];
+	const char *data;
+	struct stat st;
+	char *path;
+
+	memset(img, 0, sizeof(*img));
+	if (sourceStat(filename, &st))
+		return -ENOENT;
+	path = entryPath(filename, inf, part, fill);
+	if (!path)
+		return -ENOENT;
+	if (imageMapFile(path, img))
+		goto miss;
+
+	h = img->map;
+	if (!headerMatches(h, img->maplen, &st, &inf->parts[part], fill))
+		goto miss;
+	data = (const char *) img->map + sizeof(*h) + h->numPages * 4;
+	if (CRC32FromBuf(0, data, (size_t) h->numPages * h->pageSize) != h->crc) {
+		fprintf(stderr, "Cached image %s is corrupted\n", path);
+		goto miss;
+	}
+	if ((uhidGetFlags() & UHID_FLAG_CACHE_HASH) &&
+	    (fileHash(filename, hash) || strcmp(hash, h->srcHash)))
+		goto miss;
+
+	/* Least recently used goes first */
+	utime(path, NULL);
+	free(path);
+	printf("Using the decoded image of %s from the cache\n", filename);
+	img->data = data;
+	img->len = h->len;
+	img->pageCrcs = (const uint32_t *) (h + 1);
+	return h->len;
+
+miss:
+	imageFree(img);
+	free(path);
+	return -ENOENT;
+}
+
+static int byAge(const void *a, const void *b)
+{
+	const struct cacheFile *x = a, *y = b;
+
+	return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+/* Drops the least recently used entries until the cache fits in limit */
+static int cacheEvict(uint64_t limit)
+{
+	struct cacheFile *files = NULL, *tmp;
+	char *dir = uhidmgrGetAppHomeDir("cache");
+	struct dirent *e;
+	uint64_t total = 0;
+	size_t n = 0, cap = 0, i;
+	struct stat st;
+	DIR *d;
+
+	if (!dir)
+		return -ENOMEM;
+	d = opendir(dir);
+	if (!d) {
+		free(dir);
+		return (errno == ENOENT) ? 0 : -errno;
+	}
+	while ((e = readdir(d))) {
+		size_t len = strlen(dir) + strlen(e->d_name) + 2;
+		char *path;
+
+		/* Half-written entries belong to someone else */
+		if (strlen(e->d_name) != UHID_HASH_LEN)
+			continue;
+		path = malloc(len);
+		if (!path)
+			break;
+		snprintf(path, len, "%s/%s", dir, e->d_name);
+		if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+			free(path);
+			continue;
+		}
+		if (n == cap) {
+			cap = cap ? 2 * cap : 32;
+			tmp = realloc(files, cap * sizeof(*files));
+			if (!tmp) {
+				free(path);
+				break;
+			}
+			files = tmp;
+		}
+		files[n].path = path;
+		files[n].size = st.st_size;
+		files[n].mtime = mtimeNs(&st);
+		total += st.st_size;
+		n++;
+	}
+	closedir(d);
+
+	if (n)
+		qsort(files, n, sizeof(*files), byAge);
+	for (i = 0; i < n; i++) {
+		if (total > limit && !remove(files[i].path))
+			total -= files[i].size;
+		free(files[i].path);
+	}
+	free(files);
+	free(dir);
+	return 0;
+}
+
+/*
+ * Remembers data, the decoded image of filename for partition part, unless
+ * that doesn't fit the cache. Errors only cost the next run some time, so
+ * they aren't reported.
+ */
+UHID_NO_EXPORT void cachePut(const char *filename, struct uHidDeviceInfo *inf, int part,
+			     uint8_t fill, const char *data, uint32_t len)
+{
+	struct uHidPartInfo *p = &inf->parts[part];
+	struct cacheHeader *h;
+	uint32_t *crcs, i;
+	char *path, *buf, *pages;
+	struct stat st;
+	size_t total;
+
+	if (!len || sourceStat(filename, &st) ||
+	    mtimeNs(&st) / 1000000000LL > time(NULL) - CACHE_SETTLE_S)
+		return;
+	path = entryPath(filename, inf, part, fill);
+	if (!path)
+		return;
+
+	total = sizeof(struct cacheHeader) +
+		(size_t) ((len + p->pageSize - 1) / p->pageSize) * (4 + p->pageSize);
+	if (total > cacheLimit)
+		goto bailout;
+	buf = calloc(1, total);
+	if (!buf)
+		goto bailout;
+
+	h = (struct cacheHeader *) buf;
+	memcpy(h->magic, CACHE_MAGIC, 4);
+	h->pageSize = p->pageSize;
+	h->partSize = p->size;
+	h->fill = fill;
+	h->hexBase = uhidGetHexBase();
+	h->len = len;
+	h->numPages = (len + p->pageSize - 1) / p->pageSize;
+	h->srcSize = st.st_size;
+	h->srcIno = st.st_ino;
+	h->srcMtime = mtimeNs(&st);
+	memcpy(h->part, p->name, UISP_PART_NAME_LEN);
+	if (fileHash(filename, h->srcHash))
+		goto out;
+
+	crcs = (uint32_t *) (h + 1);
+	pages = (char *) &crcs[h->numPages];
+	memcpy(pages, data, len);
+	memset(&pages[len], fill, (size_t) h->numPages * p->pageSize - len);
+	for (i = 0; i < h->numPages; i++)
+		crcs[i] = CRC32FromBuf(0, &pages[(size_t) i * p->pageSize], p->pageSize);
+	h->crc = CRC32FromBuf(0, pages, (size_t) h->numPages * p->pageSize);
+
+	if (!uhidmgrWriteAtomic(path, buf, total))
+		cacheEvict(cacheLimit);
+out:
+	free(buf);
+bailout:
+	free(path);
+}
+
+/**
+ * Forget all decoded images, e.g. after changing something
+ * uhidWritePartFromFile() can't see in the source file's metadata.
+ *
+ * @return 0 or -errno
+ */
+UHID_API int uhidCacheClear(void)
+{
+	return cacheEvict(0);
+}
@@ -33,9 +33,13 @@ if (CMAKE_BUILD_TYPE MATCHES "StaticRelease")
   set(CMAKE_FIND_LIBRARY_SUFFIXES ".a")
 endif()
 
+# libusb is the default. hidraw is needed to see virtual devices created by
+# uhidsim, since those never show up on the USB bus
+set(UHID_HIDAPI_BACKEND "libusb" CACHE STRING "hidapi backend to use on linux: libusb or hidraw")
+
 FIND_PACKAGE(PkgConfig)
 if (PKGCONFIG_FOUND)
-  PKG_CHECK_MODULES(HIDAPI hidapi-libusb)
+  PKG_CHECK_MODULES(HIDAPI hidapi-${UHID_HIDAPI_BACKEND})
   if (CMAKE_BUILD_TYPE MATCHES "StaticRelease")
     PKG_CHECK_MODULES(LIBUSB libusb-1.0)
     PKG_CHECK_MODULES(UDEV libudev)
@@ -45,7 +49,7 @@ endif()
 
 if((NOT HIDAPI_FOUND))
   message(STATUS "hidapi not found via pkg-config, trying find_library()")
-  find_library(HIDAPI NAMES hidapi hidapi-hidraw hidapi-libusb)
+  find_library(HIDAPI NAMES hidapi hidapi-${UHID_HIDAPI_BACKEND} hidapi-hidraw hidapi-libusb)
   if (NOT HIDAPI)
     message(STATUS "Failed to find system installation of hidapi")
   else()
@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <libuhid.h>
+#include "uhid_probes.h"
 
 UHID_NO_EXPORT int CRC32FromFile(const char *path, uint32_t *outCrc32)
 {
@@ -112,10 +113,13 @@ UHID_NO_EXPORT uint32_t CRC32FromBuf(uint32_t inCrc32, const void *buf,
     unsigned char *byteBuf;
     size_t i;
 
+    UHID_PROBE2(crc__start, inCrc32, bufLen);
     crc32 = inCrc32 ^ 0xFFFFFFFF;
     byteBuf = (unsigned char*) buf;
     for (i=0; i < bufLen; i++) {
         crc32 = (crc32 >> 8) ^ crcTable[ (crc32 ^ byteBuf[i]) & 0xFF ];
     }
-    return( crc32 ^ 0xFFFFFFFF );
+    crc32 ^= 0xFFFFFFFF;
+    UHID_PROBE2(crc__done, bufLen, crc32);
+    return crc32;
 }
@@ -0,0 +1,269 @@
+/*
+ *  uHID Universal MCU Bootloader. Library.
+ *  Copyright (C) 2016  Andrew 'Necromant' Andrianov
+ *
+ *  This file is part of uHID project. uHID was initially based
+ *  on bootloadHID avr bootloader by Christian Starkjohann
+ *  Since no original userspace code remains, all userspace code
+ *  is now LGPLv2.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Loads partition images straight from ELF32 firmware, no objcopy needed.
+ * PT_LOAD segments are placed by physical (load) address, so initialized
+ * data ends up in flash right after the code, just like objcopy does it.
+ * Not every platform has <elf.h>, hence the hand-rolled offsets.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#include <libuhid.h>
+
+#define ELF_HDR_SIZE     52
+#define ELF_PHDR_SIZE    32
+#define ELFCLASS32       1
+#define ELFDATA2LSB      1
+#define PT_LOAD          1
+#define EM_AVR           83
+
+#ifndef O_BINARY
+#define O_BINARY         0
+#endif
+
+/* avr-gcc puts everything that isn't flash at these offsets */
+static const struct {
+	const char *name;
+	uint32_t base;
+} avrSections[] = {
+	{ "flash",  0x000000 },
+	{ "eeprom", 0x810000 },
+	{ "fuse",   0x820000 },
+	{ "lock",   0x830000 },
+	{ }
+};
+
+static uint16_t le16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/* Maps the whole file behind fd, read-only. fd stays open */
+UHID_NO_EXPORT int imageMapFd(int fd, struct uhidImage *img)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0)
+		return -EINVAL;
+	img->maplen = st.st_size;
+#ifndef _WIN32
+	img->map = mmap(NULL, img->maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (img->map == MAP_FAILED)
+		img->map = NULL;
+#else
+	img->map = malloc(img->maplen);
+	if (img->map && (lseek(fd, 0, SEEK_SET) != 0 ||
+			 read(fd, img->map, img->maplen) != img->maplen)) {
+		free(img->map);
+		img->map = NULL;
+	}
+#endif
+	return img->map ? 0 : -EIO;
+}
+
+/* Maps the whole file, read-only */
+UHID_NO_EXPORT int imageMapFile(const char *filename, struct uhidImage *img)
+{
+	int fd = open(filename, O_RDONLY | O_BINARY);
+	int ret;
+
+	if (fd < 0)
+		return -errno;
+	ret = imageMapFd(fd, img);
+	close(fd);
+	return ret;
+}
+
+UHID_NO_EXPORT void imageFree(struct uhidImage *img)
+{
+	free(img->alloc);
+	if (img->map) {
+#ifndef _WIN32
+		munmap(img->map, img->maplen);
+#else
+		free(img->map);
+#endif
+	}
+	memset(img, 0, sizeof(*img));
+}
+
+static int64_t partBase(int machine, const char *name, const unsigned char *ph, int phnum)
+{
+	int64_t base = -1;
+	int i;
+
+	if (machine == EM_AVR) {
+		for (i = 0; avrSections[i].name; i++)
+			if (strcmp(avrSections[i].name, name) == 0)
+				return avrSections[i].base;
+		return -1;
+	}
+
+	/* Elsewhere only flash is known: it starts where the first thing is loaded */
+	if (strcmp(name, "flash") != 0)
+		return -1;
+	for (i = 0; i < phnum; i++, ph += ELF_PHDR_SIZE) {
+		if (le32(&ph[0]) != PT_LOAD || !le32(&ph[16]))
+			continue;
+		if (base < 0 || le32(&ph[12]) < base)
+			base = le32(&ph[12]);
+	}
+	return base;
+}
+
+/*
+ * Fills img with the contents of partition name (size bytes long) from the
+ * ELF32 file e, maplen bytes long. Gaps between segments are filled with
+ * fill. If a single segment makes up the image, img->data points right into
+ * e, otherwise into img->alloc. filename is only used for messages.
+ *
+ * @return image length or -errno
+ */
+UHID_NO_EXPORT ssize_t elfParse(const char *filename, const unsigned char *e, size_t maplen,
+				const char *name, uint32_t size, uint8_t fill,
+				struct uhidImage *img)
+{
+	const unsigned char *ph;
+	uint32_t phoff, len = 0;
+	int phnum, phentsize, machine, i, nseg = 0;
+	int64_t base;
+
+	if (maplen < ELF_HDR_SIZE || memcmp(e, "\177ELF", 4) ||
+	    e[4] != ELFCLASS32 || e[5] != ELFDATA2LSB) {
+		fprintf(stderr, "%s: not a little endian ELF32 file\n", filename);
+		return -EINVAL;
+	}
+	machine = le16(&e[18]);
+	phoff = le32(&e[28]);
+	phentsize = le16(&e[42]);
+	phnum = le16(&e[44]);
+	if (phentsize != ELF_PHDR_SIZE ||
+	    (uint64_t) phoff + (uint64_t) phnum * ELF_PHDR_SIZE > maplen) {
+		fprintf(stderr, "%s: bad program headers\n", filename);
+		return -EINVAL;
+	}
+	ph = &e[phoff];
+
+	base = partBase(machine, name, ph, phnum);
+	if (base < 0) {
+		fprintf(stderr, "%s: don't know where %s lives for ELF machine %d\n",
+			filename, name, machine);
+		return -ENOENT;
+	}
+
+	/* First pass: validate and find out how long the image is */
+	img->data = NULL;
+	for (i = 0; i < phnum; i++) {
+		const unsigned char *p = &ph[i * ELF_PHDR_SIZE];
+		uint32_t off = le32(&p[4]), paddr = le32(&p[12]), filesz = le32(&p[16]);
+
+		if (le32(&p[0]) != PT_LOAD || !filesz)
+			continue;
+		if ((uint64_t) off + filesz > maplen) {
+			fprintf(stderr, "%s: segment %d is past the end of file\n", filename, i);
+			return -EINVAL;
+		}
+		if (paddr < base || paddr >= base + size)
+			continue;
+		if (paddr - base + filesz > size) {
+			printf("WARN: Segment at 0x%x doesn't fit into %s, truncated!\n",
+			       paddr, name);
+			filesz = base + size - paddr;
+			img->truncated = 1;
+		}
+		if (paddr - base + filesz > len)
+			len = paddr - base + filesz;
+		nseg++;
+		if (paddr == base && filesz == len)
+			img->data = (const char *) &e[off];
+	}
+
+	if (!nseg) {
+		fprintf(stderr, "%s: nothing to load into %s\n", filename, name);
+		return -ENOENT;
+	}
+
+	if (nseg == 1 && img->data) {
+		img->len = len;
+		return len;
+	}
+
+	/* Second pass: put the segments together */
+	img->alloc = malloc(len);
+	if (!img->alloc)
+		return -ENOMEM;
+	memset(img->alloc, fill, len);
+	for (i = 0; i < phnum; i++) {
+		const unsigned char *p = &ph[i * ELF_PHDR_SIZE];
+		uint32_t off = le32(&p[4]), paddr = le32(&p[12]), filesz = le32(&p[16]);
+
+		if (le32(&p[0]) != PT_LOAD || !filesz || paddr < base || paddr >= base + size)
+			continue;
+		if (paddr - base + filesz > len)
+			filesz = len - (paddr - base);
+		memcpy(&img->alloc[paddr - base], &e[off], filesz);
+	}
+	img->data = img->alloc;
+	img->len = len;
+	return len;
+}
+
+/*
+ * Same as elfParse(), for the regular file open on fd that gets mapped into
+ * img. filename is only for messages, it may be "-" for stdin.
+ */
+UHID_NO_EXPORT ssize_t elfLoad(int fd, const char *filename, const char *name, uint32_t size,
+			       uint8_t fill, struct uhidImage *img)
+{
+	ssize_t ret;
+
+	memset(img, 0, sizeof(*img));
+	ret = imageMapFd(fd, img);
+	if (ret) {
+		fprintf(stderr, "error opening %s: %s\n", filename, strerror(-ret));
+		return ret;
+	}
+
+	ret = elfParse(filename, img->map, img->maplen, name, size, fill, img);
+	if (ret < 0)
+		imageFree(img);
+	return ret;
+}
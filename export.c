@@ -0,0 +1,201 @@
+/*
+ *  uHID Universal MCU Bootloader. Library.
+ *  Copyright (C) 2016  Andrew 'Necromant' Andrianov
+ *
+ *  This file is part of uHID project. uHID was initially based
+ *  on bootloadHID avr bootloader by Christian Starkjohann
+ *  Since no original userspace code remains, all userspace code
+ *  is now LGPLv2.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Saving partitions to files as they are read. Names ending in .hex, .ihx
+ * or .ihex get Intel HEX without the erased (0xff) parts, which is what the
+ * writer fills gaps with anyway. Everything else is raw binary, with holes
+ * where whole blocks are zero. A hole reads back as zeroes, so that is all
+ * it can stand for.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <libuhid.h>
+
+#define min_t(type, a, b) (((type)(a)<(type)(b))?(type)(a):(type)(b))
+
+#define HEX_RECORD_LEN   16
+
+#define HEX_PAIRS(h) \
+	h "0" h "1" h "2" h "3" h "4" h "5" h "6" h "7" \
+	h "8" h "9" h "A" h "B" h "C" h "D" h "E" h "F"
+
+/* Two digits per byte value, one copy per byte rather than two lookups */
+static const char hexPairs[] =
+	HEX_PAIRS("0") HEX_PAIRS("1") HEX_PAIRS("2") HEX_PAIRS("3")
+	HEX_PAIRS("4") HEX_PAIRS("5") HEX_PAIRS("6") HEX_PAIRS("7")
+	HEX_PAIRS("8") HEX_PAIRS("9") HEX_PAIRS("A") HEX_PAIRS("B")
+	HEX_PAIRS("C") HEX_PAIRS("D") HEX_PAIRS("E") HEX_PAIRS("F");
+
+static int isHexName(const char *filename)
+{
+	const char *ext = strrchr(filename, '.');
+
+	return ext && (strcasecmp(ext, ".hex") == 0 || strcasecmp(ext, ".ihx") == 0 ||
+		       strcasecmp(ext, ".ihex") == 0);
+}
+
+static char *hexByte(char *p, uint8_t v, uint8_t *sum)
+{
+	memcpy(p, &hexPairs[v * 2], 2);
+	*sum += v;
+	return p + 2;
+}
+
+static int hexRecord(FILE *fd, uint8_t type, uint16_t addr, const unsigned char *data,
+		     int len)
+{
+	/* ':' count address type data checksum '\n' */
+	char buf[1 + 2 + 4 + 2 + 2 * 255 + 2 + 1];
+	char *p = buf;
+	uint8_t sum = 0;
+	int i;
+
+	*p++ = ':';
+	p = hexByte(p, len, &sum);
+	p = hexByte(p, addr >> 8, &sum);
+	p = hexByte(p, addr & 0xff, &sum);
+	p = hexByte(p, type, &sum);
+	for (i = 0; i < len; i++)
+		p = hexByte(p, data[i], &sum);
+	p = hexByte(p, -sum, &sum);
+	*p++ = '\n';
+	return (fwrite(buf, p - buf, 1, fd) == 1) ? 0 : -EIO;
+}
+
+static int hexFlush(struct uhidExport *x)
+{
+	unsigned char upper[2];
+	int i, len = x->fill;
+
+	x->fill = 0;
+	for (i = 0; i < len && x->buf[i] == UHID_ERASED_BYTE; i++)
+		;
+	if (i == len)
+		return 0;
+
+	/* Intel HEX can't go past 4G, see uhidSetHexBase() */
+	if (x->start + len - 1 > UINT32_MAX) {
+		fprintf(stderr, "Intel HEX can't address 0x%llx\n",
+			(unsigned long long) x->start + len - 1);
+		return -ERANGE;
+	}
+	if ((x->start >> 16) != x->upper) {
+		x->upper = x->start >> 16;
+		upper[0] = x->upper >> 8;
+		upper[1] = x->upper;
+		if (hexRecord(x->fd, 4, 0, upper, 2))
+			return -EIO;
+	}
+	return hexRecord(x->fd, 0, x->start & 0xffff, x->buf, len);
+}
+
+static int binFlush(struct uhidExport *x)
+{
+	int i, len = x->fill;
+
+	x->fill = 0;
+	for (i = 0; i < len && !x->buf[i]; i++)
+		;
+	x->hole = (i == len);
+	if (x->hole)
+		return fseeko(x->fd, len, SEEK_CUR) ? -errno : 0;
+	return (fwrite(x->buf, len, 1, x->fd) == 1) ? 0 : -EIO;
+}
+
+/*
+ * Opens filename for partition data starting at offset. Intel HEX addresses
+ * are partition addresses plus uhidGetHexBase(), as the reader takes them,
+ * so a range saved this way can be written back without --offset.
+ */
+UHID_NO_EXPORT int exportOpen(struct uhidExport *x, const char *filename, uint64_t offset)
+{
+	unsigned char upper[2];
+
+	memset(x, 0, sizeof(*x));
+	x->fd = fopen(filename, "wb");
+	if (!x->fd)
+		return -errno;
+	x->hex = isHexName(filename);
+	/* Binary blocks line up with the file, so holes line up with its blocks */
+	x->addr = x->hex ? uhidGetHexBase() + offset : 0;
+	/* The file says where it starts, even if that is the 0 a reader assumes */
+	x->upper = x->addr >> 16;
+	upper[0] = x->upper >> 8;
+	upper[1] = x->upper;
+	if (x->hex && hexRecord(x->fd, 4, 0, upper, 2)) {
+		fclose(x->fd);
+		return -EIO;
+	}
+	return 0;
+}
+
+/* uhidReadSink for an opened export */
+UHID_NO_EXPORT int exportSink(void *arg, const char *data, int len)
+{
+	struct uhidExport *x = arg;
+	int block = x->hex ? HEX_RECORD_LEN : UHID_EXPORT_BLOCK;
+	int ret;
+
+	while (len) {
+		/* Records and blocks don't cross their natural boundaries */
+		int n = min_t(int, len, block - (x->addr % block));
+
+		if (!x->fill)
+			x->start = x->addr;
+		memcpy(&x->buf[x->fill], data, n);
+		x->fill += n;
+		x->addr += n;
+		data += n;
+		len -= n;
+		if (x->addr % block == 0) {
+			ret = x->hex ? hexFlush(x) : binFlush(x);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+/* Writes out what is left and closes the file, ret is passed through */
+UHID_NO_EXPORT int exportClose(struct uhidExport *x, int ret)
+{
+	if (!ret && x->fill)
+		ret = x->hex ? hexFlush(x) : binFlush(x);
+	if (!ret && x->hex && hexRecord(x->fd, 1, 0, NULL, 0))
+		ret = -EIO;
+	/* A trailing hole doesn't make the file any longer by itself */
+	if (!ret && x->hole && (fflush(x->fd) || ftruncate(fileno(x->fd), ftello(x->fd))))
+		ret = -errno;
+	if (fclose(x->fd) && !ret)
+		ret = -errno;
+	return ret;
+}
@@ -0,0 +1,282 @@
+/*
+ *  uHID Universal MCU Bootloader. Library.
+ *  Copyright (C) 2016  Andrew 'Necromant' Andrianov
+ *
+ *  This file is part of uHID project. uHID was initially based
+ *  on bootloadHID avr bootloader by Christian Starkjohann
+ *  Since no original userspace code remains, all userspace code
+ *  is now LGPLv2.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Starting the application and waiting for the board to come back. It drops
+ * off the bus after the run request and shows up again as whatever the
+ * application is, or as the bootloader if the application didn't start.
+ * On linux the kernel's uevents tell when something was plugged in or out,
+ * so HID devices are only enumerated then. Elsewhere they are enumerated
+ * every POLL_MS.
+ *
+ * The board is recognised by the USB port it is plugged into (see
+ * uhidGetTopology()), whatever it calls itself now. Where that isn't known,
+ * the old path or any HID device that wasn't there before will do.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+#include <hidapi/hidapi.h>
+#include <libuhid.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#endif
+
+#define min_t(type, a, b) (((type)(a)<(type)(b))?(type)(a):(type)(b))
+
+/* Enumeration interval without uevents */
+#define POLL_MS   50
+/* Some hidapi backends (libusb) only see a device a little after its uevent */
+#define SETTLE_MS 250
+/* In case uevents don't make it into this network namespace */
+#define IDLE_MS   1000
+
+struct waiter {
+	const char   *path;
+	struct uhidTopology topo;
+	int           topoKnown;
+	char          port[40];    /* "<bus>-<ports>", the USB device in sysfs */
+	struct hid_device_info *before;
+	int           events;      /* uevent socket or -1 */
+	uint64_t      settle;      /* Enumerate every POLL_MS until then */
+	uint64_t      goneAt;
+	int           absent;      /* An enumeration didn't find the board */
+	int           removed;     /* uevents saw it go ... */
+	int           replugged;   /* ... and come back */
+};
+
+static uint64_t nowMs(void)
+{
+	struct timespec tv;
+	clock_gettime(CLOCK_MONOTONIC, &tv);
+	return tv.tv_sec * 1000ULL + tv.tv_nsec / 1000000;
+}
+
+#ifdef __linux__
+static int ueventOpen(void)
+{
+	struct sockaddr_nl addr;
+	int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+
+	if (fd < 0)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;	/* Straight from the kernel, udev may not even run */
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Does devpath go through the USB device port or one of its interfaces? */
+static int onPort(const char *devpath, const char *port)
+{
+	size_t len = strlen(port);
+	const char *p = devpath;
+
+	while ((p = strchr(p, '/'))) {
+		p++;
+		if (!strncmp(p, port, len) && (p[len] == '/' || p[len] == ':' || !p[len]))
+			return 1;
+	}
+	return 0;
+}
+
+/* Wait up to ms for uevents, returns 1 if something was plugged in or out */
+static int ueventWait(struct waiter *w, int ms)
+{
+	struct pollfd pfd = { .fd = w->events, .events = POLLIN };
+	char buf[4096];
+	int changed = 0;
+	ssize_t len;
+
+	if (poll(&pfd, 1, ms) <= 0)
+		return 0;
+	/* "<action>@<devpath>" and then the environment, we only need the first */
+	while ((len = recv(w->events, buf, sizeof(buf) - 1, MSG_DONTWAIT)) > 0) {
+		char *at;
+		int add;
+
+		buf[len] = 0;
+		at = strchr(buf, '@');
+		if (!at)
+			continue;
+		add = !strncmp(buf, "add@", 4);
+		if (!add && strncmp(buf, "remove@", 7))
+			continue;
+		changed = 1;
+		if (!w->port[0] || !onPort(at + 1, w->port))
+			continue;
+		if (!add && !w->removed) {
+			w->removed = 1;
+			if (!w->goneAt)
+				w->goneAt = nowMs();
+		}
+		if (add && w->removed)
+			w->replugged = 1;
+	}
+	return changed;
+}
+#endif
+
+/* Sleep until the board may have come or gone, at most until end */
+static void waitChange(struct waiter *w, uint64_t end)
+{
+	uint64_t now = nowMs();
+	int ms;
+
+	if (now >= end)
+		return;
+#ifdef __linux__
+	if (w->events >= 0) {
+		ms = min_t(uint64_t, (now < w->settle) ? POLL_MS : IDLE_MS, end - now);
+		if (ueventWait(w, ms))
+			w->settle = nowMs() + SETTLE_MS;
+		return;
+	}
+#endif
+	ms = min_t(uint64_t, POLL_MS, end - now);
+	usleep(ms * 1000);
+}
+
+static struct hid_device_info *findBoard(struct waiter *w, struct hid_device_info *list)
+{
+	struct hid_device_info *inf, *b;
+	struct uhidTopology t;
+
+	for (inf = list; inf; inf = inf->next) {
+		if (w->topoKnown) {
+			if (!uhidGetTopology(inf->path, &t) && t.bus == w->topo.bus &&
+			    !strcmp(t.ports, w->topo.ports))
+				return inf;
+			continue;
+		}
+		if (!strcmp(inf->path, w->path))
+			return inf;
+		for (b = w->before; b && strcmp(b->path, inf->path); b = b->next)
+			;
+		if (!b)
+			return inf;
+	}
+	return NULL;
+}
+
+/**
+ * Start the application in part like uhidCloseAndRun() and wait up to
+ * timeoutMs for the board to drop off the bus and come back. path is where
+ * dev was opened, see uhidOpenMatching(). r gets what came back and how
+ * long it took. If that matches deviceMatch (NULL is the built-in table,
+ * see uhidOpen()) the application didn't start and r->bootloader is set.
+ * dev is closed in any case.
+ *
+ * @return 0, -ETIMEDOUT if the board didn't come back in time, -ECANCELED
+ * (see uhidSetLimits()) or -errno
+ */
+UHID_API int uhidRunAndWait(hid_device *dev, const char *path, int part,
+			    struct uHidDeviceMatch *deviceMatch, uint32_t timeoutMs,
+			    struct uhidReappear *r)
+{
+	struct hid_device_info *list, *inf;
+	struct waiter w;
+	uint64_t start, end;
+	int ret = 0;
+
+	memset(r, 0, sizeof(*r));
+	memset(&w, 0, sizeof(w));
+	w.path = path;
+	w.events = -1;
+	w.topoKnown = !uhidGetTopology(path, &w.topo);
+	if (w.topoKnown)
+		snprintf(w.port, sizeof(w.port), "%d-%s", w.topo.bus, w.topo.ports);
+	w.before = hid_enumerate(0, 0);
+#ifdef __linux__
+	/* Before the run request, or its events might be gone already */
+	w.events = ueventOpen();
+#endif
+
+	start = nowMs();
+	end = start + timeoutMs;
+	if (uhidCloseAndRun(dev, part)) {
+		ret = -EIO;
+		goto bailout;
+	}
+
+	while (1) {
+		list = hid_enumerate(0, 0);
+		inf = findBoard(&w, list);
+		if (!inf && !w.absent) {
+			w.absent = 1;
+			if (!w.goneAt)
+				w.goneAt = nowMs();
+		}
+		/* Old enumerations may still list it for a bit, see SETTLE_MS */
+		if (inf && (w.absent || w.replugged)) {
+			r->vendor = inf->vendor_id;
+			r->product = inf->product_id;
+			if (inf->product_string)
+				wcsncpy(r->productName, inf->product_string, 63);
+			if (inf->serial_number)
+				wcsncpy(r->serial, inf->serial_number, 63);
+			snprintf(r->path, sizeof(r->path), "%s", inf->path);
+			r->bootloader = uhidDevMatches(inf, deviceMatch);
+			r->goneMs = w.goneAt - start;
+			r->elapsedMs = nowMs() - start;
+			hid_free_enumeration(list);
+			break;
+		}
+		hid_free_enumeration(list);
+
+		if (uhidLimitsCancelled()) {
+			fprintf(stderr, "Cancelled\n");
+			ret = -ECANCELED;
+			break;
+		}
+		if (nowMs() >= end) {
+			if (w.absent || w.removed)
+				fprintf(stderr, "The device didn't come back in %u ms\n", timeoutMs);
+			else
+				fprintf(stderr, "The device is still there after %u ms\n", timeoutMs);
+			ret = -ETIMEDOUT;
+			break;
+		}
+		waitChange(&w, end);
+	}
+
+bailout:
+	if (w.events >= 0)
+		close(w.events);
+	hid_free_enumeration(w.before);
+	return ret;
+}
@@ -0,0 +1,397 @@
+/*
+ *  uHID Universal MCU Bootloader. Library.
+ *  Copyright (C) 2016  Andrew 'Necromant' Andrianov
+ *
+ *  This file is part of uHID project. uHID was initially based
+ *  on bootloadHID avr bootloader by Christian Starkjohann
+ *  Since no original userspace code remains, all userspace code
+ *  is now LGPLv2.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Header-only C++20 wrapper around libuhid.
+ *
+ *   auto dev = uhid::Device::open();
+ *   if (!dev)
+ *           return dev.error().message();
+ *   auto ok = dev->write("flash", std::as_bytes(std::span(image)));
+ *
+ * Data is passed to libuhid straight from the caller's buffers, nothing is
+ * copied on the way. Errors come back as uhid::Result<T>, which is
+ * std::expected<T, std::error_code> where the standard library has it.
+ * libuhid itself still prints progress and diagnostics, use uhidProgressCb()
+ * to redirect the progress bar.
+ */
+
+#ifndef LIBUHIDXX_H
+#define LIBUHIDXX_H
+
+#include <libuhid.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+#if __has_include(<expected>)
+#include <expected>
+#endif
+
+namespace uhid {
+
+#if defined(__cpp_lib_expected)
+template <typename T>
+using Result = std::expected<T, std::error_code>;
+using Unexpected = std::unexpected<std::error_code>;
+#else
+struct Unexpected {
+	explicit Unexpected(std::error_code e) : err(e) {}
+	const std::error_code &error() const { return err; }
+	std::error_code err;
+};
+
+/* The subset of std::expected we need */
+template <typename T>
+class Result {
+public:
+	Result(T v) : val(std::move(v)) {}
+	Result(Unexpected u) : err(u.error()) {}
+	bool has_value() const { return val.has_value(); }
+	explicit operator bool() const { return val.has_value(); }
+	T &value() { return *val; }
+	const T &value() const { return *val; }
+	T &operator*() { return *val; }
+	const T &operator*() const { return *val; }
+	T *operator->() { return &*val; }
+	const T *operator->() const { return &*val; }
+	const std::error_code &error() const { return err; }
+private:
+	std::optional<T> val;
+	std::error_code err;
+};
+
+template <>
+class Result<void> {
+public:
+	Result() : ok(true) {}
+	Result(Unexpected u) : err(u.error()), ok(false) {}
+	bool has_value() const { return ok; }
+	explicit operator bool() const { return ok; }
+	void value() const {}
+	const std::error_code &error() const { return err; }
+private:
+	std::error_code err;
+	bool ok;
+};
+#endif
+
+/* libuhid returns -errno, or just -1 in a few older calls */
+inline Unexpected fail(int ret)
+{
+	return Unexpected(std::error_code(ret < -1 ? -ret : EIO, std::generic_category()));
+}
+
+struct Partition {
+	int           id;
+	std::string   name;
+	uint32_t      size;
+	uint16_t      pageSize;
+	uint16_t      ioSize;
+};
+
+/* A copy of the info report, so lookups don't cost a USB round trip */
+class PartitionTable {
+public:
+	PartitionTable() = default;
+	explicit PartitionTable(struct uHidDeviceInfo *inf)
+		: version(inf->version), caps(uhidGetCaps(inf)),
+		  freqMhz(uhidGetFrequencyMhz(inf))
+	{
+		for (int i = 0; i < inf->numParts; i++) {
+			const struct uHidPartInfo *p = &inf->parts[i];
+			const char *name = (const char *) p->name;
+			parts.push_back({ i, std::string(name, strnlen(name, UISP_PART_NAME_LEN)),
+					  p->size, p->pageSize, p->ioSize });
+		}
+	}
+
+	const Partition *find(std::string_view name) const
+	{
+		for (const auto &p : parts)
+			if (p.name == name)
+				return &p;
+		return nullptr;
+	}
+
+	const Partition *find(int id) const
+	{
+		if (id < 0 || id >= (int) parts.size())
+			return nullptr;
+		return &parts[id];
+	}
+
+	std::size_t size() const { return parts.size(); }
+	auto begin() const { return parts.begin(); }
+	auto end() const { return parts.end(); }
+
+	int           version = 0;
+	uint32_t      caps = 0;
+	float         freqMhz = 0;
+private:
+	std::vector<Partition> parts;
+};
+
+/* An open uHID device. Closed when it goes out of scope */
+class Device {
+public:
+	Device() = default;
+	Device(const Device &) = delete;
+	Device &operator=(const Device &) = delete;
+	Device(Device &&o) noexcept
+		: dev(std::exchange(o.dev, nullptr)), table(std::move(o.table)) {}
+	Device &operator=(Device &&o) noexcept
+	{
+		if (this != &o) {
+			close();
+			dev = std::exchange(o.dev, nullptr);
+			table = std::move(o.table);
+		}
+		return *this;
+	}
+	~Device() { close(); }
+
+	/* match works like for uhidOpen(), nullptr means any known device */
+	static Result<Device> open(struct uHidDeviceMatch *match = nullptr)
+	{
+		return adopt(uhidOpen(match));
+	}
+
+	static Result<Device> openPath(const char *path)
+	{
+		return adopt(hid_open_path(path));
+	}
+
+	/* Takes ownership of an already open device */
+	static Result<Device> adopt(hid_device *handle)
+	{
+		if (!handle)
+			return fail(-ENODEV);
+		Device d;
+		d.dev = handle;
+		auto r = d.refresh();
+		if (!r)
+			return Unexpected(r.error());
+		return d;
+	}
+
+	hid_device *handle() const { return dev; }
+	hid_device *release() { return std::exchange(dev, nullptr); }
+
+	void close()
+	{
+		if (dev)
+			uhidClose(std::exchange(dev, nullptr));
+	}
+
+	const PartitionTable &partitions() const { return table; }
+
+	/* Re-reads the info report */
+	Result<void> refresh()
+	{
+		struct uHidDeviceInfo *inf = uhidReadInfo(dev);
+		if (!inf)
+			return fail(-EIO);
+		table = PartitionTable(inf);
+		free(inf);
+		return {};
+	}
+
+	Result<void> write(const Partition &p, std::span<const std::byte> data)
+	{
+		int ret = uhidWritePart(dev, p.id, (const char *) data.data(), data.size());
+		if (ret)
+			return fail(ret);
+		return {};
+	}
+
+	/* offset must be on a page boundary, see uhidWriteRange() */
+	Result<void> write(const Partition &p, uint64_t offset, std::span<const std::byte> data)
+	{
+		int ret = uhidWriteRange(dev, p.id, offset, (const char *) data.data(), data.size());
+		if (ret)
+			return fail(ret);
+		return {};
+	}
+
+	/* Reads min(out.size(), partition size) bytes, returns how many */
+	Result<std::size_t> read(const Partition &p, std::span<std::byte> out)
+	{
+		ssize_t ret = uhidReadPartInto(dev, p.id, (char *) out.data(), out.size());
+		if (ret < 0)
+			return fail(ret);
+		return (std::size_t) ret;
+	}
+
+	/* Reads the first len bytes (default: all) of the partition into out */
+	template <typename OutputIt>
+	Result<OutputIt> read(const Partition &p, OutputIt out, std::size_t len = SIZE_MAX)
+	{
+		auto sink = [](void *arg, const char *data, int n) -> int {
+			OutputIt *it = static_cast<OutputIt *>(arg);
+			const std::byte *b = reinterpret_cast<const std::byte *>(data);
+			for (int i = 0; i < n; i++)
+				*(*it)++ = b[i];
+			return 0;
+		};
+		ssize_t ret = uhidReadPartCb(dev, p.id, len, sink, &out);
+		if (ret < 0)
+			return fail(ret);
+		return out;
+	}
+
+	/* Reads len bytes starting at offset into out */
+	template <typename OutputIt>
+	Result<OutputIt> read(const Partition &p, uint64_t offset, uint64_t len, OutputIt out)
+	{
+		auto sink = [](void *arg, const char *data, int n) -> int {
+			OutputIt *it = static_cast<OutputIt *>(arg);
+			const std::byte *b = reinterpret_cast<const std::byte *>(data);
+			for (int i = 0; i < n; i++)
+				*(*it)++ = b[i];
+			return 0;
+		};
+		int ret = uhidReadRange(dev, p.id, offset, len, sink, &out);
+		if (ret)
+			return fail(ret);
+		return out;
+	}
+
+	/*
+	 * true if the partition starts with data. Uses page digests if the
+	 * device has them, otherwise compares against the data as it is read.
+	 */
+	Result<bool> verify(const Partition &p, std::span<const std::byte> data)
+	{
+		if ((table.caps & UHID_CAP_DIGEST) && !(uhidGetFlags() & UHID_FLAG_READBACK)) {
+			int ret = uhidVerifyPartPages(dev, p.id, (const char *) data.data(),
+						      data.size(), nullptr, 0);
+			if (ret < 0)
+				return fail(ret);
+			return ret == 0;
+		}
+
+		struct Cmp {
+			std::span<const std::byte> rest;
+			bool same;
+		} cmp = { data.first(std::min<std::size_t>(data.size(), p.size)), true };
+		auto sink = [](void *arg, const char *d, int n) -> int {
+			Cmp *c = static_cast<Cmp *>(arg);
+			if (memcmp(c->rest.data(), d, n)) {
+				c->same = false;
+				return -ECANCELED;
+			}
+			c->rest = c->rest.subspan(n);
+			return 0;
+		};
+		ssize_t ret = uhidReadPartCb(dev, p.id, cmp.rest.size(), sink, &cmp);
+		if (!cmp.same)
+			return false;
+		if (ret < 0)
+			return fail(ret);
+		return true;
+	}
+
+	Result<uint32_t> crc(const Partition &p)
+	{
+		uint32_t crc;
+		if (uhidGetPartitionCRCById(dev, p.id, &crc))
+			return fail(-EIO);
+		return crc;
+	}
+
+	Result<uint32_t> crc(const Partition &p, uint64_t offset, uint64_t len)
+	{
+		uint32_t crc;
+		int ret = uhidGetRangeCRC(dev, p.id, offset, len, &crc);
+		if (ret)
+			return fail(ret);
+		return crc;
+	}
+
+	/* Starts the application. The device is closed afterwards */
+	Result<void> run(const Partition &p)
+	{
+		int ret = uhidCloseAndRun(std::exchange(dev, nullptr), p.id);
+		if (ret)
+			return fail(ret);
+		return {};
+	}
+
+	/* Same as above, with partitions looked up by name */
+	Result<void> write(std::string_view part, std::span<const std::byte> data)
+	{
+		auto p = lookup(part);
+		return p ? write(**p, data) : Unexpected(p.error());
+	}
+
+	Result<std::size_t> read(std::string_view part, std::span<std::byte> out)
+	{
+		auto p = lookup(part);
+		return p ? read(**p, out) : Unexpected(p.error());
+	}
+
+	Result<bool> verify(std::string_view part, std::span<const std::byte> data)
+	{
+		auto p = lookup(part);
+		return p ? verify(**p, data) : Unexpected(p.error());
+	}
+
+	Result<uint32_t> crc(std::string_view part)
+	{
+		auto p = lookup(part);
+		return p ? crc(**p) : Unexpected(p.error());
+	}
+
+	Result<void> run(std::string_view part)
+	{
+		auto p = lookup(part);
+		return p ? run(**p) : Unexpected(p.error());
+	}
+
+	Result<const Partition *> lookup(std::string_view name) const
+	{
+		const Partition *p = table.find(name);
+		if (!p)
+			return fail(-ENOENT);
+		return p;
+	}
+
+private:
+	hid_device *dev = nullptr;
+	PartitionTable table;
+};
+
+} /* namespace uhid */
+
+#endif
@@ -27,6 +27,7 @@
 
 #define UISP_PART_NAME_LEN  8
 #include <stdint.h>
+#include <sys/types.h>
 #include <hidapi/hidapi.h>
 
 struct uHidDeviceMatch {
@@ -66,7 +67,129 @@ struct uhidRepositoryHandle {
 	char *dirpath;
 };
 
+/* Where a device is plugged in, see uhidGetTopology() */
+struct uhidTopology {
+	int           bus;
+	int           speed;      /* Mbit/s, 0 if unknown */
+	char          ports[32];  /* Port chain, e.g. "2.3.1" */
+	char          tt[64];     /* Devices on the same bus with the same tt
+				     share a transaction translator */
+};
+
+/*
+ * Feature report traffic of one thread, see uhidGetXferStats(). latency
+ * is a histogram of how long single reports took, uhidXferPercentile()
+ * reads it.
+ */
+#define UHID_LAT_BUCKETS        96
+
+struct uhidXferStats {
+	uint64_t      bytes;
+	uint32_t      reports;
+	uint32_t      errors;     /* Transfers that failed */
+	uint64_t      us;         /* Time spent in transfers */
+	uint32_t      latency[UHID_LAT_BUCKETS];
+};
+
+/*
+ * Set from any thread (or a signal handler) with uhidCancel() to make the
+ * operations watching it return -ECANCELED before their next report
+ */
+struct uhidCancel {
+	int           cancelled;
+};
+
+/*
+ * Limits for the operations of the calling thread, see uhidSetLimits().
+ * An operation that runs into one returns -ETIMEDOUT. 0 means no limit.
+ */
+struct uhidLimits {
+	uint32_t      timeoutMs;       /* Everything, counted from uhidSetLimits() */
+	uint32_t      reportTimeoutMs; /* A single feature report */
+	struct uhidCancel *cancel;     /* May be NULL */
+};
+
+/* What came back on the bus after uhidRunAndWait() */
+struct uhidReappear {
+	uint16_t      vendor;
+	uint16_t      product;
+	wchar_t       productName[64];
+	wchar_t       serial[64];
+	char          path[256];
+	int           bootloader;  /* It is a uHID device again, the app didn't start */
+	uint32_t      goneMs;      /* From the run request until it left the bus */
+	uint32_t      elapsedMs;   /* ... and until it was back */
+};
+
+enum {
+	UHID_STATUS_IDLE = 0,
+	UHID_STATUS_RUNNING,
+	UHID_STATUS_DONE
+};
+
+/* One device on the status board, see status.c. 128 bytes */
+struct uhidStatusSlot {
+	uint32_t      seq;         /* Odd while the owner is updating the slot */
+	int32_t       pid;         /* Owner, 0 if the slot was never used */
+	char          serial[48];
+	char          phase[16];
+	char          part[16];
+	uint64_t      bytes;       /* Done so far */
+	uint64_t      total;
+	uint32_t      rate;        /* Bytes per second */
+	int32_t       result;      /* 0 or -errno, once done */
+	uint32_t      state;       /* UHID_STATUS_* */
+	uint32_t      elapsedMs;
+	uint64_t      updatedMs;   /* CLOCK_MONOTONIC */
+};
+
+enum {
+	UHID_JOB_PENDING = 0,
+	UHID_JOB_RUNNING,
+	UHID_JOB_DONE
+};
+
+/* A unit of work for uhidRunJobs(), one per device */
+struct uhidJob {
+	const char   *path;
+	int         (*run)(struct uhidJob *job, hid_device *dev);
+	void         *arg;
+	const char   *name;        /* For the status board, may be NULL */
+	/* Filled in by uhidRunJobs() */
+	struct uhidTopology topo;
+	int           state;
+	int           result;
+	uint64_t      bytes;
+	uint64_t      startMs;
+	uint64_t      endMs;
+	struct uhidXferStats stats;
+};
+
+/* Concurrency limits for uhidRunJobs(), 0 means unlimited */
+struct uhidSchedule {
+	int           maxJobs;
+	int           perTT;
+	int           perBus;
+	/* Applied to each job on its own, see struct uhidLimits */
+	uint32_t      jobTimeoutMs;
+	uint32_t      reportTimeoutMs;
+	struct uhidCancel *cancel;     /* Cancels all jobs, running or not */
+};
+
+/*
+ * A partition in the info report. Version 3 bootloaders send this, older
+ * ones struct uHidPartInfoV1. uhidReadInfo() and friends always return
+ * this layout, with the version the device reported.
+ */
 struct uHidPartInfo {
+	uint16_t      pageSize;
+	uint32_t      size;
+	uint16_t      ioSize;
+	uint8_t       name[UISP_PART_NAME_LEN];
+}  __attribute__((packed));
+
+/* Info report versions 1 and 2, at most 255 bytes per report */
+struct uHidPartInfoV1 {
 	uint16_t      pageSize;
 	uint32_t      size;
 	uint8_t       ioSize;
@@ -81,30 +204,302 @@ struct uHidDeviceInfo {
 	struct uHidPartInfo parts[];
 } __attribute__((packed));
 
+/*
+ * Optional bootloader features. Bootloaders with info version >= 2 append a
+ * 32-bit capability mask right after the partition table. Version 3 adds
+ * a 16-bit hint after that: the longest report the device handles, which
+ * may be the info report itself. See uhidGetMaxReport().
+ */
+#define UHID_INFO_VERSION       3
+#define UHID_CAP_CONTROL        (1 << 0) /* Control report, see below */
+#define UHID_CAP_RLE            (1 << 1) /* RLE compressed write stream */
+#define UHID_CAP_ERASE_ON_ENTRY (1 << 2) /* Starting a write erases the partition */
+#define UHID_CAP_DIGEST         (1 << 3) /* Per-page CRC32 digests */
+#define UHID_CAP_SEEK           (1 << 4) /* Address pointer can be moved */
+#define UHID_CAP_STATUS         (1 << 5) /* Reports page program time and busy state */
+#define UHID_CAP_WRITE_VERIFY   (1 << 6) /* Compares programmed pages with what it got */
+
+/*
+ * The control report follows the partition reports, e.g. it has report id
+ * 2 + numParts and is parts[0].ioSize bytes long, just like 'run' on the
+ * info report. Writes carry a command:
+ *   [cmd] [part] [arguments...]
+ * Like the address pointer, any state set this way is reset by reading
+ * the info report.
+ */
+#define UHID_CMD_STREAM_MODE    1 /* arg: one of UHID_STREAM_* below */
+/*
+ * args: first page, number of pages, both 32-bit little endian. The CRC32s
+ * of these pages are then read from the control report, as many 32-bit
+ * little endian values per report as fit.
+ */
+#define UHID_CMD_DIGEST         2
+#define UHID_CMD_SEEK           3 /* arg: 32-bit little endian offset */
+/*
+ * no args. Reads of the control report then return the device status:
+ *   [flags] [page program time, us] [time until ready, us]
+ * both times 32-bit little endian. The device answers status reads while
+ * programming.
+ */
+#define UHID_CMD_STATUS         4
+#define UHID_STATUS_BUSY        (1 << 0)
+/*
+ * arg: 1 to have every page programmed from then on compared with the data
+ * it was programmed from, which also zeroes the counters, 0 to stop. Reads
+ * of the control report then return
+ *   [pages that differ] [partition address of the first one]
+ * both 32-bit little endian.
+ */
+#define UHID_CMD_VERIFY         5
+
+#define UHID_STREAM_RAW         0
+/*
+ * Writes are a stream of frames, one per page, packed back to back into
+ * reports. Each frame is a 16-bit header followed by the data. Bit 15 set
+ * means the data is RLE (see rle.c), the other bits are the data length.
+ * Raw frames are always exactly pageSize long. The last report is padded
+ * with zeroes. That leaves 15 bits for the length, so partitions with
+ * pages over UHID_FRAME_MAX bytes are always written uncompressed.
+ */
+#define UHID_STREAM_RLE         1
+#define UHID_FRAME_RLE          0x8000
+#define UHID_FRAME_MAX          0x7fff
+
+/* Flags for uhidSetFlags() */
+#define UHID_FLAG_NO_COMPRESS   (1 << 0) /* Never use UHID_CAP_RLE */
+#define UHID_FLAG_ELIDE_BLANK   (1 << 1) /* Skip trailing erased pages with
+					    UHID_CAP_ERASE_ON_ENTRY */
+#define UHID_FLAG_READBACK      (1 << 2) /* Always verify by reading back
+					    everything */
+#define UHID_FLAG_VERIFY        (1 << 3) /* uhidWrite*() verify what they
+					    wrote, on the device if it can */
+#define UHID_FLAG_CACHE_HASH    (1 << 4) /* Cached images also need the
+					    source to hash the same */
+
+/* Directions for uhidReportCb() */
+#define UHID_REPORT_GET         0
+#define UHID_REPORT_SEND        1
+
+/* What erased flash reads as. Also the default for padding the last page */
+#define UHID_ERASED_BYTE        0xff
+
+/*
+ * Memory for the uhid*Ws() calls, which don't allocate anything. It holds
+ * the info report and a data and a control report. scratch is optional:
+ * compressed writes and page digest verification need
+ * uhidWorkspaceScratchSize() bytes of it, without it the calls fall back
+ * to plain writes and reading everything back. Either way a transfer never
+ * uses more than sizeof(struct uhidWorkspace) + UHID_SCRATCH_MAX bytes,
+ * plus a little over UHID_INFO_MAX bytes of stack.
+ */
+#define UHID_INFO_MAX           1024
+#define UHID_REPORT_MAX         4095    /* + report id, hidraw's limit on older kernels */
+#define UHID_SCRATCH_MAX        (2 * 0xffff + 2)
+
+struct uhidWorkspace {
+	unsigned char info[UHID_INFO_MAX];
+	unsigned char report[UHID_REPORT_MAX + 1];
+	unsigned char control[UHID_REPORT_MAX + 1];
+	unsigned char *scratch;
+	size_t        scratchLen;
+};
+
 #include "uhid_export_glue.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Gets the data read from a partition, see uhidReadPartCb() */
+typedef int (*uhidReadSink)(void *arg, const char *data, int len);
+
 UHID_API struct uHidDeviceInfo *uhidReadInfo(hid_device *dev);
 UHID_API hid_device *uhidOpen(struct uHidDeviceMatch *deviceMatch);
+UHID_API hid_device *uhidOpenMatching(struct uHidDeviceMatch *deviceMatch,
+				      const wchar_t *product, const wchar_t *serial,
+				      char **path);
+UHID_API hid_device *uhidOpenByPath(const char *path);
 UHID_API char *uhidReadPart(hid_device *dev, int part, int *bytes_read);
-UHID_API int uhidWritePart(hid_device *dev, int part, const char *buf, int length);
+UHID_API ssize_t uhidReadPartInto(hid_device *dev, int part, char *buf, size_t len);
+UHID_API ssize_t uhidReadPartCb(hid_device *dev, int part, size_t len,
+				uhidReadSink sink, void *arg);
+UHID_API int uhidWritePart(hid_device *dev, int part, const char *buf, size_t length);
+UHID_API int uhidReadRange(hid_device *dev, int part, uint64_t offset, uint64_t len,
+			   uhidReadSink sink, void *arg);
+UHID_API int uhidWriteRange(hid_device *dev, int part, uint64_t offset,
+			    const char *buf, size_t len);
+UHID_API int uhidGetRangeCRC(hid_device *dev, int part, uint64_t offset, uint64_t len,
+			     uint32_t *crc32);
 UHID_API void uhidClose(hid_device *dev);
 UHID_API int uhidCloseAndRun(hid_device *dev, int part);
+UHID_API int uhidRunAndWait(hid_device *dev, const char *path, int part,
+			    struct uHidDeviceMatch *deviceMatch, uint32_t timeoutMs,
+			    struct uhidReappear *r);
 UHID_API void uhidPrintInfo(hid_device *dev, struct uHidDeviceInfo *inf);
 UHID_API struct hid_device_info *uhidListDevices(struct uHidDeviceMatch *deviceMatch);
 UHID_API void uhidProgressCb(void (*cb)(const char *label, int cur, int max));
+UHID_API void uhidReportCb(void (*cb)(int dir, int part, int len, uint64_t us));
 UHID_API int uhidWritePartFromFile(hid_device *dev, int part, const char *filename);
+UHID_API int uhidWritePartFromFd(hid_device *dev, int part, int fd);
 UHID_API int uhidReadPartToFile(hid_device *dev, int part, const char *filename);
-UHID_API int uhidVerifyPart(hid_device *dev, int part, const char *buf, int len);
+UHID_API int uhidSnapshot(hid_device *dev, const char *filename);
+UHID_API int uhidRestore(hid_device *dev, const char *filename);
+UHID_API int uhidReadRangeToFile(hid_device *dev, int part, uint64_t offset, uint64_t len,
+				 const char *filename);
+UHID_API int uhidWriteRangeFromFile(hid_device *dev, int part, uint64_t offset,
+				    const char *filename);
+UHID_API int uhidVerifyPart(hid_device *dev, int part, const char *buf, size_t len);
 UHID_API int uhidVerifyPartFromFile(hid_device *dev, int part, const char *filename);
+UHID_API int uhidVerifyPartPages(hid_device *dev, int part, const char *buf, size_t len,
+				 uint32_t *bad, int maxbad);
+UHID_API int uhidGetPageDigests(hid_device *dev, int part, uint32_t first,
+				uint32_t count, uint32_t *crcs);
 UHID_API int uhidLookupPart(hid_device *dev, const char *name);
 UHID_API float uhidGetFrequencyMhz(struct uHidDeviceInfo *i);
+UHID_API uint32_t uhidGetCaps(struct uHidDeviceInfo *i);
+UHID_API uint16_t uhidGetMaxReport(struct uHidDeviceInfo *i);
+UHID_API int uhidGetStatus(hid_device *dev, uint32_t *progUs, uint32_t *busyUs);
+UHID_API void uhidSetFlags(unsigned int flags);
+UHID_API unsigned int uhidGetFlags(void);
+UHID_API void uhidSetFillByte(uint8_t fill);
+UHID_API void uhidSetHexBase(uint32_t base);
+UHID_API uint32_t uhidGetHexBase(void);
+UHID_API void uhidSetLimits(const struct uhidLimits *limits);
+UHID_API void uhidCancel(struct uhidCancel *cancel);
+UHID_API int uhidCancelled(struct uhidCancel *cancel);
+UHID_API int uhidStatusOpen(const char *path, int numSlots);
+UHID_API int uhidStatusSlots(void);
+UHID_API int uhidStatusRead(int i, struct uhidStatusSlot *out);
+UHID_API int uhidStatusBegin(hid_device *dev, const char *phase, const char *part);
+UHID_API void uhidStatusEnd(int result);
+
+UHID_API void uhidWorkspaceInit(struct uhidWorkspace *ws, void *scratch, size_t len);
+UHID_API size_t uhidWorkspaceScratchSize(struct uHidDeviceInfo *inf, int part);
+UHID_API struct uHidDeviceInfo *uhidWorkspaceInfo(struct uhidWorkspace *ws);
+UHID_API int uhidReadInfoWs(hid_device *dev, struct uhidWorkspace *ws);
+UHID_API int uhidReadRangeWs(hid_device *dev, struct uhidWorkspace *ws, int part,
+			     uint64_t offset, uint64_t len, uhidReadSink sink, void *arg);
+UHID_API int uhidWriteRangeWs(hid_device *dev, struct uhidWorkspace *ws, int part,
+			      uint64_t offset, const char *buf, size_t len);
+UHID_API int uhidVerifyPartWs(hid_device *dev, struct uhidWorkspace *ws, int part,
+			      const char *buf, size_t len);
+
+UHID_API int uhidGetTopology(const char *path, struct uhidTopology *t);
+UHID_API int uhidRunJobs(struct uhidJob *jobs, int njobs, struct uhidSchedule *sched);
+UHID_API void uhidPrintJobStats(struct uhidJob *jobs, int njobs);
+UHID_API void uhidResetXferStats(void);
+UHID_API void uhidGetXferStats(struct uhidXferStats *st);
+UHID_API uint32_t uhidXferPercentile(const struct uhidXferStats *st, int pct);
 
 UHID_API int uhidGetPartitionCRC(hid_device *dev, const char *part, uint32_t *crc32);
+
+/*
+ * Local firmware repository, see manager.c. Images are stored once, named
+ * by their SHA-256, per-device application directories only refer to them.
+ */
+#define UHID_HASH_LEN 64
+UHID_API char *uhidmgrGetAppHomeDir(const char *subdir);
+UHID_API char *uhidmgrAppDir(hid_device *dev, const char *appname);
+UHID_API struct uhidApplication *uhidmgrRepoRead(hid_device *dev);
+UHID_API int uhidmgrStorePut(const char *data, size_t len, char hash[UHID_HASH_LEN + 1]);
+UHID_API char *uhidmgrStorePath(const char *hash);
+UHID_API int uhidmgrStoreInfo(const char *hash, size_t *len, uint32_t *crc32);
+UHID_API int uhidmgrAppAdd(hid_device *dev, const char *appname, int part,
+			   const char *filename);
+UHID_API int uhidmgrAppWrite(hid_device *dev, const char *appname, int part);
 UHID_API int uhidGetPartitionCRCById(hid_device *dev, int part, uint32_t *crc32);
 
+/*
+ * Decoded images of the files uhidWritePartFromFile() and
+ * uhidVerifyPartFromFile() were given, see cache.c
+ */
+#define UHID_CACHE_DEFAULT_LIMIT (64ULL << 20)
+UHID_API void uhidSetCacheLimit(uint64_t bytes);
+UHID_API int uhidCacheClear(void);
+
+/*
+ * Performance history, see perf.c. One record per operation and device,
+ * so slow boards, ports and hubs can be told apart from their own past.
+ */
+UHID_API int uhidmgrPerfAppend(hid_device *dev, const char *path, const char *op,
+			       const char *part, const struct uhidXferStats *st,
+			       uint64_t elapsedUs);
+UHID_API int uhidmgrPerfDrift(int recent, double threshold);
+
 /* Private library stuff */
+
+/* A partition image loaded from a file */
+struct uhidImage {
+	const char   *data;
+	size_t        len;
+	char         *alloc;   /* Owned by the image, if not NULL */
+	void         *map;     /* The mapped file, if not NULL */
+	size_t        maplen;
+	const uint32_t *pageCrcs; /* Of each page, padded, if known */
+	int           truncated; /* The source didn't fit into the partition */
+};
+
+/* Partition data on its way to a file, see export.c */
+#define UHID_EXPORT_BLOCK 4096
+
+struct uhidExport {
+	FILE         *fd;
+	int           hex;
+	uint64_t      addr;    /* Of the next byte */
+	uint64_t      start;   /* Of buf[0] */
+	int           fill;
+	int           hole;    /* The last block was skipped */
+	uint32_t      upper;   /* Last extended linear address record */
+	unsigned char buf[UHID_EXPORT_BLOCK];
+};
+
+struct uhidSha256 {
+	uint32_t      h[8];
+	uint64_t      len;
+	unsigned char buf[64];
+	size_t        fill;
+};
+
 UHID_NO_EXPORT uint32_t CRC32FromBuf(uint32_t inCrc32, const void *buf,
                                        size_t bufLen );
 UHID_NO_EXPORT int CRC32FromFd( FILE *file, uint32_t *outCrc32 );
+UHID_NO_EXPORT int rleCompress(const unsigned char *in, int len,
+				 unsigned char *out, int max);
+UHID_NO_EXPORT int rleDecompress(const unsigned char *in, int len,
+				   unsigned char *out, int max);
+UHID_NO_EXPORT ssize_t elfParse(const char *filename, const unsigned char *e, size_t maplen,
+				const char *name, uint32_t size, uint8_t fill,
+				struct uhidImage *img);
+UHID_NO_EXPORT ssize_t elfLoad(int fd, const char *filename, const char *name, uint32_t size,
+			       uint8_t fill, struct uhidImage *img);
+UHID_NO_EXPORT void imageFree(struct uhidImage *img);
+UHID_NO_EXPORT int imageMapFd(int fd, struct uhidImage *img);
+UHID_NO_EXPORT int imageMapFile(const char *filename, struct uhidImage *img);
+UHID_NO_EXPORT ssize_t imageLoad(const char *filename, struct uHidDeviceInfo *inf, int part,
+				 struct uhidImage *img);
+UHID_NO_EXPORT void sha256Init(struct uhidSha256 *c);
+UHID_NO_EXPORT void sha256Update(struct uhidSha256 *c, const void *data, size_t len);
+UHID_NO_EXPORT void sha256Final(struct uhidSha256 *c, char out[UHID_HASH_LEN + 1]);
+UHID_NO_EXPORT int uhidmgrMkParents(const char *path);
+UHID_NO_EXPORT int uhidmgrWriteAtomic(const char *path, const void *data, size_t len);
+UHID_NO_EXPORT ssize_t cacheGet(const char *filename, struct uHidDeviceInfo *inf, int part,
+				uint8_t fill, struct uhidImage *img);
+UHID_NO_EXPORT void cachePut(const char *filename, struct uHidDeviceInfo *inf, int part,
+			     uint8_t fill, const char *data, uint32_t len);
+UHID_NO_EXPORT char *uhidmgrPathCacheGet(const char *serial);
+UHID_NO_EXPORT void uhidmgrPathCachePut(const char *serial, const char *path);
+UHID_NO_EXPORT int exportOpen(struct uhidExport *x, const char *filename, uint64_t offset);
+UHID_NO_EXPORT int exportSink(void *arg, const char *data, int len);
+UHID_NO_EXPORT int exportClose(struct uhidExport *x, int ret);
+UHID_NO_EXPORT int uhidDevMatches(struct hid_device_info *inf,
+				  struct uHidDeviceMatch *deviceMatch);
+UHID_NO_EXPORT int uhidLimitsCancelled(void);
+UHID_NO_EXPORT int infoParse(const unsigned char *raw, int len, unsigned char *buf,
+			     size_t bufLen);
+UHID_NO_EXPORT void statusProgress(uint64_t cur, uint64_t max);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
@@ -26,15 +26,24 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <time.h>
 #include <hidapi/hidapi.h>
 #include <libuhid.h>
+#include "uhid_probes.h"
 
 #ifdef _WIN32
-#include <malloc.h>	/* for alloca() */
+#include <io.h>		/* for _setmode() */
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY        0
 #endif
 
 
@@ -55,316 +64,1844 @@ static struct uHidDeviceMatch compatibleDevices[] = {
 };
 
 #define min_t(type, a, b) (((type)(a)<(type)(b))?(type)(a):(type)(b))
+#define max_t(type, a, b) (((type)(a)>(type)(b))?(type)(a):(type)(b))
 
 static void (*progresscb)(const char *label, int cur, int max);
+static void (*reportcb)(int dir, int part, int len, uint64_t us);
+static unsigned int flags;
+static uint8_t fillByte = UHID_ERASED_BYTE;
+static uint32_t hexBase;
+
+/* Transfers made by this thread, see uhidGetXferStats() */
+static __thread struct uhidXferStats xferStats;
+
+/*
+ * Page program time of the device being written (UHID_CAP_STATUS) and when
+ * it will be done with the pages sent so far
+ */
+static __thread uint32_t progUs;
+static __thread uint64_t busyUntil;
+
+/* See uhidSetLimits(), deadline is in nowUs() time */
+static __thread struct uhidLimits limits;
+static __thread uint64_t deadline;
 
 #define REPORT_ID_RUN  0
 #define REPORT_ID_INFO 1
 #define REPORT_ID_PART(n) (2 + n)
+#define REPORT_ID_CONTROL(inf) REPORT_ID_PART((inf)->numParts)
 
 void UHID_API uhidProgressCb(void (*cb)(const char *label, int cur, int max))
 {
 	progresscb = cb;
 }
 
-static void show_progress(const char *label, int cur, int max)
+/**
+ * Have cb called after every feature report transfer with its direction
+ * (UHID_REPORT_GET or UHID_REPORT_SEND), partition (-1 for info/control),
+ * length and how long it took. Meant for benchmarking.
+ */
+UHID_API void uhidReportCb(void (*cb)(int dir, int part, int len, uint64_t us))
+{
+	reportcb = cb;
+}
+
+UHID_API void uhidSetFlags(unsigned int f)
+{
+	flags = f;
+}
+
+UHID_API unsigned int uhidGetFlags(void)
+{
+	return flags;
+}
+
+UHID_API void uhidSetFillByte(uint8_t fill)
+{
+	fillByte = fill;
+}
+
+/*
+ * Intel HEX address of the start of every partition, e.g. 0x08000000 for
+ * STM32 flash. Records below it are an error. 0 by default.
+ */
+UHID_API void uhidSetHexBase(uint32_t base)
+{
+	hexBase = base;
+}
+
+UHID_API uint32_t uhidGetHexBase(void)
+{
+	return hexBase;
+}
+
+/* Copy len bytes of the image at pos, padding past its end with fillByte */
+static void copyPadded(unsigned char *dst, const char *buf, size_t length,
+		       uint32_t pos, int len)
+{
+	int avail = (pos < length) ? min_t(size_t, len, length - pos) : 0;
+
+	memcpy(dst, &buf[pos], avail);
+	memset(&dst[avail], fillByte, len - avail);
+}
+
+static void show_progress(const char *label, uint64_t cur, uint64_t max)
 {
+	statusProgress(cur, max);
+	/* The callback takes ints, scale huge partitions down to fit */
+	while (max > INT_MAX) {
+		cur >>= 1;
+		max >>= 1;
+	}
 	if (progresscb)
 		progresscb(label, cur, max);
 }
 
-static int  parseUntilColon(FILE *fp)
+static uint64_t nowUs(void)
 {
-	int c;
-
-	do {
-		c = getc(fp);
-	} while(c != ':' && c != EOF);
-	return c;
+	struct timespec tv;
+	clock_gettime(CLOCK_MONOTONIC, &tv);
+	return tv.tv_sec * 1000000ULL + tv.tv_nsec / 1000;
 }
 
-static int  parseHex(FILE *fp, int numDigits)
+/**
+ * Limit how long the operations of the calling thread may take from now
+ * on, or make them cancellable. The timeout covers everything done until
+ * the next call, not each operation. NULL removes all limits.
+ */
+UHID_API void uhidSetLimits(const struct uhidLimits *l)
 {
-	int     i;
-	char    temp[9];
+	if (l)
+		limits = *l;
+	else
+		memset(&limits, 0, sizeof(limits));
+	deadline = limits.timeoutMs ? nowUs() + limits.timeoutMs * 1000ULL : 0;
+}
 
-	for(i = 0; i < numDigits; i++)
-		temp[i] = getc(fp);
-	temp[i] = 0;
-	return strtol(temp, NULL, 16);
+/* Safe to call from a signal handler */
+UHID_API void uhidCancel(struct uhidCancel *cancel)
+{
+	__atomic_store_n(&cancel->cancelled, 1, __ATOMIC_RELEASE);
 }
 
-static ssize_t  parseIntelHex(const char *hexfile, char *buffer, int *startAddr, int *endAddr)
+UHID_API int uhidCancelled(struct uhidCancel *cancel)
 {
-	ssize_t     address, base, d, segment, i, lineLen, sum;
-	ssize_t maxAddress = 0;
+	return cancel && __atomic_load_n(&cancel->cancelled, __ATOMIC_ACQUIRE);
+}
 
-	FILE    *input;
+/* For waits outside of transfers, see hotplug.c */
+UHID_NO_EXPORT int uhidLimitsCancelled(void)
+{
+	return uhidCancelled(limits.cancel);
+}
 
-	input = fopen(hexfile, "r");
-	if(input == NULL) {
-		fprintf(stderr, "error opening %s: %s\n", hexfile, strerror(errno));
-		return -1;
+/* Checked before every report, so a hung operation ends at the next one */
+static int xferLimit(void)
+{
+	if (uhidCancelled(limits.cancel)) {
+		fprintf(stderr, "Cancelled\n");
+		return -ECANCELED;
+	}
+	if (deadline && nowUs() >= deadline) {
+		fprintf(stderr, "Timed out\n");
+		return -ETIMEDOUT;
 	}
+	return 0;
+}
 
-	while(parseUntilColon(input) == ':') {
-		sum = 0;
-		sum += lineLen = parseHex(input, 2);
-		base = address = parseHex(input, 4);
-		sum += address >> 8;
-		sum += address;
-		sum += segment = parseHex(input, 2);  /* segment value? */
-		if(segment != 0)    /* ignore lines where this byte is not 0 */
-			continue;
-		for(i = 0; i < lineLen ; i++) {
-			d = parseHex(input, 2);
-			if (buffer)
-				buffer[address] = d;
-			address++;
-			if (address > maxAddress)
-				maxAddress = address;
-			sum += d;
-		}
-		sum += parseHex(input, 2);
-		if((sum & 0xff) != 0) {
-			fprintf(stderr, "Warning: Checksum error between address 0x%zx and 0x%zx\n", base, address);
-		}
-		if(*startAddr > base)
-			*startAddr = base;
-		if(*endAddr < address)
-			*endAddr = address;
+/*
+ * hidapi can't abort a feature report, the USB stack gives up on it after
+ * a few seconds at most. A device that needs longer than reportTimeoutMs
+ * to answer is treated as hung, even if it did answer in the end.
+ */
+static int xferDone(int ret, uint64_t us)
+{
+	if (limits.reportTimeoutMs && us > limits.reportTimeoutMs * 1000ULL) {
+		fprintf(stderr, "Report took %llu ms, giving up\n",
+			(unsigned long long) us / 1000);
+		return -ETIMEDOUT;
 	}
-	fclose(input);
-	return maxAddress;
+	return ret;
+}
+
+/* Failed transfers are -EIO, unless a limit stopped them */
+static int xferError(hid_device *dev, const char *what, int ret)
+{
+	if (ret == -ETIMEDOUT || ret == -ECANCELED)
+		return ret;
+	printf("%s failed: %ls\n", what, hid_error(dev));
+	return -EIO;
 }
 
+/* The device started programming pages pages */
+static void paceStart(int pages)
+{
+	uint64_t now;
+
+	if (!progUs || !pages)
+		return;
+	now = nowUs();
+	if (busyUntil < now)
+		busyUntil = now;
+	busyUntil += (uint64_t) pages * progUs;
+}
+
+/*
+ * Sleep until the device is done programming rather than having the next
+ * transfer stall or get NAKed for who knows how long
+ */
+static void paceWait(void)
+{
+	uint64_t now, wake = busyUntil;
+
+	if (!busyUntil)
+		return;
+	/* No point in sleeping past the deadline */
+	if (deadline && deadline < wake)
+		wake = deadline;
+	now = nowUs();
+	if (now < wake)
+		usleep(wake - now);
+	busyUntil = 0;
+}
+
+/*
+ * Latency histogram bucket: exact below 8us, then 4 buckets per power of
+ * two, so anything read off it is within 25%
+ */
+static int latBucket(uint64_t us)
+{
+	int o = 0;
+
+	if (us < 8)
+		return us;
+	while ((us >> o) > 1)
+		o++;
+	return min_t(int, 4 * (o - 1) + ((us >> (o - 2)) & 3), UHID_LAT_BUCKETS - 1);
+}
+
+static uint64_t latBucketStart(int i)
+{
+	if (i < 8)
+		return i;
+	return (uint64_t) (4 + (i & 3)) << (i / 4 - 1);
+}
+
+static void xferAccount(int ret, uint64_t us)
+{
+	if (ret > 0)
+		xferStats.bytes += ret;
+	else
+		xferStats.errors++;
+	xferStats.reports++;
+	xferStats.us += us;
+	xferStats.latency[latBucket(us)]++;
+}
+
+/*
+ * All feature report traffic goes through these two, so that the probes
+ * see every single transfer. part is -1 for the info report.
+ */
+static int getReport(hid_device *dev, unsigned char *buf, size_t len,
+		     int part, uint32_t offset)
+{
+	int ret;
+
+	paceWait();
+	ret = xferLimit();
+	if (ret)
+		return ret;
+	UHID_PROBE3(report__get__start, part, offset, len);
+	uint64_t start = nowUs();
+	ret = hid_get_feature_report(dev, buf, len);
+	uint64_t us = nowUs() - start;
+	ret = xferDone(ret, us);
+	if (reportcb)
+		reportcb(UHID_REPORT_GET, part, len, us);
+	UHID_PROBE4(report__get__done, part, offset, len, ret);
+	xferAccount(ret, us);
+	return ret;
+}
+
+static int sendReport(hid_device *dev, const unsigned char *buf, size_t len,
+		      int part, uint32_t offset)
+{
+	int ret;
+
+	paceWait();
+	ret = xferLimit();
+	if (ret)
+		return ret;
+	UHID_PROBE3(report__send__start, part, offset, len);
+	uint64_t start = nowUs();
+	ret = hid_send_feature_report(dev, buf, len);
+	uint64_t us = nowUs() - start;
+	ret = xferDone(ret, us);
+	if (reportcb)
+		reportcb(UHID_REPORT_SEND, part, len, us);
+	UHID_PROBE4(report__send__done, part, offset, len, ret);
+	xferAccount(ret, us);
+	return ret;
+}
+
+/* Start counting the transfers of the calling thread from zero */
+UHID_API void uhidResetXferStats(void)
+{
+	memset(&xferStats, 0, sizeof(xferStats));
+}
+
+/* Transfers made by the calling thread since uhidResetXferStats() */
+UHID_API void uhidGetXferStats(struct uhidXferStats *st)
+{
+	*st = xferStats;
+}
 
 /**
- * Reads the information struct from the device. The caller must free the
- * struct obtained.
- *
- * @param dev
+ * Per report latency below which pct percent of the reports in st were.
+ * Precise to about 25%, see latBucket().
  *
- * @return
+ * @return microseconds, 0 if there were no reports
  */
-UHID_API struct uHidDeviceInfo *uhidReadInfo(hid_device *dev)
+UHID_API uint32_t uhidXferPercentile(const struct uhidXferStats *st, int pct)
 {
-	int len = 255;
+	uint64_t want = ((uint64_t) st->reports * pct + 99) / 100;
+	uint64_t seen = 0;
 	int i;
-	char *tmp = calloc(len, 1);
-
-	if (!tmp)
-		goto error;
 
-	tmp[0] = REPORT_ID_INFO;
-	len = hid_get_feature_report(dev, (unsigned char *)tmp, len);
-	if (len < 0) {
-		fprintf(stderr, "Error reading info struct: %ls\n", hid_error(dev));
-		goto error;
+	for (i = 0; i < UHID_LAT_BUCKETS && want; i++) {
+		seen += st->latency[i];
+		if (seen >= want)
+			return latBucketStart(i + 1) - 1;
 	}
-	struct uHidDeviceInfo *inf = (struct uHidDeviceInfo *) tmp;
+	return 0;
+}
 
+enum {
+	IMAGE_BINARY = 0,
+	IMAGE_IHEX,
+	IMAGE_ELF,
+};
 
-	/* Sanity checking and force strings end with zeroes just in case */
-	if ((len < sizeof(struct uHidDeviceInfo)) ||
-	    (len < sizeof(struct uHidDeviceInfo) + inf->numParts * sizeof(struct uHidPartInfo))) {
-		fprintf(stderr, "Short-read on uHidDeviceInfo - bad bootloader version?\n");
-		fprintf(stderr, "Expected %ld bytes, got %d bytes (%ld + %d * %ld)\n",
-			(long) sizeof(struct uHidDeviceInfo) + inf->numParts * sizeof(struct uHidPartInfo),
-			len,
-			(long) sizeof(struct uHidDeviceInfo), inf->numParts, (long) sizeof(struct uHidPartInfo));
-		//exit(1);
-	}
+/* How much is looked at to tell binary, Intel HEX and ELF apart */
+#define SOURCE_PEEK     64
+/* Read buffer of file sources, allocated so the Ws calls stay small */
+#define SOURCE_IN       4096
 
-	for (i=0; i<inf->numParts; i++) {
-		inf->parts[i].name[UISP_PART_NAME_LEN -1] = 0;
+/*
+ * An image that is still coming in. Data lands in a partition sized buffer
+ * as it is read, so writing can start while a pipe is still delivering.
+ * Memory buffers and ELF files are loaded in one go and start out at eof,
+ * only sources read from a file have an input buffer.
+ */
+struct uhidSource {
+	const char *name;
+	int fd;
+	int format;
+	int eof;
+	int err;
+	int truncated;
+	struct uhidImage img;
+	uint32_t offset;	/* Where in the partition the image goes */
+	uint32_t size;		/* Room from there on, nothing past it is kept */
+	uint32_t cap;		/* Of img.alloc */
+	uint32_t len;		/* End of the image, as far as we know yet */
+	uint32_t ready;		/* Bytes below this won't change anymore */
+	uint32_t used;		/* Bytes below this may have been written */
+	int verified;		/* The device compared what it programmed */
+	uint32_t startAddr;	/* Intel HEX only */
+	uint32_t endAddr;
+	uint32_t hexUpper;
+	int hexData;
+	int inPos;
+	int inLen;
+	unsigned char *in;	/* SOURCE_IN bytes */
+};
+
+static int sourceFill(struct uhidSource *src)
+{
+	ssize_t ret;
+
+	do {
+		ret = read(src->fd, src->in, SOURCE_IN);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) {
+		src->err = -errno;
+		fprintf(stderr, "error reading %s: %s\n", src->name, strerror(errno));
+		return src->err;
 	}
+	src->inPos = 0;
+	src->inLen = ret;
+	return ret;
+}
 
-	return inf;
-error:
-	if (tmp)
-		free(tmp);
-	return NULL;
+static int sourceGetc(struct uhidSource *src)
+{
+	if (src->inPos == src->inLen && sourceFill(src) <= 0)
+		return EOF;
+	return src->in[src->inPos++];
+}
+
+static int  parseUntilColon(struct uhidSource *src)
+{
+	int c;
 
+	do {
+		c = sourceGetc(src);
+	} while(c != ':' && c != EOF);
+	return c;
 }
 
+static int  parseHex(struct uhidSource *src, int numDigits)
+{
+	int     i, c;
+	char    temp[9];
 
-static int hidDevMatch(struct hid_device_info *inf,
-											struct uHidDeviceMatch *deviceMatch)
+	for(i = 0; i < numDigits; i++) {
+		c = sourceGetc(src);
+		if (c == EOF)
+			return -1;
+		temp[i] = c;
+	}
+	temp[i] = 0;
+	return strtol(temp, NULL, 16);
+}
+
+static int detectFormat(const unsigned char *p, int n)
 {
-	/*
-	fprintf(stderr, "check: 0x%x:0x%x m:%ls p:%ls s:%ls\n",
-		inf->vendor_id, inf->product_id,
-		inf->manufacturer_string,
-		inf->product_string,
-		inf->serial_number
-	);
-	fprintf(stderr, "against: 0x%x:0x%x m:%ls p:%ls s:%ls\n",
-		deviceMatch->vendor, deviceMatch->product,
-		deviceMatch->vendorName,
-		deviceMatch->productName,
-		deviceMatch->serialNumber
-	);
-	*/
+	int i = 0;
+
+	if (n >= 4 && memcmp(p, "\177ELF", 4) == 0)
+		return IMAGE_ELF;
+	while (i < n && isspace(p[i]))
+		i++;
+	if (i == n || p[i] != ':')
+		return IMAGE_BINARY;
+	for (; i < n; i++)
+		if (!isxdigit(p[i]) && !isspace(p[i]) && p[i] != ':')
+			return IMAGE_BINARY;
+	return IMAGE_IHEX;
+}
+
+static int sourceDone(struct uhidSource *src)
+{
+	src->eof = 1;
+	src->ready = src->len;
+	if (src->truncated)
+		printf("WARN: %s is too big for the partition, truncated to %u bytes!\n",
+		       src->name, src->size);
+	if (src->format == IMAGE_IHEX) {
+		printf("Start addr 0x%x end addr 0x%x\n", src->startAddr, src->endAddr);
+		UHID_PROBE2(ihex__done, src->name, src->len);
+	}
+	return 0;
+}
 
+/* The buffer grows with the image, not the partition, which may be huge */
+static int sourceGrow(struct uhidSource *src, uint32_t want)
+{
+	uint32_t cap = src->cap ? src->cap : 65536;
+	char *tmp;
 
-	if (inf->vendor_id != deviceMatch->vendor)
+	if (want <= src->cap)
 		return 0;
+	while (cap < want && cap < src->size)
+		cap = (cap > src->size / 2) ? src->size : cap * 2;
+	cap = min_t(uint32_t, cap, src->size);
+	tmp = realloc(src->img.alloc, cap);
+	if (!tmp)
+		return -ENOMEM;
+	memset(&tmp[src->cap], fillByte, cap - src->cap);
+	src->img.alloc = tmp;
+	src->img.data = tmp;
+	src->cap = cap;
+	return 0;
+}
 
-	if (inf->product_id != deviceMatch->product)
+/*
+ * Reads one Intel HEX record. Addresses, extended ones (record types 2 and
+ * 4) included, are absolute: hexBase is the start of the partition and the
+ * source begins src->offset bytes into it.
+ */
+static int hexMore(struct uhidSource *src)
+{
+	int d, segment, i, lineLen, sum, offset;
+	uint32_t address, base;
+	uint64_t abs;
+
+	if (parseUntilColon(src) != ':')
+		return src->err ? src->err : sourceDone(src);
+
+	sum = 0;
+	sum += lineLen = parseHex(src, 2);
+	sum += (offset = parseHex(src, 4)) >> 8;
+	sum += offset;
+	sum += segment = parseHex(src, 2);  /* record type */
+	if (lineLen < 0 || offset < 0 || segment < 0) {
+		fprintf(stderr, "Warning: %s ends in the middle of a record\n", src->name);
+		return src->err ? src->err : sourceDone(src);
+	}
+	if (segment == 2 || segment == 4) {
+		uint32_t upper = parseHex(src, 4);
+		src->hexUpper = upper << ((segment == 2) ? 4 : 16);
 		return 0;
-
-	if (deviceMatch->vendorName && !inf->manufacturer_string)
+	}
+	if(segment != 0)    /* ignore the rest */
 		return 0;
+	abs = (uint64_t) src->hexUpper + offset;
+	if (abs < (uint64_t) hexBase + src->offset) {
+		fprintf(stderr, "%s: record at 0x%llx is below 0x%llx, where the image starts\n",
+			src->name, (unsigned long long) abs,
+			(unsigned long long) hexBase + src->offset);
+		return -EINVAL;
+	}
+	base = address = min_t(uint64_t, abs - hexBase - src->offset, UINT32_MAX - 0xff);
+	if (!src->hexData && base >= src->size) {
+		fprintf(stderr, "%s: first record at 0x%llx is past the end of the partition, "
+			"is the Intel HEX base address (0x%x) right?\n",
+			src->name, (unsigned long long) abs, hexBase);
+		return -EINVAL;
+	}
+	src->hexData = 1;
+	if (base < src->used) {
+		fprintf(stderr, "%s: record at 0x%x comes after 0x%x was written, "
+			"can't stream out of order Intel HEX\n", src->name, base, src->used);
+		return -EINVAL;
+	}
+	if (base < src->size && sourceGrow(src, min_t(uint64_t, (uint64_t) base + lineLen,
+						      src->size)))
+		return -ENOMEM;
+	for(i = 0; i < lineLen ; i++) {
+		d = parseHex(src, 2);
+		if (address < src->size)
+			src->img.alloc[address] = d;
+		else
+			src->truncated = 1;
+		address++;
+		sum += d;
+	}
+	sum += parseHex(src, 2);
+	if((sum & 0xff) != 0) {
+		fprintf(stderr, "Warning: Checksum error between address 0x%x and 0x%x\n", base, address);
+	}
+	if(src->startAddr > base)
+		src->startAddr = base;
+	if(src->endAddr < address)
+		src->endAddr = address;
+	if (src->len < address)
+		src->len = min_t(uint32_t, address, src->size);
+	/* Records come in ascending order, anything before this one is done */
+	if (src->ready < base)
+		src->ready = min_t(uint32_t, base, src->len);
+	return 0;
+}
 
-	if (deviceMatch->vendorName &&
-			(wcscmp(inf->manufacturer_string, deviceMatch->vendorName)!=0))
-			return 0;
+static int binMore(struct uhidSource *src)
+{
+	int n;
 
-	if (deviceMatch->productName && !inf->product_string)
-		return 0;
+	if (src->inPos == src->inLen) {
+		n = sourceFill(src);
+		if (n <= 0)
+			return n ? n : sourceDone(src);
+	}
+	if (src->len == src->size) {
+		src->truncated = 1;
+		return sourceDone(src);
+	}
+	n = min_t(uint32_t, src->inLen - src->inPos, src->size - src->len);
+	if (sourceGrow(src, src->len + n))
+		return -ENOMEM;
+	memcpy(&src->img.alloc[src->len], &src->in[src->inPos], n);
+	src->inPos += n;
+	src->len += n;
+	src->ready = src->len;
+	return 0;
+}
 
-	if (deviceMatch->productName &&
-			(wcscmp(inf->product_string, deviceMatch->productName)!=0))
-			return 0;
+static int sourceRead(struct uhidSource *src, uint64_t want)
+{
+	int ret;
 
-	if (deviceMatch->serialNumber && !inf->serial_number)
-		return 0;
+	while (!src->eof && src->ready < want) {
+		ret = (src->format == IMAGE_IHEX) ? hexMore(src) : binMore(src);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
 
-	if (deviceMatch->serialNumber &&
-  		(wcscmp(inf->serial_number, deviceMatch->serialNumber)!=0))
-			return 0;
+/* Blocks until bytes up to want are final or the input has ended */
+static int sourceNeed(struct uhidSource *src, uint64_t want)
+{
+	int ret = sourceRead(src, want);
 
-	return 1;
+	if (!ret && src->used < want)
+		src->used = min_t(uint64_t, want, src->size);
+	return ret;
 }
 
+/*
+ * ELF needs random access, so the whole thing is read first. A regular file
+ * read from its start is mapped instead, through the fd as it may be stdin.
+ */
+static int sourceLoadElf(struct uhidSource *src, int regular, const char *name)
+{
+	size_t len = src->inLen, max = 65536;
+	unsigned char *raw;
+	ssize_t ret;
+
+	printf("Input file detected as ELF\n");
+	if (regular && lseek(src->fd, 0, SEEK_CUR) == (off_t) src->inLen) {
+		ret = elfLoad(src->fd, src->name, name, src->size, fillByte, &src->img);
+		goto done;
+	}
 
-/**
- * Returns a linked list of compatible uHID devices found on the system
- *
- * If deviceMatch is NULL uHID will search for devices based on a built-in table
- * of compatible devices
- *
- * @param deviceMatch Should be an array of suitable matches terminated
- * by an all-zero element.
- *
- * @return device instance or NULL on error
+	raw = malloc(max);
+
+	if (!raw)
+		return -ENOMEM;
+	memcpy(raw, src->in, len);
+	while (1) {
+		if (len == max) {
+			unsigned char *tmp = realloc(raw, max * 2);
+			if (!tmp) {
+				free(raw);
+				return -ENOMEM;
+			}
+			raw = tmp;
+			max *= 2;
+		}
+		do {
+			ret = read(src->fd, &raw[len], max - len);
+		} while (ret < 0 && errno == EINTR);
+		if (ret < 0) {
+			ret = -errno;
+			fprintf(stderr, "error reading %s: %s\n", src->name, strerror(errno));
+			free(raw);
+			return ret;
+		}
+		if (!ret)
+			break;
+		len += ret;
+	}
+
+	ret = elfParse(src->name, raw, len, name, src->size, fillByte, &src->img);
+	/* The image may point right into raw, then raw is what we keep */
+	if (ret > 0 && src->img.data != src->img.alloc)
+		src->img.alloc = (char *) raw;
+	else
+		free(raw);
+done:
+	if (ret < 0)
+		return ret;
+	src->truncated = src->img.truncated;
+	src->len = src->ready = src->img.len;
+	src->eof = 1;
+	return 0;
+}
+
+/*
+ * Starts reading the image for partition part from fd. It goes offset bytes
+ * into the partition. The format is told by the contents. Regular files are
+ * read completely right away, anything else is read as the writer gets to
+ * it.
  */
-UHID_API struct hid_device_info *uhidListDevices(struct uHidDeviceMatch *deviceMatch)
+static int sourceOpen(struct uhidSource *src, int fd, const char *name,
+		      struct uHidDeviceInfo *inf, int part, uint32_t offset)
+{
+	char pname[UISP_PART_NAME_LEN + 1];
+	struct stat st;
+	ssize_t ret;
+	int regular;
+
+	memset(src, 0, sizeof(*src));
+	src->in = malloc(SOURCE_IN);
+	if (!src->in)
+		return -ENOMEM;
+	src->fd = fd;
+	src->name = name;
+	src->offset = offset;
+	src->size = inf->parts[part].size - offset;
+	src->startAddr = UINT32_MAX;
+	snprintf(pname, sizeof(pname), "%.*s", UISP_PART_NAME_LEN, (char *) inf->parts[part].name);
+	regular = (fstat(fd, &st) == 0) && S_ISREG(st.st_mode);
+
+	while (src->inLen < SOURCE_PEEK) {
+		do {
+			ret = read(fd, &src->in[src->inLen], SOURCE_IN - src->inLen);
+		} while (ret < 0 && errno == EINTR);
+		if (ret < 0) {
+			fprintf(stderr, "error reading %s: %s\n", name, strerror(errno));
+			return -EIO;
+		}
+		if (!ret)
+			break;
+		src->inLen += ret;
+	}
+	if (!src->inLen) {
+		fprintf(stderr, "%s is empty\n", name);
+		return -EINVAL;
+	}
+
+	src->format = detectFormat(src->in, src->inLen);
+	if (src->format == IMAGE_ELF && offset) {
+		fprintf(stderr, "%s: ELF files say where they go, an offset makes no sense\n", name);
+		return -EINVAL;
+	}
+	if (src->format == IMAGE_ELF)
+		return sourceLoadElf(src, regular, pname);
+
+	if (src->format == IMAGE_IHEX) {
+		printf("Input file detected as Intel Hex\n");
+		if (hexBase)
+			printf("Intel HEX address 0x%x is the start of the partition\n", hexBase);
+		UHID_PROBE1(ihex__start, name);
+	} else {
+		printf("Input file detected as binary\n");
+	}
+
+	if (!regular)
+		return 0;
+	/* Out of order Intel HEX is fine as long as nothing was written yet */
+	return sourceRead(src, (uint64_t) src->size + 1);
+}
+
+static void sourceClose(struct uhidSource *src)
+{
+	free(src->in);
+	src->in = NULL;
+	imageFree(&src->img);
+}
+
+static int openInput(const char *filename)
+{
+	int fd;
+
+	if (strcmp(filename, "-") == 0) {
+#ifdef _WIN32
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+		return STDIN_FILENO;
+	}
+	fd = open(filename, O_RDONLY | O_BINARY);
+	if (fd < 0) {
+		fd = -errno;
+		fprintf(stderr, "error opening %s: %s\n", filename, strerror(-fd));
+	}
+	return fd;
+}
+
+static void closeInput(int fd)
 {
-	/* TODO: Implement */
-	return NULL;
+	if (fd != STDIN_FILENO)
+		close(fd);
+}
+
+/* The file behind filename, NULL for stdin which has no name to go by */
+static const char *inputPath(const char *filename)
+{
+	return strcmp(filename, "-") ? filename : NULL;
+}
+
+
+/*
+ * Turns an info report of any version into the version 3 layout in buf,
+ * which has room for bufLen bytes. Older reports have 8-bit ioSizes and no
+ * max report hint, see struct uHidPartInfoV1.
+ * Returns 0 or -EOPNOTSUPP.
+ */
+UHID_NO_EXPORT int infoParse(const unsigned char *raw, int len, unsigned char *buf,
+			     size_t bufLen)
+{
+	const struct uHidDeviceInfo *r = (const struct uHidDeviceInfo *) raw;
+	struct uHidDeviceInfo *inf = (struct uHidDeviceInfo *) buf;
+	size_t partLen = (r->version >= 3) ? sizeof(struct uHidPartInfo) :
+		sizeof(struct uHidPartInfoV1);
+	size_t tail = (r->version >= 3) ? 6 : (r->version >= 2) ? 4 : 0;
+	size_t expect = sizeof(*r) + r->numParts * partLen + tail;
+	int i;
+
+	/* Sanity checking, raw is zero-padded so a short read just gets zeroes */
+	if (len < expect) {
+		fprintf(stderr, "Short-read on uHidDeviceInfo - bad bootloader version?\n");
+		fprintf(stderr, "Expected %ld bytes, got %d bytes (%ld + %d * %ld + %ld)\n",
+			(long) expect, len, (long) sizeof(*r), r->numParts, (long) partLen,
+			(long) tail);
+		//exit(1);
+	}
+	if (sizeof(*inf) + r->numParts * sizeof(struct uHidPartInfo) + 6 > bufLen) {
+		fprintf(stderr, "%d partitions are too many for libuhid\n", r->numParts);
+		return -EOPNOTSUPP;
+	}
+
+	memset(buf, 0, bufLen);
+	memcpy(inf, r, sizeof(*r));
+	if (r->version >= 3) {
+		memcpy(inf->parts, r->parts, r->numParts * partLen + tail);
+	} else {
+		const struct uHidPartInfoV1 *p = (const struct uHidPartInfoV1 *) &raw[sizeof(*r)];
+
+		for (i = 0; i < r->numParts; i++) {
+			inf->parts[i].pageSize = p[i].pageSize;
+			inf->parts[i].size = p[i].size;
+			inf->parts[i].ioSize = p[i].ioSize;
+			memcpy(inf->parts[i].name, p[i].name, UISP_PART_NAME_LEN);
+		}
+		memcpy(&inf->parts[r->numParts], &p[r->numParts], tail);
+	}
+
+	/* Force strings end with zeroes just in case */
+	for (i = 0; i < inf->numParts; i++) {
+		inf->parts[i].name[UISP_PART_NAME_LEN - 1] = 0;
+		if (inf->parts[i].ioSize > UHID_REPORT_MAX) {
+			fprintf(stderr, "The device uses %d byte reports, libuhid can do %d at most\n",
+				inf->parts[i].ioSize, UHID_REPORT_MAX);
+			return -EOPNOTSUPP;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Reads the info report into buf, which has room for len bytes.
+ * Returns 0 or -errno.
+ */
+static int readInfoInto(hid_device *dev, unsigned char *buf, int len)
+{
+	unsigned char raw[UHID_INFO_MAX];
+	int ret;
+
+	memset(raw, 0, sizeof(raw));
+	UHID_PROBE1(info__start, sizeof(raw) - 1);
+	raw[0] = REPORT_ID_INFO;
+	ret = getReport(dev, raw, sizeof(raw) - 1, -1, 0);
+	UHID_PROBE1(info__done, ret);
+	if (ret == -ETIMEDOUT || ret == -ECANCELED)
+		return ret;
+	if (ret < 0) {
+		fprintf(stderr, "Error reading info struct: %ls\n", hid_error(dev));
+		return -EIO;
+	}
+	return infoParse(raw, ret, buf, len);
+}
+
+/**
+ * Reads the information struct from the device. The caller must free the
+ * struct obtained.
+ *
+ * @param dev
+ *
+ * @return
+ */
+UHID_API struct uHidDeviceInfo *uhidReadInfo(hid_device *dev)
+{
+	unsigned char *tmp = malloc(UHID_INFO_MAX);
+
+	if (tmp && readInfoInto(dev, tmp, UHID_INFO_MAX)) {
+		free(tmp);
+		tmp = NULL;
+	}
+	return (struct uHidDeviceInfo *) tmp;
+}
+
+/**
+ * Sets up a workspace for the uhid*Ws() calls. scratch may be NULL, see
+ * struct uhidWorkspace.
+ */
+UHID_API void uhidWorkspaceInit(struct uhidWorkspace *ws, void *scratch, size_t len)
+{
+	memset(ws, 0, sizeof(*ws));
+	ws->scratch = scratch;
+	ws->scratchLen = scratch ? len : 0;
+}
+
+/**
+ * Scratch space the fast paths need for partition part, never more than
+ * UHID_SCRATCH_MAX.
+ */
+UHID_API size_t uhidWorkspaceScratchSize(struct uHidDeviceInfo *inf, int part)
+{
+	size_t pageSize = inf->parts[part].pageSize;
+	size_t ioSize = inf->parts[part].ioSize;
+
+	/* A page and its frame for RLE writes, a page plus a report to verify */
+	return max_t(size_t, 2 * pageSize + 2, pageSize + ioSize);
+}
+
+/* The info report last read into ws */
+UHID_API struct uHidDeviceInfo *uhidWorkspaceInfo(struct uhidWorkspace *ws)
+{
+	return (struct uHidDeviceInfo *) ws->info;
+}
+
+/**
+ * Reads the info report into ws, e.g. to find out how much scratch space
+ * to give it. Every other uhid*Ws() call does this by itself.
+ *
+ * @return 0 or -EIO
+ */
+UHID_API int uhidReadInfoWs(hid_device *dev, struct uhidWorkspace *ws)
+{
+	return readInfoInto(dev, ws->info, sizeof(ws->info));
+}
+
+/* Reads the info report into ws and checks that part exists */
+static int wsReadInfo(hid_device *dev, struct uhidWorkspace *ws, int part)
+{
+	int ret = uhidReadInfoWs(dev, ws);
+
+	if (!ret && ((part < 0) || (part >= uhidWorkspaceInfo(ws)->numParts)))
+		ret = -ENOENT;
+	return ret;
+}
+
+/*
+ * The convenience calls keep the workspace on the stack and only allocate
+ * the scratch space.
+ */
+static int wsOpen(hid_device *dev, struct uhidWorkspace *ws, int part)
+{
+	size_t len;
+	int ret;
+
+	uhidWorkspaceInit(ws, NULL, 0);
+	ret = wsReadInfo(dev, ws, part);
+	if (ret)
+		return ret;
+	len = uhidWorkspaceScratchSize(uhidWorkspaceInfo(ws), part);
+	ws->scratch = malloc(len);
+	if (!ws->scratch)
+		return -ENOMEM;
+	ws->scratchLen = len;
+	return 0;
+}
+
+static void wsClose(struct uhidWorkspace *ws)
+{
+	free(ws->scratch);
+	ws->scratch = NULL;
+	ws->scratchLen = 0;
+}
+
+
+static int hidDevMatch(struct hid_device_info *inf,
+											struct uHidDeviceMatch *deviceMatch)
+{
+	/*
+	fprintf(stderr, "check: 0x%x:0x%x m:%ls p:%ls s:%ls\n",
+		inf->vendor_id, inf->product_id,
+		inf->manufacturer_string,
+		inf->product_string,
+		inf->serial_number
+	);
+	fprintf(stderr, "against: 0x%x:0x%x m:%ls p:%ls s:%ls\n",
+		deviceMatch->vendor, deviceMatch->product,
+		deviceMatch->vendorName,
+		deviceMatch->productName,
+		deviceMatch->serialNumber
+	);
+	*/
+
+
+	if (inf->vendor_id != deviceMatch->vendor)
+		return 0;
+
+	if (inf->product_id != deviceMatch->product)
+		return 0;
+
+	if (deviceMatch->vendorName && !inf->manufacturer_string)
+		return 0;
+
+	if (deviceMatch->vendorName &&
+			(wcscmp(inf->manufacturer_string, deviceMatch->vendorName)!=0))
+			return 0;
+
+	if (deviceMatch->productName && !inf->product_string)
+		return 0;
+
+	if (deviceMatch->productName &&
+			(wcscmp(inf->product_string, deviceMatch->productName)!=0))
+			return 0;
+
+	if (deviceMatch->serialNumber && !inf->serial_number)
+		return 0;
+
+	if (deviceMatch->serialNumber &&
+  		(wcscmp(inf->serial_number, deviceMatch->serialNumber)!=0))
+			return 0;
+
+	return 1;
+}
+
+
+/* Check a device against a table of matches */
+static int hidDevMatchAny(struct hid_device_info *inf,
+			  struct uHidDeviceMatch *deviceMatch)
+{
+	if (!deviceMatch)
+		deviceMatch = compatibleDevices;
+
+	while (deviceMatch->vendor) {
+		if (hidDevMatch(inf, deviceMatch))
+			return 1;
+		deviceMatch++;
+	}
+	return 0;
+}
+
+UHID_NO_EXPORT int uhidDevMatches(struct hid_device_info *inf,
+				  struct uHidDeviceMatch *deviceMatch)
+{
+	return hidDevMatchAny(inf, deviceMatch);
+}
+
+/**
+ * Returns a linked list of compatible uHID devices found on the system,
+ * to be freed with hid_free_enumeration()
+ *
+ * If deviceMatch is NULL uHID will search for devices based on a built-in table
+ * of compatible devices
+ *
+ * @param deviceMatch Should be an array of suitable matches terminated
+ * by an all-zero element.
+ *
+ * @return device instance or NULL on error
+ */
+UHID_API struct hid_device_info *uhidListDevices(struct uHidDeviceMatch *deviceMatch)
+{
+	struct hid_device_info *inf = hid_enumerate(0, 0);
+	struct hid_device_info *ret = NULL;
+	struct hid_device_info **tail = &ret;
+
+	while (inf) {
+		struct hid_device_info *next = inf->next;
+		inf->next = NULL;
+		if (hidDevMatchAny(inf, deviceMatch)) {
+			*tail = inf;
+			tail = &inf->next;
+		} else {
+			hid_free_enumeration(inf);
+		}
+		inf = next;
+	}
+	return ret;
+}
+
+/* Open a device by its hidapi path, e.g. hid_device_info->path */
+UHID_API hid_device *uhidOpenByPath(const char *path)
+{
+		return hid_open_path(path);
+}
+
+/* Whether inf is a device uhidOpenMatching() is looking for */
+static int wantedDevice(struct hid_device_info *inf, const wchar_t *product,
+			const wchar_t *serial)
+{
+	if (product && (!inf->product_string || wcscmp(inf->product_string, product)))
+		return 0;
+	if (serial && (!inf->serial_number || wcscmp(inf->serial_number, serial)))
+		return 0;
+	return 1;
+}
+
+/*
+ * The last path of the board with this serial, if it still leads there.
+ * Some other device may have got the path since, so it's looked up among
+ * the devices with the VID/PID pairs of deviceMatch, which only enumerates
+ * those.
+ */
+static hid_device *openCached(struct uHidDeviceMatch *deviceMatch, const char *mserial,
+			      const wchar_t *product, const wchar_t *serial, char **path)
+{
+	char *cached = uhidmgrPathCacheGet(mserial);
+	struct hid_device_info *list, *inf;
+	hid_device *dev = NULL;
+	int found = 0;
+
+	if (!cached)
+		return NULL;
+	if (!deviceMatch)
+		deviceMatch = compatibleDevices;
+	for (; deviceMatch->vendor && !found; deviceMatch++) {
+		list = hid_enumerate(deviceMatch->vendor, deviceMatch->product);
+		for (inf = list; inf && !found; inf = inf->next)
+			found = strcmp(inf->path, cached) == 0 && hidDevMatch(inf, deviceMatch) &&
+				wantedDevice(inf, product, serial);
+		hid_free_enumeration(list);
+	}
+	if (found)
+		dev = hid_open_path(cached);
+	if (dev && path)
+		*path = cached;
+	else
+		free(cached);
+	return dev;
+}
+
+/**
+ * Open the first device that matches deviceMatch (see uhidOpen()) and, if
+ * they are not NULL, has this product name and serial number. Where a board
+ * opened by serial number was found is remembered in the application
+ * directory, so opening it again only enumerates all HID devices if it
+ * moved. path, if not NULL, gets that path, to be freed by the caller.
+ *
+ * @return device instance or NULL on error
+ */
+UHID_API hid_device *uhidOpenMatching(struct uHidDeviceMatch *deviceMatch,
+				      const wchar_t *product, const wchar_t *serial,
+				      char **path)
+{
+	struct hid_device_info *list, *inf;
+	hid_device *dev = NULL;
+	char mserial[128];
+
+	if (path)
+		*path = NULL;
+	mserial[0] = 0;
+	if (serial && wcstombs(mserial, serial, sizeof(mserial) - 1) == (size_t) -1)
+		mserial[0] = 0;
+	mserial[sizeof(mserial) - 1] = 0;
+	if (mserial[0]) {
+		dev = openCached(deviceMatch, mserial, product, serial, path);
+		if (dev)
+			return dev;
+	}
+
+	list = uhidListDevices(deviceMatch);
+	for (inf = list; inf; inf = inf->next)
+		if (wantedDevice(inf, product, serial))
+			break;
+
+	if (inf) {
+		dev = hid_open_path(inf->path);
+		if (!dev)
+			fprintf(stderr, "Failed to open a uHID device (Permissions problem?)\n");
+	}
+	if (dev && mserial[0])
+		uhidmgrPathCachePut(mserial, inf->path);
+	if (dev && path)
+		*path = strdup(inf->path);
+	hid_free_enumeration(list);
+	return dev;
+}
+
+/**
+ * Open a uHID device. if @deviceMatch table is supplied uHid will find
+ * a device described there.
+ *
+ * if  is NULL uHID will search for devices based on a built-in table
+ *
+ * @param deviceMatch Should be an array of suitable matches terminated
+ * by an all-zero element.
+ *
+ * @return device instance or NULL on error
+ */
+UHID_API hid_device *uhidOpen(struct uHidDeviceMatch *deviceMatch)
+{
+	return uhidOpenMatching(deviceMatch, NULL, NULL, NULL);
+}
+
+
+static int seekPart(hid_device *dev, struct uhidWorkspace *ws, int part,
+		    uint32_t offset);
+
+/*
+ * Reads len bytes of a partition from offset on and hands them to sink in
+ * report sized chunks. Devices without UHID_CAP_SEEK are read from the start
+ * and everything before offset is thrown away. The address pointer must have
+ * been reset by reading the info report into ws just before. The range must
+ * be within the partition. Returns 0 or -errno.
+ */
+static int readPartCb(hid_device *dev, struct uhidWorkspace *ws, int part,
+		      uint32_t offset, uint32_t len, uhidReadSink sink, void *arg)
+{
+	uint32_t ioSize = uhidWorkspaceInfo(ws)->parts[part].ioSize;
+	unsigned char *xferbuf = ws->report;
+	uint64_t end = (uint64_t) offset + len;
+	uint64_t pos = 0;
+
+	if (offset && seekPart(dev, ws, part, offset) == 0)
+		pos = offset;
+
+	UHID_PROBE3(read__start, part, offset, len);
+	while (pos < end) {
+		uint32_t skip = (pos < offset) ? min_t(uint64_t, offset - pos, ioSize) : 0;
+		/* Account for the extra report byte */
+		int ret = ioSize+1;
+		xferbuf[0] = REPORT_ID_PART(part);
+		ret = getReport(dev, xferbuf, ret, part, pos);
+		if (ret < 0) {
+			ret = xferError(dev, "hid_get_feature_report", ret);
+			UHID_PROBE4(read__done, part, offset, pos - offset, ret);
+			return ret;
+		}
+		if (skip < ioSize) {
+			ret = sink(arg, (char *) &xferbuf[1 + skip],
+				   min_t(uint64_t, ioSize - skip, end - pos - skip));
+			if (ret < 0) {
+				UHID_PROBE4(read__done, part, offset, pos - offset, ret);
+				return ret;
+			}
+		}
+		pos +=ioSize;
+		if (pos > offset)
+			show_progress("Reading", pos - offset, len);
+	}
+
+	UHID_PROBE4(read__done, part, offset, len, 0);
+	show_progress("Reading", len, len);
+	return 0;
+}
+
+static int copySink(void *arg, const char *data, int len)
+{
+	char **dst = arg;
+
+	memcpy(*dst, data, len);
+	*dst += len;
+	return 0;
+}
+
+/* Ranges can't go past the end of the partition */
+static int checkRange(struct uHidDeviceInfo *inf, int part, uint64_t offset, uint64_t len)
+{
+	uint32_t size = inf->parts[part].size;
+
+	if (offset > size || len > size - offset)
+		return -ERANGE;
+	return 0;
+}
+
+/**
+ * Pass len bytes of a partition starting at offset to sink, see
+ * uhidReadRange(). Nothing is allocated, ws is all the memory needed.
+ *
+ * @return 0, -ERANGE if the range doesn't fit the partition or -errno
+ */
+UHID_API int uhidReadRangeWs(hid_device *dev, struct uhidWorkspace *ws, int part,
+			     uint64_t offset, uint64_t len, uhidReadSink sink, void *arg)
+{
+	int ret = wsReadInfo(dev, ws, part);
+
+	if (!ret)
+		ret = checkRange(uhidWorkspaceInfo(ws), part, offset, len);
+	if (!ret)
+		ret = readPartCb(dev, ws, part, offset, len, sink, arg);
+	return ret;
+}
+
+/**
+ * Read the first len bytes of a partition, or all of it if it's smaller,
+ * into buf.
+ *
+ * @return the number of bytes read or -errno
+ */
+UHID_API ssize_t uhidReadPartInto(hid_device *dev, int part, char *buf, size_t len)
+{
+	struct uhidWorkspace ws;
+	int ret;
+
+	uhidWorkspaceInit(&ws, NULL, 0);
+	ret = wsReadInfo(dev, &ws, part);
+	if (ret)
+		return ret;
+	len = min_t(uint64_t, len, uhidWorkspaceInfo(&ws)->parts[part].size);
+	ret = readPartCb(dev, &ws, part, 0, len, copySink, &buf);
+	return ret ? ret : (ssize_t) len;
+}
+
+/**
+ * Like uhidReadPartInto(), but the data is passed to sink as it arrives
+ * instead. A negative return value from sink aborts the transfer and is
+ * returned as is.
+ */
+UHID_API ssize_t uhidReadPartCb(hid_device *dev, int part, size_t len,
+				uhidReadSink sink, void *arg)
+{
+	struct uhidWorkspace ws;
+	int ret;
+
+	uhidWorkspaceInit(&ws, NULL, 0);
+	ret = wsReadInfo(dev, &ws, part);
+	if (ret)
+		return ret;
+	len = min_t(uint64_t, len, uhidWorkspaceInfo(&ws)->parts[part].size);
+	ret = readPartCb(dev, &ws, part, 0, len, sink, arg);
+	return ret ? ret : (ssize_t) len;
+}
+
+/**
+ * Pass len bytes of a partition starting at offset to sink, see
+ * uhidReadPartCb(). Only the part of the partition that is asked for is
+ * transferred if the device has UHID_CAP_SEEK.
+ *
+ * @return 0, -ERANGE if the range doesn't fit the partition or -errno
+ */
+UHID_API int uhidReadRange(hid_device *dev, int part, uint64_t offset, uint64_t len,
+			   uhidReadSink sink, void *arg)
+{
+	struct uhidWorkspace ws;
+
+	uhidWorkspaceInit(&ws, NULL, 0);
+	return uhidReadRangeWs(dev, &ws, part, offset, len, sink, arg);
+}
+
+/**
+ * Read a partition to a character buffer. Returns a pointer to the allocated buffer or NULL.
+ * If the buffer
+ *
+ * @param dev
+ * @param part
+ * @param bytes_read
+ *
+ * @return
+ */
+UHID_API char *uhidReadPart(hid_device *dev, int part, int *bytes_read)
+{
+	struct uhidWorkspace ws;
+	uint32_t len;
+	char *buf, *dst;
+
+	uhidWorkspaceInit(&ws, NULL, 0);
+	if (wsReadInfo(dev, &ws, part))
+		return NULL;
+	len = uhidWorkspaceInfo(&ws)->parts[part].size;
+	if (len > INT_MAX)
+		return NULL;
+
+	buf = dst = malloc(len + 1);
+	if (!buf)
+		return NULL;
+	if (readPartCb(dev, &ws, part, 0, len, copySink, &dst) < 0) {
+		free(buf);
+		return NULL;
+	}
+	if (bytes_read)
+		*bytes_read = len;
+	return buf;
+}
+
+UHID_API uint32_t uhidGetCaps(struct uHidDeviceInfo *i)
+{
+	uint32_t caps;
+
+	if (i->version < 2)
+		return 0;
+	memcpy(&caps, &i->parts[i->numParts], sizeof(caps));
+	return caps;
+}
+
+/*
+ * The longest report the device handles. Devices before info version 3
+ * don't say, their partition reports are the longest there is.
+ */
+UHID_API uint16_t uhidGetMaxReport(struct uHidDeviceInfo *i)
+{
+	uint16_t max = 0;
+	int n;
+
+	if (i->version >= 3) {
+		memcpy(&max, (unsigned char *) &i->parts[i->numParts] + 4, sizeof(max));
+		if (max)
+			return max;
+	}
+	for (n = 0; n < i->numParts; n++)
+		if (i->parts[n].ioSize > max)
+			max = i->parts[n].ioSize;
+	return max;
+}
+
+static int sendControl(hid_device *dev, struct uhidWorkspace *ws, int cmd,
+		       int part, const void *arg, int arglen)
+{
+	struct uHidDeviceInfo *inf = uhidWorkspaceInfo(ws);
+	int ioSize = inf->parts[0].ioSize;
+	unsigned char *tmp = ws->control;
+	int ret;
+
+	if (!(uhidGetCaps(inf) & UHID_CAP_CONTROL) || (arglen + 2 > ioSize))
+		return -EOPNOTSUPP;
+
+	memset(tmp, 0, ioSize + 1);
+	tmp[0] = REPORT_ID_CONTROL(inf);
+	tmp[1] = cmd;
+	tmp[2] = part;
+	if (arglen)
+		memcpy(&tmp[3], arg, arglen);
+	ret = sendReport(dev, tmp, ioSize + 1, -1, 0);
+	if (ret < 0)
+		return xferError(dev, "hid_send_feature_report", ret);
+	return 0;
+}
+
+/*
+ * Reads a response from the control report into ws->control,
+ * parts[0].ioSize bytes + report id
+ */
+static int recvControl(hid_device *dev, struct uhidWorkspace *ws)
+{
+	struct uHidDeviceInfo *inf = uhidWorkspaceInfo(ws);
+	int ioSize = inf->parts[0].ioSize;
+	unsigned char *buf = ws->control;
+	int ret;
+
+	buf[0] = REPORT_ID_CONTROL(inf);
+	ret = getReport(dev, buf, ioSize + 1, -1, 0);
+	if (ret < 0)
+		return xferError(dev, "hid_get_feature_report", ret);
+	return 0;
+}
+
+static void put32le(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t get32le(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/* Moves the address pointer, needs UHID_CAP_SEEK */
+static int seekPart(hid_device *dev, struct uhidWorkspace *ws, int part,
+		    uint32_t offset)
+{
+	unsigned char arg[4];
+
+	if (!(uhidGetCaps(uhidWorkspaceInfo(ws)) & UHID_CAP_SEEK))
+		return -EOPNOTSUPP;
+	put32le(arg, offset);
+	return sendControl(dev, ws, UHID_CMD_SEEK, part, arg, sizeof(arg));
+}
+
+static int getPageDigests(hid_device *dev, struct uhidWorkspace *ws, int part,
+			  uint32_t first, uint32_t count, uint32_t *crcs)
+{
+	struct uHidDeviceInfo *inf = uhidWorkspaceInfo(ws);
+	int ioSize = inf->parts[0].ioSize;
+	int perReport = ioSize / 4;
+	unsigned char arg[8];
+	unsigned char *tmp = ws->control;
+	uint32_t i = 0;
+	int ret;
+
+	if (!(uhidGetCaps(inf) & UHID_CAP_DIGEST) || !perReport)
+		return -EOPNOTSUPP;
+
+	put32le(&arg[0], first);
+	put32le(&arg[4], count);
+	ret = sendControl(dev, ws, UHID_CMD_DIGEST, part, arg, sizeof(arg));
+	if (ret)
+		return ret;
+
+	while (i < count) {
+		int j;
+		ret = recvControl(dev, ws);
+		if (ret)
+			return ret;
+		for (j = 0; j < perReport && i < count; j++, i++)
+			crcs[i] = get32le(&tmp[1 + j * 4]);
+	}
+	return 0;
+}
+
+/**
+ * Fetch CRC32 digests of count pages starting at page first. Needs a device
+ * with UHID_CAP_DIGEST.
+ *
+ * @return 0 on success, -EOPNOTSUPP if the device can't do it, -errno otherwise
+ */
+UHID_API int uhidGetPageDigests(hid_device *dev, int part, uint32_t first,
+				uint32_t count, uint32_t *crcs)
+{
+	struct uhidWorkspace ws;
+	int ret;
+
+	uhidWorkspaceInit(&ws, NULL, 0);
+	ret = wsReadInfo(dev, &ws, part);
+	if (!ret)
+		ret = getPageDigests(dev, &ws, part, first, count, crcs);
+	return ret;
+}
+
+static int readStatus(hid_device *dev, struct uhidWorkspace *ws,
+		      uint32_t *prog, uint32_t *left)
+{
+	struct uHidDeviceInfo *inf = uhidWorkspaceInfo(ws);
+	unsigned char *tmp = ws->control;
+	int ret;
+
+	if (!(uhidGetCaps(inf) & UHID_CAP_STATUS) || inf->parts[0].ioSize < 9)
+		return -EOPNOTSUPP;
+	ret = sendControl(dev, ws, UHID_CMD_STATUS, 0, NULL, 0);
+	if (!ret)
+		ret = recvControl(dev, ws);
+	if (ret)
+		return ret;
+	if (prog)
+		*prog = get32le(&tmp[2]);
+	if (left)
+		*left = get32le(&tmp[6]);
+	return tmp[1];
+}
+
+/**
+ * Query a device with UHID_CAP_STATUS.
+ *
+ * @return UHID_STATUS_* flags, -EOPNOTSUPP if the device can't tell or -errno
+ */
+UHID_API int uhidGetStatus(hid_device *dev, uint32_t *progUs, uint32_t *busyUs)
+{
+	struct uhidWorkspace ws;
+	int ret;
+
+	uhidWorkspaceInit(&ws, NULL, 0);
+	ret = uhidReadInfoWs(dev, &ws);
+	if (!ret)
+		ret = readStatus(dev, &ws, progUs, busyUs);
+	return ret;
+}
+
+static int pageErased(const char *buf, size_t length, uint32_t pos, int pageSize)
+{
+	int i;
+
+	for (i = 0; i < pageSize; i++) {
+		uint8_t c = (pos + i < length) ? buf[pos + i] : fillByte;
+		if (c != UHID_ERASED_BYTE)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Number of bytes of an image that actually go to the partition when
+ * written at offset: clipped to the partition size and rounded up to a
+ * page. If the device erases the partition when a write starts,
+ * UHID_FLAG_ELIDE_BLANK also drops trailing pages that are erased anyway.
+ * The first page is always written, since that's what triggers the erase.
+ */
+static uint32_t imageLength(struct uHidDeviceInfo *inf, int part, uint32_t offset,
+			    const char *buf, size_t length)
+{
+	uint32_t pageSize = inf->parts[part].pageSize;
+	uint32_t size = min_t(uint64_t, inf->parts[part].size - offset, length);
+
+	if (size % pageSize)
+		size += pageSize - (size % pageSize);
+
+	if (offset || !(flags & UHID_FLAG_ELIDE_BLANK) ||
+	    !(uhidGetCaps(inf) & UHID_CAP_ERASE_ON_ENTRY))
+		return size;
+
+	while ((size > pageSize) && pageErased(buf, length, size - pageSize, pageSize))
+		size -= pageSize;
+
+	return size;
+}
+
+/*
+ * Makes sure the n bytes at pos are loaded. Once the end of the input shows
+ * up, *size goes from the whole partition down to what has to be written.
+ */
+static int sourceNext(struct uhidSource *src, struct uHidDeviceInfo *inf, int part,
+		      uint64_t pos, int n, uint32_t *size)
+{
+	int eof = src->eof;
+	int ret = sourceNeed(src, pos + n);
+
+	if (!ret && src->eof && !eof)
+		*size = imageLength(inf, part, src->offset, src->img.data, src->len);
+	return ret;
+}
+
+/* Packs frames of the compressed write stream into reports */
+struct frameStream {
+	hid_device *dev;
+	int part;
+	int ioSize;
+	unsigned char *report;
+	int fill;
+	uint64_t pos;
+	int reports;
+	int pending;	/* Frames that end in report */
+	uint32_t offset;
+};
+
+static int streamFlush(struct frameStream *s)
+{
+	int ret;
+
+	if (!s->fill)
+		return 0;
+
+	memset(&s->report[1 + s->fill], 0, s->ioSize - s->fill);
+	s->report[0] = REPORT_ID_PART(s->part);
+	ret = sendReport(s->dev, s->report, s->ioSize + 1, s->part, s->offset + s->pos);
+	if (ret < 0)
+		return xferError(s->dev, "hid_send_feature_report", ret);
+	s->fill = 0;
+	s->reports++;
+	paceStart(s->pending);
+	s->pending = 0;
+	return 0;
 }
 
-UHID_API hid_device *uhidOpenByPath(const char *path)
+static int streamPut(struct frameStream *s, const unsigned char *data, int len)
 {
-		return hid_open_path(path);
+	while (len) {
+		int n = min_t(int, len, s->ioSize - s->fill);
+		memcpy(&s->report[1 + s->fill], data, n);
+		s->fill += n;
+		data += n;
+		len -= n;
+		if (s->fill == s->ioSize) {
+			int ret = streamFlush(s);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
 }
 
-/**
- * Open a uHID device. if @deviceMatch table is supplied uHid will find
- * a device described there.
- *
- * if  is NULL uHID will search for devices based on a built-in table
- *
- * @param deviceMatch Should be an array of suitable matches terminated
- * by an all-zero element.
- *
- * @return device instance or NULL on error
+/*
+ * Same as the plain write loop in uhidWritePart(), but every page goes out as
+ * a frame of the UHID_STREAM_RLE stream and is compressed when that makes it
+ * smaller. size is already rounded up to pageSize. Needs 2 * pageSize + 2
+ * bytes of scratch space.
  */
-UHID_API hid_device *uhidOpen(struct uHidDeviceMatch *deviceMatch)
+static int writePartRle(hid_device *dev, struct uhidWorkspace *ws, int part,
+			struct uhidSource *src, uint32_t *size)
 {
-	hid_device *dev = NULL;
-
-	if (!deviceMatch)
-		deviceMatch = compatibleDevices;
-
-	struct hid_device_info *inf_list = hid_enumerate(0, 0);
-	struct hid_device_info *inf = inf_list;
-	struct hid_device_info *found = NULL;
+	struct uHidDeviceInfo *inf = uhidWorkspaceInfo(ws);
+	int pageSize = inf->parts[part].pageSize;
+	int ioSize = inf->parts[part].ioSize;
+	uint8_t mode = UHID_STREAM_RLE;
+	int ret;
+	int packed = 0;
+	struct frameStream s = {
+		.dev = dev,
+		.part = part,
+		.ioSize = ioSize,
+		.offset = src->offset,
+		.report = ws->report,
+	};
+	unsigned char *page = ws->scratch;
+	unsigned char *frame = &ws->scratch[pageSize];
 
-	while (inf) {
-		struct uHidDeviceMatch *tmp = deviceMatch;
-		while (tmp->vendor) {
-			if (hidDevMatch(inf, tmp)) {
-				found = inf;
-				break;
-			}
+	ret = sendControl(dev, ws, UHID_CMD_STREAM_MODE, part, &mode, sizeof(mode));
+	if (ret)
+		return ret;
 
-			if (found)
-				break;
+	while (s.pos < *size) {
+		uint16_t hdr;
+		int clen;
 
-			tmp++;
+		ret = sourceNext(src, inf, part, s.pos, pageSize, size);
+		if (ret)
+			return ret;
+		if (s.pos >= *size)
+			break;
+		copyPadded(page, src->img.data, src->len, s.pos, pageSize);
+
+		clen = rleCompress(page, pageSize, &frame[2], pageSize - 1);
+		if (clen > 0) {
+			hdr = UHID_FRAME_RLE | clen;
+			packed++;
+		} else {
+			hdr = clen = pageSize;
+			memcpy(&frame[2], page, pageSize);
 		}
-		inf = inf->next;
-	};
+		frame[0] = hdr & 0xff;
+		frame[1] = hdr >> 8;
+
+		ret = streamPut(&s, frame, clen + 2);
+		if (ret)
+			return ret;
+		/* The device programs the page once it has the whole frame */
+		if (s.fill)
+			s.pending++;
+		else
+			paceStart(1);
+
+		s.pos += pageSize;
+		show_progress("Writing", s.pos, *size);
+	}
+	ret = streamFlush(&s);
 
-	if (!found)
-		goto bailout;
+	printf("Compressed %d/%d pages, %d reports instead of %d\n",
+	       packed, (int) (*size / pageSize), s.reports, (int) ((*size + ioSize - 1) / ioSize));
+	return ret;
+}
 
-	dev = hid_open_path(found->path);
-	if (!dev)
-		fprintf(stderr, "Failed to open a uHID device (Permissions problem?)\n");
+/*
+ * Writing anywhere but at the start needs a seek, and a device that doesn't
+ * wipe the whole partition when the write begins.
+ */
+static int seekForWrite(hid_device *dev, struct uhidWorkspace *ws, int part,
+			uint32_t offset)
+{
+	struct uHidDeviceInfo *inf = uhidWorkspaceInfo(ws);
 
-bailout:
-	hid_free_enumeration(inf_list);
-	return dev;
+	if (!offset)
+		return 0;
+	if (offset % inf->parts[part].pageSize) {
+		fprintf(stderr, "Write offset 0x%x is not on a page boundary\n", offset);
+		return -EINVAL;
+	}
+	if (uhidGetCaps(inf) & UHID_CAP_ERASE_ON_ENTRY) {
+		fprintf(stderr, "The device erases the partition when a write starts, "
+			"can't write at an offset\n");
+		return -EOPNOTSUPP;
+	}
+	return seekPart(dev, ws, part, offset);
 }
 
-
-/**
- * Read a partition to a character buffer. Returns a pointer to the allocated buffer or NULL.
- * If the buffer
- *
- * @param dev
- * @param part
- * @param bytes_read
- *
- * @return
+/*
+ * Writes src to the partition, as fast as it comes in. Until the input ends
+ * the image is taken to be as big as the room it has. The stream is only
+ * compressed if ws has the scratch space for it.
  */
-UHID_API char *uhidReadPart(hid_device *dev, int part, int *bytes_read)
+static int writeStream(hid_device *dev, struct uhidWorkspace *ws, int part,
+		       struct uhidSource *src)
 {
-	struct uHidDeviceInfo *inf = uhidReadInfo(dev);
-	if (!inf)
-		return NULL;
-	if (part < 0)
-		return NULL;
-	if (part > inf->numParts)
-		return NULL;
+	struct uHidDeviceInfo *inf = uhidWorkspaceInfo(ws);
+	unsigned char *destbuf = ws->report;
+	int ret=0;
+	int ioSize = inf->parts[part].ioSize;
+	int pageSize = inf->parts[part].pageSize;
+	uint32_t size = inf->parts[part].size - src->offset;
 
-	uint32_t size = inf->parts[part].size;
-	uint32_t ioSize = inf->parts[part].ioSize;
-	unsigned char *tmp = malloc(size);
-	if (!tmp)
-		goto errfreeinf;
-	unsigned char *xferbuf = alloca(ioSize + 1);
+	if (src->eof)
+		size = imageLength(inf, part, src->offset, src->img.data, src->len);
+	else if (size % pageSize)
+		size += pageSize - (size % pageSize);
+
+	ret = seekForWrite(dev, ws, part, src->offset);
+	if (ret)
+		return ret;
+
+	progUs = 0;
+	if (readStatus(dev, ws, &progUs, NULL) >= 0)
+		printf("Page program time: %u us\n", progUs);
+
+	/* Bigger pages don't fit the frame header, see UHID_STREAM_RLE */
+	if ((uhidGetCaps(inf) & UHID_CAP_RLE) && !(flags & UHID_FLAG_NO_COMPRESS) &&
+	    pageSize <= UHID_FRAME_MAX && (ws->scratchLen >= 2 * pageSize + 2)) {
+		UHID_PROBE3(write__start, part, src->offset, size);
+		ret = writePartRle(dev, ws, part, src, &size);
+		paceWait();
+		progUs = 0;
+		UHID_PROBE4(write__done, part, src->offset, size, ret);
+		if (!ret)
+			show_progress("Writing", size, size);
+		return ret;
+	}
 
-	int pos = 0;
+	UHID_PROBE3(write__start, part, src->offset, size);
+	uint64_t pos = 0;
 	while (pos < size) {
-		/* Account for the extra report byte */
-		int len = ioSize+1;
-		xferbuf[0] = REPORT_ID_PART(part);
-		len = hid_get_feature_report(dev, xferbuf, len);
+		int len = ioSize;
+
+		ret = sourceNext(src, inf, part, pos, len, &size);
+		if (ret || pos >= size)
+			break;
+
+		destbuf[0] = REPORT_ID_PART(part);
+		copyPadded(&destbuf[1], src->img.data, src->len, pos, len);
+
+		len = sendReport(dev, destbuf, len+1, part, src->offset + pos);
 		if (len < 0) {
-			printf("hid_get_feature_report failed: %ls \n", hid_error(dev));
-			goto errfreetmp;
+			ret = xferError(dev, "hid_send_feature_report", len);
+			break;
 		}
-		memcpy(&tmp[pos], &xferbuf[1], ioSize);
-		pos +=ioSize;
-		show_progress("Reading", pos, size);
+
+		paceStart((pos + ioSize) / pageSize - pos / pageSize);
+		pos += ioSize;
+		show_progress("Writing", pos, size);
 	}
+	paceWait();
+	progUs = 0;
+	UHID_PROBE4(write__done, part, src->offset, pos, ret);
 
-	if (bytes_read)
-		*bytes_read = pos;
-	free(inf);
-	show_progress("Reading", size, size);
-	return (char *) tmp;
-errfreetmp:
-	free(tmp);
-errfreeinf:
-	free(inf);
-	return NULL;
+	if (!ret)
+		show_progress("Writing", size, size);
+	return ret;
+}
+
+/*
+ * Is UHID_FLAG_VERIFY better done by the device? Not if it can't, or if the
+ * user wants to see it read back.
+ */
+static int deviceVerifies(struct uHidDeviceInfo *inf)
+{
+	return (flags & UHID_FLAG_VERIFY) && !(flags & UHID_FLAG_READBACK) &&
+		(uhidGetCaps(inf) & UHID_CAP_WRITE_VERIFY) && inf->parts[0].ioSize >= 8;
+}
+
+/* Stops UHID_CMD_VERIFY and checks its counters, returns 1 if a page differs */
+static int deviceVerifyResult(hid_device *dev, struct uhidWorkspace *ws, int part)
+{
+	unsigned char off = 0;
+	uint32_t failed, first;
+	int ret;
+
+	ret = sendControl(dev, ws, UHID_CMD_VERIFY, part, &off, 1);
+	if (!ret)
+		ret = recvControl(dev, ws);
+	if (ret)
+		return ret;
+	failed = get32le(&ws->control[1]);
+	first = get32le(&ws->control[5]);
+	if (failed) {
+		printf("%u pages differ after programming, the first at 0x%x\n", failed, first);
+		return 1;
+	}
+	printf("Verified by the device\n");
+	return 0;
+}
 
+/*
+ * writeStream() that has the device compare every page it programs, if
+ * UHID_FLAG_VERIFY asks for it. One status read at the end then replaces
+ * reading everything back, see verifyWritten().
+ */
+static int writeSource(hid_device *dev, struct uhidWorkspace *ws, int part,
+		       struct uhidSource *src)
+{
+	unsigned char on = 1;
+	int ret;
+
+	src->verified = 0;
+	if (!deviceVerifies(uhidWorkspaceInfo(ws)))
+		return writeStream(dev, ws, part, src);
+
+	ret = sendControl(dev, ws, UHID_CMD_VERIFY, part, &on, 1);
+	if (!ret)
+		ret = writeStream(dev, ws, part, src);
+	if (!ret)
+		ret = deviceVerifyResult(dev, ws, part);
+	src->verified = !ret;
+	return ret;
+}
+
+static int verifyWritten(hid_device *dev, struct uhidWorkspace *ws, int part,
+			 struct uhidSource *src);
+
+/* Wraps a buffer in an uhidSource that has all of it already */
+static void sourceFromBuffer(struct uhidSource *src, const char *buf, size_t length,
+			     struct uHidDeviceInfo *inf, int part, uint32_t offset)
+{
+	memset(src, 0, sizeof(*src));
+	src->name = "buffer";
+	src->eof = 1;
+	src->img.data = buf;
+	src->offset = offset;
+	src->size = inf->parts[part].size - offset;
+	src->len = src->ready = min_t(uint64_t, length, src->size);
 }
 
 /**
@@ -375,55 +1912,83 @@ errfreeinf:
  * @param buf
  * @param length
  *
- * @return
+ * @return 0, 1 if UHID_FLAG_VERIFY is set and the partition doesn't match
+ * or -errno
  */
-UHID_API int uhidWritePart(hid_device *dev, int part, const char *buf, int length)
+UHID_API int uhidWritePart(hid_device *dev, int part, const char *buf, size_t length)
 {
-	int ret=0;
-	struct uHidDeviceInfo *inf = uhidReadInfo(dev);
-	if (!inf)
-		return -ENOENT;
-	if (part < 0)
-		return -ENOENT;
-	if (part > inf->numParts)
-		return -ENOENT;
+	int ret;
+	struct uhidSource src;
+	struct uhidWorkspace ws;
+	struct uHidDeviceInfo *inf = uhidWorkspaceInfo(&ws);
 
-	int pageSize = inf->parts[part].pageSize;
-	int ioSize = inf->parts[part].ioSize;
-	uint32_t size = inf->parts[part].size;
-	if (length > size) {
+	ret = wsOpen(dev, &ws, part);
+	if (ret)
+		goto bailout;
+
+	if (length > inf->parts[part].size) {
 		printf("WARNING: Input file buffer exceeds the target partition size\n");
 		printf("WARNING: The data will be truncated\n");
 	}
 
-	size = min_t(uint32_t, size, length);
-
-	if (size % pageSize)
-		size += pageSize - (size % pageSize);
-
-	char *destbuf = calloc(1, ioSize+1);
-
-	int pos = 0;
-	while (pos < size) {
-		int len = ioSize;
-
-		destbuf[0] = REPORT_ID_PART(part);
-		memcpy(&destbuf[1], &buf[pos], len);
-
-		len = hid_send_feature_report(dev, (unsigned char*) destbuf, len+1);
-		if (len < 0) {
-			printf("hid_send_feature_report failed: %ls\n", hid_error(dev));
-			ret = -EIO;
-			break;
-		}
+	sourceFromBuffer(&src, buf, length, inf, part, 0);
+	ret = writeSource(dev, &ws, part, &src);
+	if (!ret)
+		ret = verifyWritten(dev, &ws, part, &src);
+bailout:
+	wsClose(&ws);
+	return ret;
+}
 
-		pos += ioSize;
-		show_progress("Writing", pos, size);
+/**
+ * Write len bytes from buf to the partition, starting at offset. offset
+ * has to be on a page boundary and, unless it's 0, the device needs
+ * UHID_CAP_SEEK and must not have UHID_CAP_ERASE_ON_ENTRY. The rest of the
+ * last page is filled with the fill byte.
+ *
+ * @return 0, 1 if UHID_FLAG_VERIFY is set and the range doesn't match,
+ * -ERANGE if the range doesn't fit the partition or -errno
+ */
+UHID_API int uhidWriteRange(hid_device *dev, int part, uint64_t offset,
+			    const char *buf, size_t len)
+{
+	int ret;
+	struct uhidSource src;
+	struct uhidWorkspace ws;
+	struct uHidDeviceInfo *inf = uhidWorkspaceInfo(&ws);
+
+	ret = wsOpen(dev, &ws, part);
+	if (!ret)
+		ret = checkRange(inf, part, offset, len);
+	if (!ret) {
+		sourceFromBuffer(&src, buf, len, inf, part, offset);
+		ret = writeSource(dev, &ws, part, &src);
 	}
+	if (!ret)
+		ret = verifyWritten(dev, &ws, part, &src);
+	wsClose(&ws);
+	return ret;
+}
 
-	free(inf);
-	free(destbuf);
-	show_progress("Writing", size, size);
+/**
+ * uhidWriteRange() that uses nothing but ws, see struct uhidWorkspace.
+ */
+UHID_API int uhidWriteRangeWs(hid_device *dev, struct uhidWorkspace *ws, int part,
+			      uint64_t offset, const char *buf, size_t len)
+{
+	int ret;
+	struct uhidSource src;
+	struct uHidDeviceInfo *inf = uhidWorkspaceInfo(ws);
+
+	ret = wsReadInfo(dev, ws, part);
+	if (!ret)
+		ret = checkRange(inf, part, offset, len);
+	if (!ret) {
+		sourceFromBuffer(&src, buf, len, inf, part, offset);
+		ret = writeSource(dev, ws, part, &src);
+	}
+	if (!ret)
+		ret = verifyWritten(dev, ws, part, &src);
 	return ret;
 }
 
@@ -449,140 +2014,368 @@ UHID_API float uhidGetFrequencyMhz(struct uHidDeviceInfo *i)
 	return (i->cpuFreq / 100.0);
 }
 
-UHID_API int uhidVerifyPart(hid_device *dev, int part, const char *buf, int len)
+/* Page digests are fetched this many at a time, so memory use stays flat */
+#define DIGEST_BATCH    256
+
+/*
+ * Compare page digests and read back only the pages that differ (if the
+ * device can seek) to tell real differences from a different fill of the
+ * last page. crcs, if not NULL, are the digests of buf's pages, already
+ * padded. Needs pageSize + ioSize bytes of scratch space.
+ */
+static int verifyPages(hid_device *dev, struct uhidWorkspace *ws, int part,
+		       const char *buf, size_t len, const uint32_t *crcs,
+		       uint32_t limit, uint32_t *bad, int maxbad)
 {
-	int bytes;
+	struct uHidDeviceInfo *inf = uhidWorkspaceInfo(ws);
+	int pageSize = inf->parts[part].pageSize;
+	int ioSize = inf->parts[part].ioSize;
+	uint32_t npages = limit / pageSize;
+	uint32_t digests[DIGEST_BATCH];
+	unsigned char *page = ws->scratch;
+	unsigned char *xferbuf = ws->report;
+	int nbad = 0;
+	uint32_t i;
+	int ret;
+
+	if (ws->scratchLen < pageSize + ioSize)
+		return -ENOBUFS;
+
+	printf("Verifying %u bytes (%u page digests)\n",
+	       (uint32_t) min_t(uint64_t, limit, len), npages);
+	for (i = 0; i < npages; i++) {
+		uint32_t addr = i * pageSize;
+
+		if (i % DIGEST_BATCH == 0) {
+			ret = getPageDigests(dev, ws, part, i,
+					     min_t(uint32_t, npages - i, DIGEST_BATCH), digests);
+			if (ret)
+				return ret;
+		}
 
-	void *pbuf = uhidReadPart(dev, part, &bytes);
+		if (crcs && crcs[i] == digests[i % DIGEST_BATCH])
+			continue;
+		copyPadded(page, buf, len, addr, pageSize);
+		if (!crcs && CRC32FromBuf(0, page, pageSize) == digests[i % DIGEST_BATCH])
+			continue;
 
-	if (pbuf == NULL)
-		return -1;
+		if (seekPart(dev, ws, part, addr) == 0) {
+			int pos;
+			for (pos = 0; pos < pageSize; pos += ioSize) {
+				xferbuf[0] = REPORT_ID_PART(part);
+				ret = getReport(dev, xferbuf, ioSize + 1, part, addr + pos);
+				if (ret < 0)
+					return xferError(dev, "hid_get_feature_report", ret);
+				memcpy(&page[pos], &xferbuf[1], ioSize);
+			}
+			pos = (addr < len) ? min_t(uint64_t, pageSize, len - addr) : 0;
+			if (memcmp(page, &buf[addr], pos) == 0)
+				continue;
+		}
+
+		printf("Page %u (0x%x) differs\n", i, addr);
+		if (bad && nbad < maxbad)
+			bad[nbad] = i;
+		nbad++;
+	}
+	return nbad;
+}
 
-	bytes = min_t(int, bytes, len);
-	printf("Verifying %d bytes\n", bytes);
-	return memcmp(buf, pbuf, bytes);
+/**
+ * Verify the partition against buf page by page using page digests. Page
+ * numbers of up to maxbad differing pages are stored in bad.
+ *
+ * @return the number of differing pages, -EOPNOTSUPP if the device has no
+ * UHID_CAP_DIGEST or -errno
+ */
+UHID_API int uhidVerifyPartPages(hid_device *dev, int part, const char *buf, size_t len,
+				 uint32_t *bad, int maxbad)
+{
+	struct uhidWorkspace ws;
+	struct uHidDeviceInfo *inf = uhidWorkspaceInfo(&ws);
+	int ret;
+
+	ret = wsOpen(dev, &ws, part);
+	if (!ret)
+		ret = verifyPages(dev, &ws, part, buf, len, NULL,
+				  imageLength(inf, part, 0, buf, len), bad, maxbad);
+	wsClose(&ws);
+	return ret;
 }
 
+/* Compares what is read against the image, which may be shorter */
+struct cmpSink {
+	const char *buf;
+	size_t len;
+	size_t pos;
+	int differs;
+};
 
-UHID_API int uhidReadPartToFile(hid_device *dev, int part, const char *filename)
+static int cmpSink(void *arg, const char *data, int len)
 {
-	int bytes;
-	void *buf = uhidReadPart(dev, part, &bytes);
-	if (buf == NULL)
-		return -1;
+	struct cmpSink *c = arg;
+	size_t n = (c->pos < c->len) ? min_t(size_t, len, c->len - c->pos) : 0;
+
+	if (memcmp(&c->buf[c->pos], data, n)) {
+		c->differs = 1;
+		return -ECANCELED;
+	}
+	c->pos += len;
+	return 0;
+}
+
+/*
+ * Only the part of the partition that uhidWritePart() would have written
+ * is checked. That is done with page digests if the device supports them
+ * and ws has the scratch space, unless UHID_FLAG_READBACK is set.
+ *
+ * @return 0 if the partition matches, 1 if it doesn't, -errno on errors
+ */
+static int verifyPart(hid_device *dev, struct uhidWorkspace *ws, int part,
+		      const char *buf, size_t len, const uint32_t *crcs)
+{
+	struct uHidDeviceInfo *inf = uhidWorkspaceInfo(ws);
+	struct cmpSink cmp = { buf, len, 0 };
+	uint32_t limit = imageLength(inf, part, 0, buf, len);
+	int ret;
+
+	if ((uhidGetCaps(inf) & UHID_CAP_DIGEST) && !(flags & UHID_FLAG_READBACK) &&
+	    (ws->scratchLen >= inf->parts[part].pageSize + inf->parts[part].ioSize)) {
+		/* The page count is for uhidVerifyPartPages() only */
+		ret = verifyPages(dev, ws, part, buf, len, crcs, limit, NULL, 0);
+		return ret > 0 ? 1 : ret;
+	}
+
+	limit = min_t(uint64_t, limit, len);
+	printf("Verifying %u bytes\n", limit);
+	ret = readPartCb(dev, ws, part, 0, limit, cmpSink, &cmp);
+	return cmp.differs ? 1 : ret;
+}
 
-	FILE *fd = fopen(filename, "w+");
-	if (!fd)
-		return -errno;
-	int ret = fwrite(buf, bytes, 1, fd);
-	fclose(fd);
-	return (ret == 0);
+UHID_API int uhidVerifyPart(hid_device *dev, int part, const char *buf, size_t len)
+{
+	struct uhidWorkspace ws;
+	int ret;
+
+	if (wsOpen(dev, &ws, part))
+		ret = -1;
+	else
+		ret = verifyPart(dev, &ws, part, buf, len, NULL);
+	wsClose(&ws);
+	return ret;
 }
 
+/**
+ * uhidVerifyPart() that uses nothing but ws, see struct uhidWorkspace.
+ *
+ * @return 0 if the partition matches, 1 if it doesn't, -errno on errors
+ */
+UHID_API int uhidVerifyPartWs(hid_device *dev, struct uhidWorkspace *ws, int part,
+			      const char *buf, size_t len)
+{
+	int ret = wsReadInfo(dev, ws, part);
+
+	return ret ? ret : verifyPart(dev, ws, part, buf, len, NULL);
+}
 
-static int guessIfIntelHex(const char *filename)
+/**
+ * Save len bytes of the partition starting at offset to filename, without
+ * holding all of it in memory. Names ending in .hex get sparse Intel HEX,
+ * anything else a binary with holes for zeroed blocks (see export.c).
+ *
+ * @return 0, -ERANGE if the range doesn't fit the partition or -errno
+ */
+UHID_API int uhidReadRangeToFile(hid_device *dev, int part, uint64_t offset, uint64_t len,
+				 const char *filename)
 {
-	char *ext = strrchr(filename, '.');
-  /* Assume bin by default */
-	if (!ext)
-	   return 0;
-  if (strcmp(ext,".ihx")==0)
-    return 1;
-  if (strcmp(ext,".hex")==0)
-    return 1;
-  return 0;
+	struct uhidExport *x = malloc(sizeof(*x));
+	int ret;
+
+	if (!x)
+		return -ENOMEM;
+	ret = exportOpen(x, filename, offset);
+	if (!ret) {
+		ret = uhidReadRange(dev, part, offset, len, exportSink, x);
+		ret = exportClose(x, ret);
+	}
+	free(x);
+	return ret;
 }
 
-static ssize_t getFileContents(const char* filename, char **buf)
+UHID_API int uhidReadPartToFile(hid_device *dev, int part, const char *filename)
 {
-  int ok;
-  FILE *fd = fopen(filename, "r");
-  ssize_t sz;
-	if (fd == NULL)
-		return -1;
+	struct uhidWorkspace ws;
+	int ret;
+
+	uhidWorkspaceInit(&ws, NULL, 0);
+	ret = wsReadInfo(dev, &ws, part);
+	if (ret)
+		return ret;
+	return uhidReadRangeToFile(dev, part, 0, uhidWorkspaceInfo(&ws)->parts[part].size,
+				   filename);
+}
 
-	fseek(fd, 0, SEEK_END);
-	sz = ftell(fd);
-  rewind(fd);
+/*
+ * Loads what goes into partition part from filename, which may be binary,
+ * Intel HEX or ELF. Gaps are filled with fillByte. "-" is stdin.
+ */
+UHID_NO_EXPORT ssize_t imageLoad(const char *filename, struct uHidDeviceInfo *inf, int part,
+				 struct uhidImage *img)
+{
+	struct uhidSource src;
+	const char *path = inputPath(filename);
+	ssize_t cached = path ? cacheGet(path, inf, part, fillByte, img) : -ENOENT;
+	int fd;
+	int ret;
+
+	if (cached >= 0)
+		return cached;
+	fd = openInput(filename);
+	if (fd < 0)
+		return fd;
+	ret = sourceOpen(&src, fd, filename, inf, part, 0);
+	if (!ret)
+		ret = sourceRead(&src, (uint64_t) src.size + 1);
+	closeInput(fd);
+	if (ret < 0) {
+		sourceClose(&src);
+		return ret;
+	}
+	if (path && !src.truncated)
+		cachePut(path, inf, part, fillByte, src.img.data, src.len);
+	free(src.in);
+	*img = src.img;
+	img->len = src.len;
+	img->truncated = src.truncated;
+	return src.len;
+}
+
+/*
+ * With UHID_FLAG_VERIFY, checks what writeSource() just wrote, unless the
+ * device already did. Whatever was written is in memory now, even if it
+ * came from a pipe.
+ *
+ * @return 0 if the partition matches, 1 if it doesn't, -errno on errors
+ */
+static int verifyWritten(hid_device *dev, struct uhidWorkspace *ws, int part,
+			 struct uhidSource *src)
+{
+	struct cmpSink cmp = { src->img.data, src->len, 0 };
+	int ret;
+
+	if (!(flags & UHID_FLAG_VERIFY) || src->verified)
+		return 0;
+	if (!src->offset) {
+		ret = wsReadInfo(dev, ws, part);
+		return ret ? ret : verifyPart(dev, ws, part, src->img.data, src->len,
+					      src->img.pageCrcs);
+	}
+	printf("Verifying %u bytes at 0x%x\n", src->len, src->offset);
+	ret = uhidReadRangeWs(dev, ws, part, src->offset, src->len, cmpSink, &cmp);
+	return cmp.differs ? 1 : ret;
+}
+
+static int writeFromFd(hid_device *dev, int part, uint64_t offset, int fd,
+		       const char *name, const char *path)
+{
+	struct uhidWorkspace ws;
+	struct uHidDeviceInfo *inf = uhidWorkspaceInfo(&ws);
+	struct uhidSource src;
+	struct uhidImage cached;
+	int ret;
+
+	memset(&cached, 0, sizeof(cached));
+	ret = wsOpen(dev, &ws, part);
+	if (ret)
+		goto bailout;
+	if (offset > inf->parts[part].size) {
+		ret = -ERANGE;
+		goto bailout;
+	}
 
-  *buf = malloc(sz);
-  if (!*buf)
-    return -1;
+	/* Regular files are read completely by sourceOpen(), see cache.c */
+	if (path && !offset && cacheGet(path, inf, part, fillByte, &cached) >= 0) {
+		sourceFromBuffer(&src, cached.data, cached.len, inf, part, 0);
+		src.img.pageCrcs = cached.pageCrcs;
+		ret = 0;
+	} else {
+		ret = sourceOpen(&src, fd, name, inf, part, offset);
+		if (!ret && path && !offset && src.eof && !src.truncated)
+			cachePut(path, inf, part, fillByte, src.img.data, src.len);
+	}
+	if (!ret)
+		ret = writeSource(dev, &ws, part, &src);
+	if (!ret)
+		ret = verifyWritten(dev, &ws, part, &src);
+	sourceClose(&src);
+bailout:
+	imageFree(&cached);
+	wsClose(&ws);
+	return ret;
+}
 
-  ok=fread(*buf, sz, 1, fd);
-	fclose(fd);
+/**
+ * Write partition part from fd, which may be a pipe or socket. Writing
+ * starts as soon as the first data comes in. The format (binary, Intel HEX
+ * or ELF) is detected from the contents.
+ */
+UHID_API int uhidWritePartFromFd(hid_device *dev, int part, int fd)
+{
+	char name[32];
 
-  if (ok)
-    return sz;
-  else {
-    free(*buf);
-    return -1;
-  }
+	snprintf(name, sizeof(name), "fd %d", fd);
+	return writeFromFd(dev, part, 0, fd, name, NULL);
 }
 
+/* "-" writes from stdin, see uhidWritePartFromFd() */
 UHID_API int uhidWritePartFromFile(hid_device *dev, int part, const char *filename)
 {
-        struct uHidDeviceInfo *inf = uhidReadInfo(dev);
-        if (!inf)
-                return -1;
-
-        if (part > inf->numParts)
-                return -1;
-
-        int ret = -EIO;
-        ssize_t len_file;
-        ssize_t len = inf->parts[part].size;
-        char *buf;
-
-        if (!guessIfIntelHex(filename))
-        {
-                len_file = getFileContents(filename, &buf);
-                if (len_file <=0)
-                  goto errfreeinf;
-                printf("Input file detected as binary\n");
-        } else {
-              int startAddr, endAddr;
-              len_file = parseIntelHex(filename, NULL, &startAddr, &endAddr);
-              if (len_file <= 0)
-                  goto errfreeinf;
-              printf("Input file detected as Intel Hex\n");
-              printf("Start addr 0x%x end addr 0x%x\n",
-                startAddr, endAddr);
-              buf = malloc(len_file);
-              if (!buf)
-                goto errfreeinf;
-              len_file = parseIntelHex(filename, buf, &startAddr, &endAddr);
-              if (len_file <=0)
-                  goto errfreebuf;
-        }
-
-        if (len_file < len)
-                len = len_file;
-		if (len_file > len) {
-			printf("WARN: File too big for partition, truncated! (%zd > %zd)\n",
-			len_file, len);
-		}
+	int fd = openInput(filename);
+	int ret;
+
+	if (fd < 0)
+		return fd;
+	ret = writeFromFd(dev, part, 0, fd, filename, inputPath(filename));
+	closeInput(fd);
+	return ret;
+}
 
-        ret = uhidWritePart(dev, part, buf, len);
+/*
+ * Like uhidWritePartFromFile(), but the image goes offset bytes into the
+ * partition. See uhidWriteRange() for what offsets work.
+ */
+UHID_API int uhidWriteRangeFromFile(hid_device *dev, int part, uint64_t offset,
+				    const char *filename)
+{
+	int fd = openInput(filename);
+	int ret;
 
-errfreebuf:
-        free(buf);
-errfreeinf:
-        free(inf);
-        return ret;
+	if (fd < 0)
+		return fd;
+	ret = writeFromFd(dev, part, offset, fd, filename, inputPath(filename));
+	closeInput(fd);
+	return ret;
 }
 
 UHID_API int uhidVerifyPartFromFile(hid_device *dev, int part, const char *filename)
 {
-
+	struct uhidWorkspace ws;
+	struct uhidImage img;
 	ssize_t len_file;
-  char *buf;
-  len_file = getFileContents(filename, &buf);
-  if (len_file <= 0)
-    return -1;
+	int ret = -1;
 
-	return uhidVerifyPart(dev, part, buf, len_file);
+	if (wsOpen(dev, &ws, part))
+		goto bailout;
+
+	len_file = imageLoad(filename, uhidWorkspaceInfo(&ws), part, &img);
+	if (len_file <= 0)
+		goto bailout;
 
+	ret = verifyPart(dev, &ws, part, img.data, len_file, img.pageCrcs);
+	imageFree(&img);
+bailout:
+	wsClose(&ws);
+	return ret;
 }
 
 
@@ -594,15 +2387,17 @@ UHID_API void uhidClose(hid_device *dev)
 UHID_API int uhidCloseAndRun(hid_device *dev, int part)
 {
 	int ret = -1;
-	struct uHidDeviceInfo *inf = uhidReadInfo(dev);
-	if (!inf)
+	struct uhidWorkspace ws;
+
+	uhidWorkspaceInit(&ws, NULL, 0);
+	if (uhidReadInfoWs(dev, &ws))
 		goto bailout;
 
-	int ioSize = inf->parts[0].ioSize;
-	char *tmp = alloca(ioSize);
+	int ioSize = uhidWorkspaceInfo(&ws)->parts[0].ioSize;
+	unsigned char *tmp = ws.control;
 	tmp[0]=REPORT_ID_INFO;
 	tmp[1]=part;
-	ret = hid_send_feature_report(dev, (unsigned char *) tmp, ioSize + 1);
+	ret = sendReport(dev, tmp, ioSize + 1, -1, 0);
 	/*  Silently ignore all errors. The device will disconnect perhaps  before the
 	 *	feature report is completed
 	 */
@@ -613,21 +2408,37 @@ bailout:
 	return ret;
 }
 
-UHID_API int uhidGetPartitionCRCById(hid_device *dev, int part, uint32_t *crc32)
+static int crcSink(void *arg, const char *data, int len)
 {
-	struct uHidDeviceInfo *inf = uhidReadInfo(dev);
-	if (!inf)
-		return -1;
-	int len;
-	char *buf = uhidReadPart(dev, part, &len);
-	if (buf == NULL)
-		goto bailout;
-	*crc32 = CRC32FromBuf(0, buf, len);
+	uint32_t *crc32 = arg;
+
+	*crc32 = CRC32FromBuf(*crc32, data, len);
 	return 0;
+}
 
-bailout:
-	free(inf);
-	return -1;
+/**
+ * CRC32 of len bytes of the partition starting at offset.
+ *
+ * @return 0, -ERANGE if the range doesn't fit the partition or -errno
+ */
+UHID_API int uhidGetRangeCRC(hid_device *dev, int part, uint64_t offset, uint64_t len,
+			     uint32_t *crc32)
+{
+	*crc32 = 0;
+	return uhidReadRange(dev, part, offset, len, crcSink, crc32);
+}
+
+UHID_API int uhidGetPartitionCRCById(hid_device *dev, int part, uint32_t *crc32)
+{
+	struct uhidWorkspace ws;
+
+	uhidWorkspaceInit(&ws, NULL, 0);
+	if (wsReadInfo(dev, &ws, part))
+		return -1;
+	*crc32 = 0;
+	int ret = readPartCb(dev, &ws, part, 0, uhidWorkspaceInfo(&ws)->parts[part].size,
+			     crcSink, crc32);
+	return (ret < 0) ? -1 : 0;
 }
 
 UHID_API int uhidGetPartitionCRC(hid_device *dev, const char *part, uint32_t *crc32)
@@ -658,6 +2469,10 @@ UHID_API void uhidPrintInfo(hid_device *dev, struct uHidDeviceInfo *inf)
 	printf("Partitions:        %d\n", inf->numParts);
 
 	printf("CPU Frequency:     %.1f Mhz\n", uhidGetFrequencyMhz(inf));
+	if (inf->version >= 2)
+		printf("Capabilities:      0x%x\n", uhidGetCaps(inf));
+	if (inf->version >= 3)
+		printf("Max report:        %d bytes\n", uhidGetMaxReport(inf));
 	for (i=0; i<inf->numParts; i++) {
 		struct uHidPartInfo *p = &inf->parts[i];
 		printf("%d. %s %d bytes (pageSize: %d ioSize: %d)  \n",
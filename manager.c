@@ -83,6 +83,12 @@ bailout:
   return ret;
 }
 
+/* Creates the directories leading to path, for the stores elsewhere */
+UHID_NO_EXPORT int uhidmgrMkParents(const char *path)
+{
+    return mkpath(path, 0755);
+}
+
 static void replace_set(char *str, char *set, int repl)
 {
     while (*set)
@@ -177,6 +183,318 @@ UHID_API char *uhidmgrAppDir(hid_device *dev, const char *appname)
     return ret;
 }
 
+/*
+ * Content addressed firmware store. Decoded images are kept once, no matter
+ * how many devices use them:
+ *   store/ab/abcdef...       - the binary image, named by its SHA-256
+ *   store/ab/abcdef....meta  - "size: N" and "crc32: 0x..." lines
+ * Application directories only hold <partition>.ref files with the hash of
+ * the image that goes there.
+ */
+static char *storeFile(const char *hash, const char *suffix)
+{
+    char sub[UHID_HASH_LEN + 32];
+
+    if (strlen(hash) != UHID_HASH_LEN ||
+        strspn(hash, "0123456789abcdef") != UHID_HASH_LEN)
+        return NULL;
+    snprintf(sub, sizeof(sub), "store/%.2s/%s%s", hash, hash, suffix);
+    return uhidmgrGetAppHomeDir(sub);
+}
+
+/* Readers never see a half-written file */
+static int writeFileAtomic(const char *path, const void *data, size_t len)
+{
+    int ret = -EIO;
+    size_t tlen = strlen(path) + 32;
+    char *tmp = alloca(tlen);
+    FILE *fd;
+
+    if (mkpath(path, 0755))
+        return -errno;
+    /* --all writes from many threads */
+    static int seq;
+    snprintf(tmp, tlen, "%s.tmp%d.%d", path, (int) getpid(),
+             __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED));
+    fd = fopen(tmp, "wb");
+    if (!fd)
+        return -errno;
+    if (fwrite(data, 1, len, fd) == len)
+        ret = 0;
+    if (fclose(fd))
+        ret = -EIO;
+    if (!ret) {
+#ifdef _WIN32
+        /* rename() doesn't replace existing files here */
+        if (!MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING))
+            ret = -EIO;
+#else
+        if (rename(tmp, path))
+            ret = -errno;
+#endif
+    }
+    if (ret)
+        remove(tmp);
+    return ret;
+}
+
+UHID_NO_EXPORT int uhidmgrWriteAtomic(const char *path, const void *data, size_t len)
+{
+    return writeFileAtomic(path, data, len);
+}
+
+UHID_API char *uhidmgrStorePath(const char *hash)
+{
+    return storeFile(hash, "");
+}
+
+/**
+ * Adds an image to the store, unless it's already there. hash gets the
+ * name it is stored under.
+ *
+ * @return 0 or -errno
+ */
+UHID_API int uhidmgrStorePut(const char *data, size_t len, char hash[UHID_HASH_LEN + 1])
+{
+    struct uhidSha256 c;
+    char meta[64];
+    int ret = 0;
+
+    sha256Init(&c);
+    sha256Update(&c, data, len);
+    sha256Final(&c, hash);
+
+    char *path = storeFile(hash, "");
+    char *mpath = storeFile(hash, ".meta");
+    if (!path || !mpath) {
+        ret = -ENOMEM;
+        goto bailout;
+    }
+
+    if (access(path, F_OK) == 0 && access(mpath, F_OK) == 0)
+        goto bailout;
+
+    snprintf(meta, sizeof(meta), "size: %zu\ncrc32: 0x%08x\n",
+             len, CRC32FromBuf(0, data, len));
+    /* meta first: a blob that exists always has one */
+    ret = writeFileAtomic(mpath, meta, strlen(meta));
+    if (!ret)
+        ret = writeFileAtomic(path, data, len);
+
+bailout:
+    free(path);
+    free(mpath);
+    return ret;
+}
+
+UHID_API int uhidmgrStoreInfo(const char *hash, size_t *len, uint32_t *crc32)
+{
+    char line[64];
+    int found = 0;
+    char *path = storeFile(hash, ".meta");
+    if (!path)
+        return -EINVAL;
+    FILE *fd = fopen(path, "r");
+    free(path);
+    if (!fd)
+        return -ENOENT;
+
+    while (fgets(line, sizeof(line), fd)) {
+        unsigned long v;
+        if (sscanf(line, "size: %lu", &v) == 1) {
+            if (len)
+                *len = v;
+            found |= 1;
+        } else if (sscanf(line, "crc32: %lx", &v) == 1) {
+            if (crc32)
+                *crc32 = v;
+            found |= 2;
+        }
+    }
+    fclose(fd);
+    return (found == 3) ? 0 : -EINVAL;
+}
+
+/*
+ * Where each board was last seen: paths/<serial> holds the hidapi path it
+ * was opened by. That is only a hint, the serial number is checked again
+ * after opening.
+ */
+static char *pathCacheFile(const char *serial)
+{
+    char sub[96];
+
+    if (!serial[0] || strlen(serial) > 64)
+        return NULL;
+    snprintf(sub, sizeof(sub), "paths/%s", serial);
+    replace_set(&sub[6], "/\\:", '_');
+    return uhidmgrGetAppHomeDir(sub);
+}
+
+/* Caller frees */
+UHID_NO_EXPORT char *uhidmgrPathCacheGet(const char *serial)
+{
+    char line[1024], *ret = NULL;
+    char *file = pathCacheFile(serial);
+    FILE *fd;
+
+    if (!file)
+        return NULL;
+    fd = fopen(file, "r");
+    free(file);
+    if (!fd)
+        return NULL;
+    if (fgets(line, sizeof(line), fd)) {
+        line[strcspn(line, "\n")] = 0;
+        if (line[0])
+            ret = strdup(line);
+    }
+    fclose(fd);
+    return ret;
+}
+
+UHID_NO_EXPORT void uhidmgrPathCachePut(const char *serial, const char *path)
+{
+    char *file = pathCacheFile(serial);
+    char *old = uhidmgrPathCacheGet(serial);
+
+    /* Nothing to do for a board that stays where it is */
+    if (file && (!old || strcmp(old, path) != 0))
+        writeFileAtomic(file, path, strlen(path));
+    free(old);
+    free(file);
+}
+
+/* <appdir>/<partition>.ref, caller frees */
+static char *refPath(hid_device *dev, const char *appname, int part)
+{
+    struct uHidDeviceInfo *inf = uhidReadInfo(dev);
+    char *dir, *ret = NULL;
+    size_t len;
+
+    if (!inf)
+        return NULL;
+    if (part < 0 || part >= inf->numParts)
+        goto bailout;
+    dir = uhidmgrAppDir(dev, appname);
+    if (!dir)
+        goto bailout;
+    len = strlen(dir) + UISP_PART_NAME_LEN + 8;
+    ret = malloc(len);
+    if (ret)
+        snprintf(ret, len, "%s/%.*s.ref", dir, UISP_PART_NAME_LEN,
+                 (char *) inf->parts[part].name);
+    free(dir);
+bailout:
+    free(inf);
+    return ret;
+}
+
+/**
+ * Decodes filename (binary, Intel HEX or ELF) for partition part, puts it
+ * into the store and makes application appname of this device refer to it.
+ */
+UHID_API int uhidmgrAppAdd(hid_device *dev, const char *appname, int part,
+                           const char *filename)
+{
+    struct uHidDeviceInfo *inf = uhidReadInfo(dev);
+    struct uhidImage img;
+    char hash[UHID_HASH_LEN + 2];
+    char *ref = NULL;
+    ssize_t len;
+    int ret = -ENOENT;
+
+    if (!inf)
+        return -EIO;
+    if (part < 0 || part >= inf->numParts)
+        goto bailout;
+
+    len = imageLoad(filename, inf, part, &img);
+    if (len <= 0) {
+        ret = -EIO;
+        goto bailout;
+    }
+    if (img.truncated) {
+        fprintf(stderr, "%s doesn't fit into partition %d (%u bytes)\n",
+                filename, part, inf->parts[part].size);
+        imageFree(&img);
+        ret = -EFBIG;
+        goto bailout;
+    }
+
+    ret = uhidmgrStorePut(img.data, len, hash);
+    imageFree(&img);
+    if (ret)
+        goto bailout;
+
+    ref = refPath(dev, appname, part);
+    if (!ref) {
+        ret = -ENOMEM;
+        goto bailout;
+    }
+    printf("%s: %s\n", ref, hash);
+    strcat(hash, "\n");
+    ret = writeFileAtomic(ref, hash, strlen(hash));
+
+bailout:
+    free(ref);
+    free(inf);
+    return ret;
+}
+
+/**
+ * Writes and verifies partition part with what application appname of this
+ * device refers to.
+ */
+UHID_API int uhidmgrAppWrite(hid_device *dev, const char *appname, int part)
+{
+    char hash[UHID_HASH_LEN + 2];
+    struct uhidImage img;
+    size_t len;
+    uint32_t crc;
+    char *path;
+    int ret;
+
+    char *ref = refPath(dev, appname, part);
+    if (!ref)
+        return -ENOENT;
+    FILE *fd = fopen(ref, "r");
+    free(ref);
+    if (!fd)
+        return -ENOENT;
+    ret = fgets(hash, sizeof(hash), fd) ? 0 : -EINVAL;
+    fclose(fd);
+    if (ret)
+        return ret;
+    hash[strcspn(hash, "\r\n")] = 0;
+
+    ret = uhidmgrStoreInfo(hash, &len, &crc);
+    if (ret)
+        return ret;
+    path = uhidmgrStorePath(hash);
+    if (!path)
+        return -EINVAL;
+    memset(&img, 0, sizeof(img));
+    ret = imageMapFile(path, &img);
+    free(path);
+    if (ret)
+        return ret;
+
+    /* The CRC is much cheaper than writing a corrupted image */
+    if (img.maplen != len || CRC32FromBuf(0, img.map, len) != crc) {
+        fprintf(stderr, "Store entry %s is corrupted\n", hash);
+        ret = -EIO;
+        goto bailout;
+    }
+
+    ret = uhidWritePart(dev, part, img.map, len);
+    if (!ret)
+        ret = uhidVerifyPart(dev, part, img.map, len) ? -EIO : 0;
+bailout:
+    imageFree(&img);
+    return ret;
+}
+
 UHID_API struct uhidApplication *uhidmgrRepoRead(hid_device *dev)
 {
   char *path = uhidmgrAppDir(dev, NULL);
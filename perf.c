@@ -0,0 +1,339 @@
+/*
+ *  uHID Universal MCU Bootloader. Library.
+ *  Copyright (C) 2016  Andrew 'Necromant' Andrianov
+ *
+ *  This file is part of uHID project. uHID was initially based
+ *  on bootloadHID avr bootloader by Christian Starkjohann
+ *  Since no original userspace code remains, all userspace code
+ *  is now LGPLv2.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Performance history. Every operation appends one line to
+ *   perf/<product>/<serial>.log
+ * in the application home directory:
+ *   <unix time> <op> <part> <bytes> <reports> <elapsed us> <errors> <p99 us> <port> <tt>
+ * port and tt are "-" when the topology isn't known. The drift query
+ * compares the last few runs of every device, port and hub with the runs
+ * before them, so a board or cable that got slower stands out even when
+ * it is still faster than its neighbours.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <wchar.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <hidapi/hidapi.h>
+#include <libuhid.h>
+
+#define min_t(type, a, b) (((type)(a)<(type)(b))?(type)(a):(type)(b))
+
+/* Runs a group needs before the ones that come after can drift from it */
+#define PERF_MIN_BASELINE 3
+
+enum {
+	PERF_DEVICE = 0,
+	PERF_PORT,
+	PERF_HUB,
+	PERF_NKINDS
+};
+
+static const char *kindNames[PERF_NKINDS] = { "device", "port", "hub" };
+
+struct perfRec {
+	char key[PERF_NKINDS][136];
+	char op[16];
+	int64_t time;
+	double kbps;
+	uint32_t p99;
+	uint32_t errors;
+};
+
+struct perfSet {
+	struct perfRec *recs;
+	int n;
+	int cap;
+};
+
+/* Device strings end up in file names */
+static void devString(int (*get)(hid_device *, wchar_t *, size_t), hid_device *dev,
+		      char *buf, size_t len)
+{
+	wchar_t tmp[64];
+	char *p;
+
+	tmp[63] = 0;
+	if (get(dev, tmp, 63) || wcstombs(buf, tmp, len - 1) == (size_t) -1 || !tmp[0])
+		snprintf(buf, len, "unknown");
+	buf[len - 1] = 0;
+	for (p = buf; *p; p++)
+		if (!((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'z') ||
+		      (*p >= 'A' && *p <= 'Z') || *p == '-' || *p == '.'))
+			*p = '_';
+}
+
+/**
+ * Append a record of one operation on dev to its history. st are the
+ * transfers it made, path is where the device is plugged in (see
+ * uhidGetTopology()) and may be NULL.
+ *
+ * @return 0 or -errno
+ */
+UHID_API int uhidmgrPerfAppend(hid_device *dev, const char *path, const char *op,
+			       const char *part, const struct uhidXferStats *st,
+			       uint64_t elapsedUs)
+{
+	char product[64], serial[64], sub[160];
+	struct uhidTopology t;
+	char *file;
+	FILE *fd;
+	int ret = 0;
+
+	devString(hid_get_product_string, dev, product, sizeof(product));
+	devString(hid_get_serial_number_string, dev, serial, sizeof(serial));
+	snprintf(sub, sizeof(sub), "perf/%s/%s.log", product, serial);
+	file = uhidmgrGetAppHomeDir(sub);
+	if (!file)
+		return -ENOMEM;
+	if (uhidmgrMkParents(file)) {
+		free(file);
+		return -errno;
+	}
+
+	fd = fopen(file, "a");
+	free(file);
+	if (!fd)
+		return -errno;
+
+	if (!path || uhidGetTopology(path, &t))
+		memset(&t, 0, sizeof(t));
+	fprintf(fd, "%" PRId64 " %s %s %" PRIu64 " %u %" PRIu64 " %u %u ",
+		(int64_t) time(NULL), op, part ? part : "-", st->bytes, st->reports,
+		elapsedUs, st->errors, uhidXferPercentile(st, 99));
+	if (t.ports[0])
+		fprintf(fd, "%d-%s %s\n", t.bus, t.ports, t.tt);
+	else
+		fprintf(fd, "- -\n");
+	if (fclose(fd))
+		ret = -EIO;
+	return ret;
+}
+
+static void perfLoad(struct perfSet *set, const char *file, const char *device)
+{
+	char line[256], op[16], part[32], port[40], tt[64];
+	int64_t when;
+	uint64_t bytes, us;
+	unsigned int reports, errors, p99;
+	FILE *fd = fopen(file, "r");
+
+	if (!fd)
+		return;
+	while (fgets(line, sizeof(line), fd)) {
+		struct perfRec *r;
+
+		if (sscanf(line, "%" SCNd64 " %15s %31s %" SCNu64 " %u %" SCNu64 " %u %u %39s %63s",
+			   &when, op, part, &bytes, &reports, &us, &errors, &p99, port, tt) != 10)
+			continue;
+		/* Failed and empty runs say nothing about speed */
+		if (!bytes || !us)
+			continue;
+		if (set->n == set->cap) {
+			int cap = set->cap ? set->cap * 2 : 256;
+			struct perfRec *tmp = realloc(set->recs, cap * sizeof(*tmp));
+			if (!tmp)
+				break;
+			set->recs = tmp;
+			set->cap = cap;
+		}
+		r = &set->recs[set->n++];
+		snprintf(r->key[PERF_DEVICE], sizeof(r->key[0]), "%s", device);
+		snprintf(r->key[PERF_PORT], sizeof(r->key[0]), "%s", port);
+		snprintf(r->key[PERF_HUB], sizeof(r->key[0]), "%s", tt);
+		snprintf(r->op, sizeof(r->op), "%s", op);
+		r->time = when;
+		r->kbps = bytes * 1000000.0 / us / 1024.0;
+		r->p99 = p99;
+		r->errors = errors;
+	}
+	fclose(fd);
+}
+
+/* perf/<product>/<serial>.log */
+static void perfLoadAll(struct perfSet *set)
+{
+	char *base = uhidmgrGetAppHomeDir("perf");
+	struct dirent *p, *s;
+	DIR *pd, *sd;
+
+	if (!base)
+		return;
+	pd = opendir(base);
+	while (pd && (p = readdir(pd))) {
+		char dir[1024];
+
+		if (p->d_name[0] == '.')
+			continue;
+		snprintf(dir, sizeof(dir), "%s/%s", base, p->d_name);
+		sd = opendir(dir);
+		while (sd && (s = readdir(sd))) {
+			char file[2048], device[136];
+			size_t len = strlen(s->d_name);
+
+			if (len < 5 || strcmp(&s->d_name[len - 4], ".log") != 0)
+				continue;
+			snprintf(file, sizeof(file), "%s/%s", dir, s->d_name);
+			snprintf(device, sizeof(device), "%.63s/%.*s", p->d_name,
+				 (int) min_t(size_t, len - 4, 63), s->d_name);
+			perfLoad(set, file, device);
+		}
+		if (sd)
+			closedir(sd);
+	}
+	if (pd)
+		closedir(pd);
+	free(base);
+}
+
+static int sortKind;
+
+static int recCmp(const void *a, const void *b)
+{
+	const struct perfRec *x = *(const struct perfRec **) a;
+	const struct perfRec *y = *(const struct perfRec **) b;
+	int ret = strcmp(x->key[sortKind], y->key[sortKind]);
+
+	if (!ret)
+		ret = strcmp(x->op, y->op);
+	if (!ret)
+		ret = (x->time > y->time) - (x->time < y->time);
+	/* Same second, keep the order they were logged in */
+	if (!ret)
+		ret = (x > y) - (x < y);
+	return ret;
+}
+
+static int dblCmp(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Median of the kbps (or p99 with p99 set) of n records, tmp has room for n */
+static double median(struct perfRec **r, int n, int p99, double *tmp)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		tmp[i] = p99 ? r[i]->p99 : r[i]->kbps;
+	qsort(tmp, n, sizeof(*tmp), dblCmp);
+	return (n % 2) ? tmp[n / 2] : (tmp[n / 2 - 1] + tmp[n / 2]) / 2;
+}
+
+/**
+ * Print how the last recent runs of every device, port and hub compare to
+ * the ones before. Groups whose median throughput dropped by more than
+ * threshold (0.2 is 20%), whose p99 report latency grew by as much or that
+ * had failed transfers recently are flagged.
+ *
+ * @return the number of flagged groups or -errno
+ */
+UHID_API int uhidmgrPerfDrift(int recent, double threshold)
+{
+	struct perfSet set = { 0 };
+	struct perfRec **idx;
+	double *tmp;
+	int kind, i, flagged = 0, shown = 0;
+
+	if (recent < 1)
+		return -EINVAL;
+	perfLoadAll(&set);
+	if (!set.n) {
+		printf("No performance history yet\n");
+		free(set.recs);
+		return 0;
+	}
+
+	idx = malloc(set.n * sizeof(*idx));
+	tmp = malloc(set.n * sizeof(*tmp));
+	if (!idx || !tmp) {
+		free(idx);
+		free(tmp);
+		free(set.recs);
+		return -ENOMEM;
+	}
+
+	printf("%-6s %-32s %-8s %5s %10s %10s %7s %8s %8s %6s\n", "what", "name", "op",
+	       "runs", "base KiB/s", "now KiB/s", "change", "p99 base", "p99 now", "errors");
+	for (kind = 0; kind < PERF_NKINDS; kind++) {
+		for (i = 0; i < set.n; i++)
+			idx[i] = &set.recs[i];
+		sortKind = kind;
+		qsort(idx, set.n, sizeof(*idx), recCmp);
+
+		for (i = 0; i < set.n; ) {
+			int j = i, n, nbase, errors = 0, k;
+			double base, now, pbase, pnow;
+			const char *flag = "";
+
+			while (j < set.n && !strcmp(idx[j]->key[kind], idx[i]->key[kind]) &&
+			       !strcmp(idx[j]->op, idx[i]->op))
+				j++;
+			n = j - i;
+			nbase = n - recent;
+			if (strcmp(idx[i]->key[kind], "-") == 0 || nbase < PERF_MIN_BASELINE) {
+				i = j;
+				continue;
+			}
+
+			base = median(&idx[i], nbase, 0, tmp);
+			now = median(&idx[i + nbase], recent, 0, tmp);
+			pbase = median(&idx[i], nbase, 1, tmp);
+			pnow = median(&idx[i + nbase], recent, 1, tmp);
+			for (k = i + nbase; k < j; k++)
+				errors += idx[k]->errors;
+
+			if (now < base * (1.0 - threshold))
+				flag = "SLOW";
+			else if (pnow > pbase * (1.0 + threshold) && pnow > pbase + 1)
+				flag = "JITTER";
+			else if (errors)
+				flag = "ERRORS";
+			flagged += !!flag[0];
+			shown++;
+
+			printf("%-6s %-32s %-8s %5d %10.1f %10.1f %6.1f%% %8.0f %8.0f %6d %s\n",
+			       kindNames[kind], idx[i]->key[kind], idx[i]->op, n, base, now,
+			       base ? (now - base) * 100.0 / base : 0.0, pbase, pnow, errors, flag);
+			i = j;
+		}
+	}
+	if (!shown)
+		printf("Not enough history yet, every device, port and hub needs "
+		       "%d runs of an operation\n", PERF_MIN_BASELINE + recent);
+
+	free(idx);
+	free(tmp);
+	free(set.recs);
+	return flagged;
+}
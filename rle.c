@@ -0,0 +1,107 @@
+/*
+ *  uHID Universal MCU Bootloader. Library.
+ *  Copyright (C) 2016  Andrew 'Necromant' Andrianov
+ *
+ *  This file is part of uHID project. uHID was initially based
+ *  on bootloadHID avr bootloader by Christian Starkjohann
+ *  Since no original userspace code remains, all userspace code
+ *  is now LGPLv2.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * PackBits-style RLE used by the compressed write stream (UHID_CAP_RLE).
+ * The format is picked for the decoder, which has to fit in a few dozen
+ * bytes of bootloader code:
+ *
+ *   0x00..0x7f c:  c + 1 literal bytes follow
+ *   0x80..0xff c:  the next byte is repeated c - 0x80 + 3 times
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <libuhid.h>
+
+#define RLE_MIN_RUN 3
+#define RLE_MAX_RUN (0x7f + RLE_MIN_RUN)
+#define RLE_MAX_LIT 0x80
+
+UHID_NO_EXPORT int rleCompress(const unsigned char *in, int len,
+				 unsigned char *out, int max)
+{
+	int i = 0;
+	int o = 0;
+
+	while (i < len) {
+		int run = 1;
+		while ((i + run < len) && (run < RLE_MAX_RUN) && (in[i + run] == in[i]))
+			run++;
+
+		if (run >= RLE_MIN_RUN) {
+			if (o + 2 > max)
+				return -1;
+			out[o++] = 0x80 + run - RLE_MIN_RUN;
+			out[o++] = in[i];
+			i += run;
+			continue;
+		}
+
+		/* Literals until the next run worth encoding */
+		int lit = 0;
+		while ((i + lit < len) && (lit < RLE_MAX_LIT)) {
+			if ((i + lit + 2 < len) &&
+			    (in[i + lit] == in[i + lit + 1]) &&
+			    (in[i + lit] == in[i + lit + 2]))
+				break;
+			lit++;
+		}
+
+		if (o + 1 + lit > max)
+			return -1;
+		out[o++] = lit - 1;
+		memcpy(&out[o], &in[i], lit);
+		o += lit;
+		i += lit;
+	}
+	return o;
+}
+
+UHID_NO_EXPORT int rleDecompress(const unsigned char *in, int len,
+				   unsigned char *out, int max)
+{
+	int i = 0;
+	int o = 0;
+
+	while (i < len) {
+		int c = in[i++];
+		if (c & 0x80) {
+			int run = c - 0x80 + RLE_MIN_RUN;
+			if ((i >= len) || (o + run > max))
+				return -1;
+			memset(&out[o], in[i++], run);
+			o += run;
+		} else {
+			int lit = c + 1;
+			if ((i + lit > len) || (o + lit > max))
+				return -1;
+			memcpy(&out[o], &in[i], lit);
+			i += lit;
+			o += lit;
+		}
+	}
+	return o;
+}
@@ -0,0 +1,485 @@
+/*
+ *  uHID Universal MCU Bootloader. Library.
+ *  Copyright (C) 2016  Andrew 'Necromant' Andrianov
+ *
+ *  This file is part of uHID project. uHID was initially based
+ *  on bootloadHID avr bootloader by Christian Starkjohann
+ *  Since no original userspace code remains, all userspace code
+ *  is now LGPLv2.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Running one job per device on many devices at once. uHID bootloaders are
+ * low/full speed devices, so behind a high speed hub they all share that
+ * hub's transaction translator (or one TT per port on multi-TT hubs). Jobs
+ * are grouped by TT and by bus and the number of jobs running in each group
+ * is capped, picking jobs from the least busy bus first.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <hidapi/hidapi.h>
+#include <libuhid.h>
+
+#define min_t(type, a, b) (((type)(a)<(type)(b))?(type)(a):(type)(b))
+
+#ifdef __linux__
+static int readSysfs(const char *dir, const char *attr, char *buf, int len)
+{
+	char path[PATH_MAX];
+	FILE *fd;
+	int ret = -1;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	fd = fopen(path, "r");
+	if (!fd)
+		return -1;
+	if (fgets(buf, len, fd)) {
+		buf[strcspn(buf, "\n")] = 0;
+		ret = 0;
+	}
+	fclose(fd);
+	return ret;
+}
+
+static int isUsbDevName(const char *s, int len)
+{
+	int i;
+	int dash = 0;
+
+	for (i = 0; i < len; i++) {
+		if (s[i] == '-' && i > 0 && !dash)
+			dash = 1;
+		else if (!(s[i] >= '0' && s[i] <= '9') && !(dash && s[i] == '.'))
+			return 0;
+	}
+	return dash;
+}
+
+/* Find the sysfs name ("1-2.3") of the usb device behind a hidapi path */
+static int usbDevName(const char *path, char *name, int len)
+{
+	char buf[PATH_MAX];
+	const char *colon = strchr(path, ':');
+	unsigned int bus, addr, iface;
+
+	/* hidapi-libusb >= 0.10: "1-2.3:1.0" */
+	if (colon && isUsbDevName(path, colon - path)) {
+		snprintf(name, len, "%.*s", (int) (colon - path), path);
+		return 0;
+	}
+
+	/* hidapi-libusb < 0.10: "bus:address:interface" */
+	if (sscanf(path, "%x:%x:%x", &bus, &addr, &iface) == 3) {
+		DIR *dir = opendir("/sys/bus/usb/devices");
+		struct dirent *e;
+		int ret = -1;
+		if (!dir)
+			return -1;
+		while ((e = readdir(dir))) {
+			char d[PATH_MAX], val[16];
+			if (!isUsbDevName(e->d_name, strlen(e->d_name)))
+				continue;
+			snprintf(d, sizeof(d), "/sys/bus/usb/devices/%s", e->d_name);
+			if (readSysfs(d, "busnum", val, sizeof(val)) || atoi(val) != bus)
+				continue;
+			if (readSysfs(d, "devnum", val, sizeof(val)) || atoi(val) != addr)
+				continue;
+			snprintf(name, len, "%s", e->d_name);
+			ret = 0;
+			break;
+		}
+		closedir(dir);
+		return ret;
+	}
+
+	/* hidraw: the usb device is an ancestor of the hidraw class device */
+	if (strncmp(path, "/dev/", 5) == 0) {
+		char *p, *end;
+		snprintf(buf, sizeof(buf), "/sys/class/%s/device", &path[5]);
+		p = realpath(buf, NULL);
+		if (!p)
+			return -1;
+		/* .../usb1/1-2/1-2.3/1-2.3:1.0/0003:1D50:6032.0001 */
+		for (end = strrchr(p, '/'); end; end = strrchr(p, '/')) {
+			char *c = end + 1;
+			*end = 0;
+			if (isUsbDevName(c, strlen(c))) {
+				snprintf(name, len, "%s", c);
+				free(p);
+				return 0;
+			}
+		}
+		free(p);
+	}
+	return -1;
+}
+
+/* Virtual devices (uhidsim) only have a phys string: "usb-<busname>-<ports>/input0" */
+static int usbDevNameFromPhys(const char *path, char *name, int len)
+{
+	char uevent[PATH_MAX], line[256], phys[256];
+	char *slash, *dash, *b;
+	FILE *fd;
+
+	if (strncmp(path, "/dev/", 5) != 0)
+		return -1;
+	snprintf(uevent, sizeof(uevent), "/sys/class/%s/device/uevent", &path[5]);
+	fd = fopen(uevent, "r");
+	if (!fd)
+		return -1;
+	phys[0] = 0;
+	while (fgets(line, sizeof(line), fd)) {
+		if (strncmp(line, "HID_PHYS=", 9) == 0) {
+			strcpy(phys, &line[9]);
+			phys[strcspn(phys, "\n")] = 0;
+		}
+	}
+	fclose(fd);
+
+	if (strncmp(phys, "usb-", 4) != 0)
+		return -1;
+	slash = strchr(phys, '/');
+	if (slash)
+		*slash = 0;
+	dash = strrchr(phys, '-');
+	if (!dash || dash == &phys[3])
+		return -1;
+	*dash = 0;
+	/* Use the trailing digits of the bus name as the bus number */
+	for (b = dash; b > &phys[4] && b[-1] >= '0' && b[-1] <= '9'; b--)
+		;
+	snprintf(name, len, "%d-%s", atoi(b), dash + 1);
+	return isUsbDevName(name, strlen(name)) ? 0 : -1;
+}
+
+#endif
+
+/**
+ * Figure out where a device is plugged in. path is hid_device_info->path.
+ * Works on linux with both hidraw and libusb flavours of hidapi. Elsewhere
+ * (or if the device can't be found in sysfs) all devices end up on bus 0
+ * with no shared TT.
+ *
+ * @return 0 if the topology is known, -1 otherwise
+ */
+UHID_API int uhidGetTopology(const char *path, struct uhidTopology *t)
+{
+	memset(t, 0, sizeof(*t));
+#ifdef __linux__
+	char name[40], dir[PATH_MAX], val[16];
+	char *dot;
+	int sysfs = 1;
+
+	if (usbDevName(path, name, sizeof(name)) != 0) {
+		if (usbDevNameFromPhys(path, name, sizeof(name)) != 0)
+			return -1;
+		sysfs = 0;
+	}
+
+	t->bus = atoi(name);
+	snprintf(t->ports, sizeof(t->ports), "%s", strchr(name, '-') + 1);
+
+	snprintf(dir, sizeof(dir), "/sys/bus/usb/devices/%s", name);
+	if (sysfs && readSysfs(dir, "speed", val, sizeof(val)) == 0)
+		t->speed = atoi(val);
+
+	/* High speed devices don't go through a TT at all */
+	if (t->speed >= 480) {
+		snprintf(t->tt, sizeof(t->tt), "%d", t->bus);
+		return 0;
+	}
+
+	/* Walk up towards the root hub looking for a high speed hub */
+	while ((dot = strrchr(name, '.'))) {
+		int port = atoi(dot + 1);
+		*dot = 0;
+		snprintf(dir, sizeof(dir), "/sys/bus/usb/devices/%s", name);
+		if (sysfs && (readSysfs(dir, "speed", val, sizeof(val)) ||
+			      atoi(val) < 480))
+			continue;
+
+		/* bDeviceProtocol 2 means one TT per port */
+		if (sysfs && readSysfs(dir, "bDeviceProtocol", val, sizeof(val)) == 0 &&
+		    strtol(val, NULL, 16) == 2)
+			snprintf(t->tt, sizeof(t->tt), "%s#%d", name, port);
+		else
+			snprintf(t->tt, sizeof(t->tt), "%s", name);
+		return 0;
+	}
+
+	/* Plugged into a root port */
+	snprintf(t->tt, sizeof(t->tt), "%d", t->bus);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+static uint64_t nowMs(void)
+{
+	struct timespec tv;
+	clock_gettime(CLOCK_MONOTONIC, &tv);
+	return tv.tv_sec * 1000 + (tv.tv_nsec / 1000000UL);
+}
+
+static pthread_mutex_t openLock = PTHREAD_MUTEX_INITIALIZER;
+
+struct schedState {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct uhidJob *jobs;
+	int njobs;
+	int done;
+	struct uhidSchedule *sched;
+};
+
+static int busyCount(struct schedState *s, struct uhidJob *job, int sameTT)
+{
+	int i, n = 0;
+
+	for (i = 0; i < s->njobs; i++) {
+		struct uhidJob *j = &s->jobs[i];
+		if (j->state != UHID_JOB_RUNNING)
+			continue;
+		if (j->topo.bus != job->topo.bus)
+			continue;
+		if (sameTT && strcmp(j->topo.tt, job->topo.tt) != 0)
+			continue;
+		n++;
+	}
+	return n;
+}
+
+/* Next job that fits the limits, from the least loaded bus. Called locked */
+static struct uhidJob *pickJob(struct schedState *s)
+{
+	struct uhidJob *best = NULL;
+	int bestLoad = 0;
+	int i;
+
+	for (i = 0; i < s->njobs; i++) {
+		struct uhidJob *j = &s->jobs[i];
+		int load;
+		if (j->state != UHID_JOB_PENDING)
+			continue;
+		if (s->sched->perTT && busyCount(s, j, 1) >= s->sched->perTT)
+			continue;
+		load = busyCount(s, j, 0);
+		if (s->sched->perBus && load >= s->sched->perBus)
+			continue;
+		if (!best || load < bestLoad) {
+			best = j;
+			bestLoad = load;
+		}
+	}
+	return best;
+}
+
+static void *worker(void *arg)
+{
+	struct schedState *s = arg;
+
+	pthread_mutex_lock(&s->lock);
+	while (s->done < s->njobs) {
+		struct uhidJob *job = pickJob(s);
+		if (!job) {
+			int i, pending = 0;
+			for (i = 0; i < s->njobs; i++)
+				pending += (s->jobs[i].state == UHID_JOB_PENDING);
+			if (!pending)
+				break;
+			pthread_cond_wait(&s->cond, &s->lock);
+			continue;
+		}
+		job->state = UHID_JOB_RUNNING;
+		job->startMs = nowMs();
+		pthread_mutex_unlock(&s->lock);
+
+		/* hidapi doesn't promise opening to be thread safe */
+		hid_device *dev = NULL;
+		if (!uhidCancelled(s->sched->cancel)) {
+			pthread_mutex_lock(&openLock);
+			dev = hid_open_path(job->path);
+			pthread_mutex_unlock(&openLock);
+		}
+		uhidResetXferStats();
+		/* A hung device only takes its own job down */
+		struct uhidLimits limits = {
+			.timeoutMs = s->sched->jobTimeoutMs,
+			.reportTimeoutMs = s->sched->reportTimeoutMs,
+			.cancel = s->sched->cancel,
+		};
+		uhidSetLimits(&limits);
+		if (uhidCancelled(s->sched->cancel)) {
+			job->result = -ECANCELED;
+		} else if (dev) {
+			uhidStatusBegin(dev, job->name, NULL);
+			job->result = job->run(job, dev);
+			uhidStatusEnd(job->result);
+		} else {
+			job->result = -ENODEV;
+		}
+		if (dev)
+			hid_close(dev);
+		uhidSetLimits(NULL);
+		uhidGetXferStats(&job->stats);
+		job->bytes = job->stats.bytes;
+
+		pthread_mutex_lock(&s->lock);
+		job->endMs = nowMs();
+		job->state = UHID_JOB_DONE;
+		s->done++;
+		pthread_cond_broadcast(&s->cond);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+/**
+ * Run jobs concurrently, honoring the limits in sched (0 means no limit).
+ * job->path, job->run and job->arg must be filled in by the caller, the
+ * topology is looked up here. Each job gets its own device handle and the
+ * timeouts in sched apply to each job on its own, so a device that stops
+ * answering fails with -ETIMEDOUT while the others carry on.
+ *
+ * @return the number of failed jobs
+ */
+UHID_API int uhidRunJobs(struct uhidJob *jobs, int njobs, struct uhidSchedule *sched)
+{
+	struct schedState s = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.jobs = jobs,
+		.njobs = njobs,
+		.sched = sched,
+	};
+	int nthreads = sched->maxJobs ? min_t(int, sched->maxJobs, njobs) : njobs;
+	pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+	int i, started = 0, failed = 0, err = 0;
+
+	if (!threads)
+		return njobs;
+
+	for (i = 0; i < njobs; i++) {
+		uhidGetTopology(jobs[i].path, &jobs[i].topo);
+		jobs[i].state = UHID_JOB_PENDING;
+	}
+
+	/* Fewer workers than asked for still get through all the jobs */
+	for (i = 0; i < nthreads; i++) {
+		err = pthread_create(&threads[started], NULL, worker, &s);
+		if (err)
+			break;
+		started++;
+	}
+	if (err)
+		fprintf(stderr, "Only %d of %d workers started: %s\n",
+			started, nthreads, strerror(err));
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	for (i = 0; i < njobs; i++) {
+		/* Only if no worker started at all */
+		if (jobs[i].state == UHID_JOB_PENDING)
+			jobs[i].result = -EAGAIN;
+		failed += (jobs[i].result != 0);
+	}
+	return failed;
+}
+
+/* Sums up the jobs on bus (and behind tt, if not NULL) into one line */
+static void printAggregate(struct uhidJob *jobs, int njobs, int bus, const char *tt,
+			   const char *prefix)
+{
+	uint64_t bytes = 0, start = UINT64_MAX, end = 0;
+	int j, devices = 0;
+
+	for (j = 0; j < njobs; j++) {
+		if (jobs[j].topo.bus != bus || (tt && strcmp(jobs[j].topo.tt, tt)))
+			continue;
+		devices++;
+		bytes += jobs[j].bytes;
+		start = min_t(uint64_t, start, jobs[j].startMs);
+		end = (jobs[j].endMs > end) ? jobs[j].endMs : end;
+	}
+	printf("%s: %d device(s), %llu bytes in %llu ms, %.1f KiB/s\n",
+	       prefix, devices, (unsigned long long) bytes,
+	       (unsigned long long) (end - start),
+	       (end > start) ? (bytes * 1000.0 / 1024.0) / (end - start) : 0.0);
+}
+
+/**
+ * Print aggregate throughput of finished jobs per bus and per TT, then
+ * each job. A TT that is much slower than the others on its bus has too
+ * many devices behind it.
+ */
+UHID_API void uhidPrintJobStats(struct uhidJob *jobs, int njobs)
+{
+	char prefix[96];
+	int i, j, k;
+
+	for (i = 0; i < njobs; i++) {
+		int bus = jobs[i].topo.bus;
+
+		/* First job on this bus does the printing */
+		for (j = 0; j < i; j++)
+			if (jobs[j].topo.bus == bus)
+				break;
+		if (j < i)
+			continue;
+
+		snprintf(prefix, sizeof(prefix), "Bus %d", bus);
+		printAggregate(jobs, njobs, bus, NULL, prefix);
+
+		/* Then every TT on it, by its first job */
+		for (j = i; j < njobs; j++) {
+			const char *tt = jobs[j].topo.tt;
+			if (jobs[j].topo.bus != bus || !tt[0])
+				continue;
+			for (k = i; k < j; k++)
+				if (jobs[k].topo.bus == bus && strcmp(jobs[k].topo.tt, tt) == 0)
+					break;
+			if (k < j)
+				continue;
+			snprintf(prefix, sizeof(prefix), "  TT %s", tt);
+			printAggregate(jobs, njobs, bus, tt, prefix);
+		}
+
+		for (j = i; j < njobs; j++) {
+			struct uhidJob *job = &jobs[j];
+			uint64_t ms = job->endMs - job->startMs;
+			if (job->topo.bus != bus)
+				continue;
+			printf("  %-16s tt %-12s %s %llu bytes in %llu ms, %.1f KiB/s\n",
+			       job->path, job->topo.tt[0] ? job->topo.tt : "-",
+			       job->result == -ETIMEDOUT ? "HUNG  " :
+			       job->result ? "FAILED" : "ok    ",
+			       (unsigned long long) job->bytes, (unsigned long long) ms,
+			       ms ? (job->bytes * 1000.0 / 1024.0) / ms : 0.0);
+		}
+	}
+}
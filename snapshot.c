@@ -0,0 +1,399 @@
+/*
+ *  uHID Universal MCU Bootloader. Library.
+ *  Copyright (C) 2016  Andrew 'Necromant' Andrianov
+ *
+ *  This file is part of uHID project. uHID was initially based
+ *  on bootloadHID avr bootloader by Christian Starkjohann
+ *  Since no original userspace code remains, all userspace code
+ *  is now LGPLv2.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Whole device snapshots (.uhs). Everything is little endian:
+ *
+ *   "UHS2" [info length, 16 bit] [info report]
+ *   for every partition:
+ *     [part, 8 bit] [size, 32 bit] [chunks...] [0, 32 bit] [crc32, 32 bit]
+ *   [0xff]
+ *
+ * A chunk is a 32 bit header followed by that many bytes of data, or, with
+ * bit 31 set, a run of that many erased bytes and no data. The file is
+ * written in one go as the partitions are read, nothing is seeked back to.
+ * "UHS2" files hold the info in the layout uhidReadInfo() returns, "UHS1"
+ * ones what version 1 and 2 devices sent.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <hidapi/hidapi.h>
+#include <libuhid.h>
+
+#define min_t(type, a, b) (((type)(a)<(type)(b))?(type)(a):(type)(b))
+
+#define UHS_MAGIC        "UHS2"
+#define UHS_MAGIC_V1     "UHS1"
+#define UHS_END          0xff
+#define UHS_ERASED       0x80000000
+#define UHS_RUN_MAX      0x7fffffff
+/* Shorter runs of erased bytes cost less as data than as their own chunk */
+#define UHS_MIN_RUN      16
+#define UHS_LITERAL_MAX  4096
+
+struct uhsWriter {
+	FILE *fd;
+	uint32_t crc;
+	uint32_t erased;
+	uint32_t litLen;
+	unsigned char lit[UHS_LITERAL_MAX];
+};
+
+static int put8(FILE *fd, uint8_t v)
+{
+	return (fputc(v, fd) == EOF) ? -EIO : 0;
+}
+
+static int put16(FILE *fd, uint16_t v)
+{
+	unsigned char b[2] = { v, v >> 8 };
+
+	return (fwrite(b, sizeof(b), 1, fd) != 1) ? -EIO : 0;
+}
+
+static int put32(FILE *fd, uint32_t v)
+{
+	unsigned char b[4] = { v, v >> 8, v >> 16, v >> 24 };
+
+	return (fwrite(b, sizeof(b), 1, fd) != 1) ? -EIO : 0;
+}
+
+static int get8(FILE *fd, uint8_t *v)
+{
+	int c = fgetc(fd);
+
+	if (c == EOF)
+		return -EINVAL;
+	*v = c;
+	return 0;
+}
+
+static int get16(FILE *fd, uint16_t *v)
+{
+	unsigned char b[2];
+
+	if (fread(b, sizeof(b), 1, fd) != 1)
+		return -EINVAL;
+	*v = b[0] | (b[1] << 8);
+	return 0;
+}
+
+static int get32(FILE *fd, uint32_t *v)
+{
+	unsigned char b[4];
+
+	if (fread(b, sizeof(b), 1, fd) != 1)
+		return -EINVAL;
+	*v = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+	return 0;
+}
+
+static int flushLiteral(struct uhsWriter *w)
+{
+	if (!w->litLen)
+		return 0;
+	if (put32(w->fd, w->litLen) || fwrite(w->lit, w->litLen, 1, w->fd) != 1)
+		return -EIO;
+	w->litLen = 0;
+	return 0;
+}
+
+static int addLiteral(struct uhsWriter *w, const unsigned char *data, uint32_t len)
+{
+	while (len) {
+		uint32_t n = min_t(uint32_t, len, UHS_LITERAL_MAX - w->litLen);
+		memcpy(&w->lit[w->litLen], data, n);
+		w->litLen += n;
+		data += n;
+		len -= n;
+		if (w->litLen == UHS_LITERAL_MAX && flushLiteral(w))
+			return -EIO;
+	}
+	return 0;
+}
+
+static int flushErased(struct uhsWriter *w)
+{
+	unsigned char erased[UHS_MIN_RUN];
+	uint32_t n = w->erased;
+
+	w->erased = 0;
+	if (n < UHS_MIN_RUN) {
+		memset(erased, UHID_ERASED_BYTE, n);
+		return addLiteral(w, erased, n);
+	}
+	if (flushLiteral(w))
+		return -EIO;
+	return put32(w->fd, UHS_ERASED | n);
+}
+
+static int snapshotSink(void *arg, const char *data, int len)
+{
+	struct uhsWriter *w = arg;
+	const unsigned char *p = (const unsigned char *) data;
+	int i = 0, j, ret;
+
+	w->crc = CRC32FromBuf(w->crc, data, len);
+	while (i < len) {
+		if (p[i] == UHID_ERASED_BYTE) {
+			w->erased++;
+			i++;
+			if (w->erased == UHS_RUN_MAX && (ret = flushErased(w)))
+				return ret;
+			continue;
+		}
+		if (w->erased && (ret = flushErased(w)))
+			return ret;
+		for (j = i; j < len && p[j] != UHID_ERASED_BYTE; j++)
+			;
+		ret = addLiteral(w, &p[i], j - i);
+		if (ret)
+			return ret;
+		i = j;
+	}
+	return 0;
+}
+
+static int snapshotPart(hid_device *dev, struct uhidWorkspace *ws, int part,
+			struct uhsWriter *w)
+{
+	struct uHidPartInfo *p = &uhidWorkspaceInfo(ws)->parts[part];
+	int ret;
+
+	printf("Reading partition %d (%s), %u bytes\n", part, p->name, p->size);
+	w->crc = 0;
+	w->erased = 0;
+	w->litLen = 0;
+	if (put8(w->fd, part) || put32(w->fd, p->size))
+		return -EIO;
+	ret = uhidReadRangeWs(dev, ws, part, 0, p->size, snapshotSink, w);
+	if (ret)
+		return ret;
+	if (w->erased && flushErased(w))
+		return -EIO;
+	if (flushLiteral(w) || put32(w->fd, 0) || put32(w->fd, w->crc))
+		return -EIO;
+	return 0;
+}
+
+/**
+ * Save the info report and every partition of dev to filename. Runs of
+ * erased bytes take up almost no space, each partition is stored with its
+ * CRC32.
+ *
+ * @return 0 or -errno
+ */
+UHID_API int uhidSnapshot(hid_device *dev, const char *filename)
+{
+	struct uhidWorkspace ws;
+	struct uhsWriter *w;
+	int i, ret;
+
+	uhidWorkspaceInit(&ws, NULL, 0);
+	ret = uhidReadInfoWs(dev, &ws);
+	if (ret)
+		return ret;
+
+	w = malloc(sizeof(*w));
+	if (!w)
+		return -ENOMEM;
+	w->fd = fopen(filename, "wb");
+	if (!w->fd) {
+		ret = -errno;
+		fprintf(stderr, "error opening %s: %s\n", filename, strerror(errno));
+		free(w);
+		return ret;
+	}
+
+	if (fwrite(UHS_MAGIC, 4, 1, w->fd) != 1 || put16(w->fd, sizeof(ws.info)) ||
+	    fwrite(ws.info, sizeof(ws.info), 1, w->fd) != 1)
+		ret = -EIO;
+	/* Reading a partition re-reads the info report, ws.info stays the same */
+	for (i = 0; !ret && i < uhidWorkspaceInfo(&ws)->numParts; i++)
+		ret = snapshotPart(dev, &ws, i, w);
+	if (!ret)
+		ret = put8(w->fd, UHS_END);
+	if (fclose(w->fd) && !ret)
+		ret = -errno;
+	free(w);
+	if (ret == -EIO)
+		fprintf(stderr, "error writing %s\n", filename);
+	return ret;
+}
+
+/* The partition table must be the same, the rest of the info may differ */
+static int sameLayout(struct uHidDeviceInfo *a, struct uHidDeviceInfo *b)
+{
+	int i;
+
+	if (a->numParts != b->numParts)
+		return 0;
+	for (i = 0; i < a->numParts; i++) {
+		if (a->parts[i].size != b->parts[i].size ||
+		    a->parts[i].pageSize != b->parts[i].pageSize ||
+		    strncmp((char *) a->parts[i].name, (char *) b->parts[i].name,
+			    UISP_PART_NAME_LEN) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+/* Decodes a partition of size bytes into buf */
+static int restoreRead(FILE *fd, char *buf, uint32_t size, uint32_t *crc)
+{
+	uint32_t pos = 0, hdr;
+
+	for (;;) {
+		if (get32(fd, &hdr))
+			return -EINVAL;
+		if (!hdr)
+			break;
+		uint32_t n = hdr & UHS_RUN_MAX;
+		if (n > size - pos)
+			return -EINVAL;
+		if (hdr & UHS_ERASED)
+			memset(&buf[pos], UHID_ERASED_BYTE, n);
+		else if (fread(&buf[pos], n, 1, fd) != 1)
+			return -EINVAL;
+		pos += n;
+	}
+	if (pos != size || get32(fd, crc))
+		return -EINVAL;
+	return 0;
+}
+
+static int restorePart(hid_device *dev, struct uHidDeviceInfo *inf, int part,
+		       const char *buf, uint32_t size, uint32_t want)
+{
+	const char *name = (const char *) inf->parts[part].name;
+	uint32_t crc;
+	int ret;
+
+	ret = uhidGetRangeCRC(dev, part, 0, size, &crc);
+	if (ret)
+		return ret;
+	if (crc == want) {
+		printf("Partition %d (%s) is unchanged, skipping\n", part, name);
+		return 0;
+	}
+
+	printf("Writing partition %d (%s), %u bytes\n", part, name, size);
+	/* Verified too with UHID_FLAG_VERIFY */
+	return uhidWritePart(dev, part, buf, size);
+}
+
+/**
+ * Write a snapshot made with uhidSnapshot() back to dev, which must have
+ * the same partition table. Partitions that already have the right CRC
+ * are left alone. With UHID_FLAG_VERIFY set the others are verified.
+ *
+ * @return 0, 1 if verification failed or -errno
+ */
+UHID_API int uhidRestore(hid_device *dev, const char *filename)
+{
+	struct uhidWorkspace ws;
+	unsigned char info[UHID_INFO_MAX], raw[UHID_INFO_MAX];
+	struct uHidDeviceInfo *inf = (struct uHidDeviceInfo *) info;
+	char magic[4], *buf = NULL;
+	uint16_t infoLen;
+	uint8_t part;
+	uint32_t size, crc;
+	FILE *fd;
+	int ret;
+
+	uhidWorkspaceInit(&ws, NULL, 0);
+	ret = uhidReadInfoWs(dev, &ws);
+	if (ret)
+		return ret;
+
+	fd = fopen(filename, "rb");
+	if (!fd) {
+		ret = -errno;
+		fprintf(stderr, "error opening %s: %s\n", filename, strerror(errno));
+		return ret;
+	}
+
+	memset(raw, 0, sizeof(raw));
+	if (fread(magic, sizeof(magic), 1, fd) != 1 ||
+	    (memcmp(magic, UHS_MAGIC, 4) && memcmp(magic, UHS_MAGIC_V1, 4)) ||
+	    get16(fd, &infoLen) || infoLen > sizeof(raw) ||
+	    fread(raw, infoLen, 1, fd) != 1) {
+		fprintf(stderr, "%s: not a uHID snapshot\n", filename);
+		ret = -EINVAL;
+		goto bailout;
+	}
+	/* Older snapshots have the partition table with 8-bit ioSizes */
+	if (!memcmp(magic, UHS_MAGIC_V1, 4)) {
+		ret = infoParse(raw, infoLen, info, sizeof(info));
+		if (ret)
+			goto bailout;
+	} else {
+		memcpy(info, raw, sizeof(info));
+		if (sizeof(*inf) + inf->numParts * sizeof(inf->parts[0]) > infoLen) {
+			fprintf(stderr, "%s: not a uHID snapshot\n", filename);
+			ret = -EINVAL;
+			goto bailout;
+		}
+	}
+	if (!sameLayout(inf, uhidWorkspaceInfo(&ws))) {
+		fprintf(stderr, "%s: was taken from a device with different partitions\n",
+			filename);
+		ret = -EINVAL;
+		goto bailout;
+	}
+
+	for (;;) {
+		if (get8(fd, &part))
+			goto corrupt;
+		if (part == UHS_END)
+			break;
+		if (part >= inf->numParts || get32(fd, &size) ||
+		    size != inf->parts[part].size)
+			goto corrupt;
+		free(buf);
+		buf = malloc(size ? size : 1);
+		if (!buf) {
+			ret = -ENOMEM;
+			break;
+		}
+		if (restoreRead(fd, buf, size, &crc) || CRC32FromBuf(0, buf, size) != crc)
+			goto corrupt;
+		ret = restorePart(dev, inf, part, buf, size, crc);
+		if (ret)
+			break;
+	}
+	goto bailout;
+
+corrupt:
+	fprintf(stderr, "%s: corrupt snapshot\n", filename);
+	ret = -EINVAL;
+bailout:
+	free(buf);
+	fclose(fd);
+	return ret;
+}
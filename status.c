@@ -0,0 +1,345 @@
+/*
+ *  uHID Universal MCU Bootloader. Library.
+ *  Copyright (C) 2016  Andrew 'Necromant' Andrianov
+ *
+ *  This file is part of uHID project. uHID was initially based
+ *  on bootloadHID avr bootloader by Christian Starkjohann
+ *  Since no original userspace code remains, all userspace code
+ *  is now LGPLv2.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Status board. A file, usually in /dev/shm, that every process working on
+ * a device can map and publish its progress in, one struct uhidStatusSlot
+ * per device. The layout, in host byte order:
+ *
+ *   0   magic, "UHSB"
+ *   4   slot size (128)
+ *   8   number of slots
+ *   64  the slots
+ *
+ * Only the process in slot->pid writes a slot. It makes slot->seq odd
+ * before and even again after each update, so readers copy a slot, check
+ * that seq was even and didn't change, and otherwise try again. Neither
+ * side takes a lock or makes a syscall. Slots of processes that are gone
+ * keep their last state until a device needs the slot.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <wchar.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/file.h>
+#endif
+#include <hidapi/hidapi.h>
+#include <libuhid.h>
+
+#define STATUS_MAGIC       0x42534855
+#define STATUS_HEADER_SIZE 64
+#define STATUS_MAX_SLOTS   4096
+/* A reader gives up on a slot whose writer died in the middle of an update */
+#define STATUS_READ_TRIES  10000
+
+struct statusHeader {
+	uint32_t      magic;
+	uint32_t      slotSize;
+	uint32_t      numSlots;
+};
+
+static struct statusHeader *board;
+static struct uhidStatusSlot *slots;
+static int writable;
+
+/* The slot of the device this thread works on */
+static __thread struct uhidStatusSlot *mySlot;
+static __thread uint64_t myStart;
+
+static uint64_t nowUs(void)
+{
+	struct timespec tv;
+	clock_gettime(CLOCK_MONOTONIC, &tv);
+	return tv.tv_sec * 1000000ULL + tv.tv_nsec / 1000;
+}
+
+#ifndef _WIN32
+static void *mapBoard(int fd, size_t len)
+{
+	void *p = mmap(NULL, len, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+		       fd, 0);
+
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+/* Sets up a new board file, the caller holds its lock */
+static int boardCreate(int fd, int numSlots)
+{
+	size_t len = STATUS_HEADER_SIZE + (size_t) numSlots * sizeof(struct uhidStatusSlot);
+
+	if (!writable)
+		return -EACCES;
+	if (ftruncate(fd, len))
+		return -errno;
+	board = mapBoard(fd, len);
+	if (!board)
+		return -errno;
+	board->slotSize = sizeof(struct uhidStatusSlot);
+	board->numSlots = numSlots;
+	__atomic_store_n(&board->magic, STATUS_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static int boardAttach(int fd, off_t size)
+{
+	struct statusHeader h;
+
+	if (size < STATUS_HEADER_SIZE || pread(fd, &h, sizeof(h), 0) != sizeof(h))
+		return -EINVAL;
+	if (h.magic != STATUS_MAGIC || h.slotSize != sizeof(struct uhidStatusSlot) ||
+	    !h.numSlots || h.numSlots > STATUS_MAX_SLOTS ||
+	    size < STATUS_HEADER_SIZE + (off_t) h.numSlots * h.slotSize) {
+		fprintf(stderr, "Not a status board or a different version of it\n");
+		return -EINVAL;
+	}
+	board = mapBoard(fd, STATUS_HEADER_SIZE + (size_t) h.numSlots * h.slotSize);
+	return board ? 0 : -errno;
+}
+#endif
+
+/**
+ * Map the status board at path, creating it with numSlots slots if it
+ * doesn't exist. Once per process, before any uhidStatusBegin(). A board
+ * that can only be read is fine for uhidStatusRead().
+ *
+ * @return 0 or -errno
+ */
+UHID_API int uhidStatusOpen(const char *path, int numSlots)
+{
+#ifdef _WIN32
+	return -ENOSYS;
+#else
+	struct stat st;
+	int fd, ret;
+
+	if (board)
+		return -EALREADY;
+	if (numSlots < 1 || numSlots > STATUS_MAX_SLOTS)
+		return -EINVAL;
+	writable = 1;
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+	if (fd < 0 && errno == EACCES) {
+		writable = 0;
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+	}
+	if (fd < 0)
+		return -errno;
+
+	/* The first one to get here sets it up, the others wait for that */
+	if (flock(fd, LOCK_EX) || fstat(fd, &st)) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+	ret = st.st_size ? boardAttach(fd, st.st_size) : boardCreate(fd, numSlots);
+	flock(fd, LOCK_UN);
+	close(fd);
+	if (ret) {
+		board = NULL;
+		return ret;
+	}
+	slots = (struct uhidStatusSlot *) ((char *) board + STATUS_HEADER_SIZE);
+	return 0;
+#endif
+}
+
+/* Number of slots on the board, 0 if there is none */
+UHID_API int uhidStatusSlots(void)
+{
+	return board ? board->numSlots : 0;
+}
+
+/**
+ * Copy slot number i to out. Never blocks, just retries while the owner is
+ * in the middle of an update.
+ *
+ * @return 0, -ENOENT if there is no such slot or -EAGAIN if the owner died
+ * halfway through an update
+ */
+UHID_API int uhidStatusRead(int i, struct uhidStatusSlot *out)
+{
+	struct uhidStatusSlot *s;
+	uint32_t seq;
+	int tries;
+
+	if (!board || i < 0 || (uint32_t) i >= board->numSlots)
+		return -ENOENT;
+	s = &slots[i];
+	for (tries = 0; tries < STATUS_READ_TRIES; tries++) {
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(out, s, sizeof(*out));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+	return -EAGAIN;
+}
+
+static void slotWriteBegin(struct uhidStatusSlot *s)
+{
+	uint32_t seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+
+	/* Still odd if the last owner died while writing */
+	if (!(seq & 1))
+		__atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void slotWriteEnd(struct uhidStatusSlot *s)
+{
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+static int pidAlive(int32_t pid)
+{
+#ifdef _WIN32
+	return pid != 0;
+#else
+	return pid > 0 && (pid == getpid() || kill(pid, 0) == 0 || errno != ESRCH);
+#endif
+}
+
+/* The slot this device had last time, or else any free one */
+static struct uhidStatusSlot *slotClaim(const char *serial)
+{
+	int32_t me = getpid();
+	uint32_t i;
+	int pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < board->numSlots; i++) {
+			struct uhidStatusSlot *s = &slots[i];
+			int32_t pid = __atomic_load_n(&s->pid, __ATOMIC_ACQUIRE);
+
+			if (!pass && (!pid || strncmp(s->serial, serial, sizeof(s->serial))))
+				continue;
+			/* One thread per device, so that is our own from before */
+			if (!pass && pid == me)
+				return s;
+			if (pidAlive(pid))
+				continue;
+			if (__atomic_compare_exchange_n(&s->pid, &pid, me, 0, __ATOMIC_ACQ_REL,
+							__ATOMIC_ACQUIRE))
+				return s;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Start publishing what the calling thread does to dev in the device's
+ * slot, as phase (e.g. "write") on part, which may be NULL. Progress is
+ * updated by the library as it goes until uhidStatusEnd(). Does nothing
+ * without a board, see uhidStatusOpen().
+ *
+ * @return 0 or -errno
+ */
+UHID_API int uhidStatusBegin(hid_device *dev, const char *phase, const char *part)
+{
+	char serial[sizeof(mySlot->serial)];
+	wchar_t ws[64];
+	struct uhidStatusSlot *s;
+
+	if (!board)
+		return 0;
+	if (!writable)
+		return -EACCES;
+	serial[0] = 0;
+	if (hid_get_serial_number_string(dev, ws, 64) == 0) {
+		ws[63] = 0;
+		if (wcstombs(serial, ws, sizeof(serial) - 1) == (size_t) -1)
+			serial[0] = 0;
+	}
+	serial[sizeof(serial) - 1] = 0;
+
+	if (!mySlot || strncmp(mySlot->serial, serial, sizeof(serial)))
+		mySlot = slotClaim(serial);
+	s = mySlot;
+	if (!s) {
+		fprintf(stderr, "The status board is full\n");
+		return -ENOSPC;
+	}
+
+	myStart = nowUs();
+	slotWriteBegin(s);
+	snprintf(s->serial, sizeof(s->serial), "%s", serial);
+	snprintf(s->phase, sizeof(s->phase), "%s", phase ? phase : "");
+	snprintf(s->part, sizeof(s->part), "%s", part ? part : "");
+	s->bytes = 0;
+	s->total = 0;
+	s->rate = 0;
+	s->result = 0;
+	s->state = UHID_STATUS_RUNNING;
+	s->elapsedMs = 0;
+	s->updatedMs = myStart / 1000;
+	slotWriteEnd(s);
+	return 0;
+}
+
+/* Called with every progress update of the library */
+UHID_NO_EXPORT void statusProgress(uint64_t cur, uint64_t max)
+{
+	struct uhidStatusSlot *s = mySlot;
+	uint64_t us;
+
+	if (!s || s->state != UHID_STATUS_RUNNING)
+		return;
+	us = nowUs() - myStart;
+	slotWriteBegin(s);
+	s->bytes = cur;
+	s->total = max;
+	s->elapsedMs = us / 1000;
+	s->rate = us ? cur * 1000000 / us : 0;
+	s->updatedMs = (myStart + us) / 1000;
+	slotWriteEnd(s);
+}
+
+/* The thread is done with its device, result is 0 or -errno */
+UHID_API void uhidStatusEnd(int result)
+{
+	struct uhidStatusSlot *s = mySlot;
+	uint64_t now;
+
+	if (!s)
+		return;
+	now = nowUs();
+	slotWriteBegin(s);
+	s->result = result;
+	s->state = UHID_STATUS_DONE;
+	s->elapsedMs = (now - myStart) / 1000;
+	s->updatedMs = now / 1000;
+	slotWriteEnd(s);
+}
@@ -0,0 +1,25 @@
+#!/bin/bash
+#usage: test binary part len [extra uhidtool options]
+# Writes an ELF file through stdin, which is a regular file then
+set -e
+BIN=$1
+PART=$2
+LEN=$3
+shift 3
+
+le16() { printf "\\$(printf %03o $(($1 & 255)))\\$(printf %03o $(($1 >> 8 & 255)))"; }
+le32() { le16 $(($1 & 65535)); le16 $(($1 >> 16)); }
+
+dd if=/dev/urandom of=random.bin bs=1024 count=$LEN
+SIZE=$((LEN * 1024))
+{
+	# ELF32 LSB header, EM_AVR, one program header right behind it
+	printf '\177ELF\001\001\001\000\000\000\000\000\000\000\000\000'
+	le16 2; le16 83; le32 1; le32 0; le32 52; le32 0; le32 0
+	le16 52; le16 32; le16 1; le16 0; le16 0; le16 0
+	# PT_LOAD of the whole payload to address 0
+	le32 1; le32 84; le32 0; le32 0; le32 $SIZE; le32 $SIZE; le32 5; le32 1
+	cat random.bin
+} > random.elf
+$BIN "$@" --part $PART --write - < random.elf
+$BIN "$@" --part $PART --verify random.bin
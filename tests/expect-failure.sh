@@ -0,0 +1,13 @@
+#!/bin/bash
+#usage: expect-failure.sh pattern test [test args]
+# Passes if the test fails and its output has a line matching pattern
+PATTERN=$1
+shift
+
+if "$@" > output.log 2>&1; then
+    cat output.log
+    echo "expected a failure, but the test passed"
+    exit 1
+fi
+cat output.log
+tr '\r' '\n' < output.log | grep -q -- "$PATTERN"
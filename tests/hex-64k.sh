@@ -0,0 +1,35 @@
+#!/bin/bash
+#usage: test binary part len [extra uhidtool options]
+# Intel HEX past 64K, read back from the device and moved to 0x08000000,
+# also exported and written back with that base
+set -e
+BIN=$1
+PART=$2
+LEN=$3
+shift 3
+
+dd if=/dev/urandom of=random.bin bs=1024 count=$LEN
+dd if=/dev/zero of=zero.bin bs=1024 count=$LEN
+$BIN "$@" --part $PART --write random.bin
+$BIN "$@" --part $PART --read random.hex
+$BIN "$@" --part $PART --write zero.bin
+$BIN "$@" --part $PART --write random.hex
+$BIN "$@" --part $PART --verify random.bin
+
+# Same image, linked to 0x08000000
+sed -e 's/^:020000040000FA/:020000040800F2/' -e 's/^:020000040001F9/:020000040801F1/' \
+    random.hex > moved.hex
+$BIN "$@" --part $PART --write zero.bin
+if $BIN "$@" --part $PART --write moved.hex; then
+    echo "moved.hex was written without --hex-base"
+    exit 1
+fi
+$BIN "$@" --hex-base 0x08000000 --part $PART --write moved.hex
+$BIN "$@" --part $PART --verify random.bin
+
+# Read back with the same base, which has to give the moved addresses
+$BIN "$@" --hex-base 0x08000000 --part $PART --read based.hex
+cmp based.hex moved.hex
+$BIN "$@" --part $PART --write zero.bin
+$BIN "$@" --hex-base 0x08000000 --part $PART --write based.hex
+$BIN "$@" --part $PART --verify random.bin
@@ -0,0 +1,22 @@
+#!/bin/bash
+#usage: sim-run.sh uhidsim test [test args]
+# Brings up a virtual uHID bootloader, runs the test against it and tears
+# the device down afterwards. $UHIDSIM_ARGS go to uhidsim
+SIM=$1
+shift
+
+$SIM --serial uhidsim:$$ $UHIDSIM_ARGS &
+SIMPID=$!
+trap "kill $SIMPID 2>/dev/null; wait $SIMPID" EXIT
+
+# Wait for the kernel to bind hid-generic and udev to create the hidraw node
+for i in $(seq 50); do
+    node=$(ls -d /sys/devices/virtual/misc/uhid/*/hidraw/hidraw* 2>/dev/null | head -n1)
+    if [ -n "$node" ] && [ -r /dev/$(basename $node) ]; then
+        break
+    fi
+    kill -0 $SIMPID 2>/dev/null || exit 1
+    sleep 0.1
+done
+
+"$@"
@@ -0,0 +1,15 @@
+#!/bin/bash
+#usage: test binary part len [extra uhidtool options]
+set -e
+BIN=$1
+PART=$2
+LEN=$3
+shift 3
+
+dd if=/dev/urandom of=random.bin bs=1024 count=$LEN
+dd if=/dev/urandom of=other.bin bs=1024 count=$LEN
+$BIN "$@" --part $PART --write random.bin
+$BIN "$@" --snapshot snapshot.uhs
+$BIN "$@" --part $PART --write other.bin
+$BIN "$@" --restore snapshot.uhs
+$BIN "$@" --part $PART --verify random.bin
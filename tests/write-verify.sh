@@ -1,5 +1,10 @@
 #!/bin/bash
-#usage: test binary part len
+#usage: test binary part len [extra uhidtool options]
+set -e
+BIN=$1
+PART=$2
+LEN=$3
+shift 3
 
-dd if=/dev/urandom of=random.bin bs=1024 count=$3
-$1 --part $2 --write random.bin
+dd if=/dev/urandom of=random.bin bs=1024 count=$LEN
+$BIN "$@" --part $PART --write random.bin
@@ -0,0 +1,51 @@
+/*
+ *  uHID Universal MCU Bootloader. Library.
+ *  Copyright (C) 2016  Andrew 'Necromant' Andrianov
+ *
+ *  This file is part of uHID project. uHID was initially based
+ *  on bootloadHID avr bootloader by Christian Starkjohann
+ *  Since no original userspace code remains, all userspace code
+ *  is now LGPLv2.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef UHID_PROBES_H
+#define UHID_PROBES_H
+
+/*
+ * Static USDT probes (provider "uhid") for perf/bpftrace/systemtap.
+ * When built without sys/sdt.h these expand to nothing. When built with it,
+ * every probe is a single nop until a tracer attaches, so it is safe to
+ * keep them in release builds. List them with:
+ *
+ *   readelf -n libuhid.so | grep -A2 stapsdt
+ *   bpftrace -l 'usdt:./libuhid.so:uhid:*'
+ */
+
+#ifdef UHID_HAVE_SDT
+#include <sys/sdt.h>
+#define UHID_PROBE1(name, a)          DTRACE_PROBE1(uhid, name, a)
+#define UHID_PROBE2(name, a, b)       DTRACE_PROBE2(uhid, name, a, b)
+#define UHID_PROBE3(name, a, b, c)    DTRACE_PROBE3(uhid, name, a, b, c)
+#define UHID_PROBE4(name, a, b, c, d) DTRACE_PROBE4(uhid, name, a, b, c, d)
+#else
+#define UHID_PROBE1(name, a)          do { } while (0)
+#define UHID_PROBE2(name, a, b)       do { } while (0)
+#define UHID_PROBE3(name, a, b, c)    do { } while (0)
+#define UHID_PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+
+#endif
@@ -25,10 +25,45 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <libuhid.h>
-int main()
+
+static const char usagemsg[] =
+"Usage: \n"
+"%s add app partition file  - Store file (binary, hex or ELF) as what\n"
+"                             application app puts into partition\n"
+"%s write app partition     - Write and verify the stored image\n"
+"\n"
+"Images are kept once in ~/.uHID/store, however many devices use them.\n"
+;
+
+int main(int argc, char **argv)
 {
+    int ret = 1;
+
+    if (argc < 4) {
+        printf(usagemsg, argv[0], argv[0]);
+        return 1;
+    }
+
     hid_device *d = uhidOpen(NULL);
-    struct uhidApplication *r = uhidmgrRepoRead(d);
+    if (!d)
+        return 1;
+
+    int part = uhidLookupPart(d, argv[3]);
+    if (part < 0) {
+        fprintf(stderr, "No such part: %s\n", argv[3]);
+        goto bailout;
+    }
+
+    if (strcmp(argv[1], "add") == 0 && argc == 5)
+        ret = uhidmgrAppAdd(d, argv[2], part, argv[4]);
+    else if (strcmp(argv[1], "write") == 0)
+        ret = uhidmgrAppWrite(d, argv[2], part);
+    else
+        printf(usagemsg, argv[0], argv[0]);
 
+bailout:
+    uhidClose(d);
+    return ret ? 1 : 0;
 }
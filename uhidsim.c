@@ -0,0 +1,842 @@
+/*
+ *  uHID Universal MCU Bootloader. Virtual bootloader for testing.
+ *  Copyright (C) 2016  Andrew 'Necromant' Andrianov
+ *
+ *  This file is part of uHID project. uHID is loosely (very)
+ *  based on bootloadHID avr bootloader by Christian Starkjohann
+ *
+ *  uHID is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  uHID is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with uHID.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * uhidsim creates a virtual HID device via the Linux /dev/uhid interface that
+ * behaves like a uHID bootloader according to the SPEC in README.md. Anything
+ * that talks hidraw (uhidtool built against hidapi-hidraw, hidapi itself,
+ * udev) sees it as a real device, so the whole stack can be tested and
+ * benchmarked end to end without hardware.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/file.h>
+#include <linux/uhid.h>
+#include <libuhid.h>
+
+#define SIM_MAX_PARTS 8
+
+#define min_t(type, a, b) (((type)(a)<(type)(b))?(type)(a):(type)(b))
+
+#define REPORT_ID_INFO 1
+#define REPORT_ID_PART(n) (2 + n)
+
+struct simPart {
+	char          name[UISP_PART_NAME_LEN];
+	uint16_t      pageSize;
+	uint32_t      size;
+	uint16_t      ioSize;
+	uint8_t      *mem;
+	uint8_t      *page;
+	uint64_t      reports_in;
+	uint64_t      reports_out;
+	uint64_t      pages;
+};
+
+static struct simPart parts[SIM_MAX_PARTS];
+static int numParts;
+static uint16_t cpuFreq = 1600;
+static uint32_t ptr;
+static int progUs;
+static int nakUs;
+static uint64_t busyUntil;
+static uint64_t stalls;
+static int reportUs;
+static int sharedFd = -1;
+static const char *simPhys = "uhidsim";
+static int verbose;
+static const char *simName = "uHID simulator";
+static const char *simSerial = "uhidsim:0";
+static uint32_t simVid = 0x1d50;
+static uint32_t simPid = 0x6032;
+static uint32_t caps = UHID_CAP_CONTROL | UHID_CAP_RLE | UHID_CAP_ERASE_ON_ENTRY |
+	UHID_CAP_DIGEST | UHID_CAP_SEEK | UHID_CAP_STATUS | UHID_CAP_WRITE_VERIFY;
+static int infoVer;		/* 0: the oldest one that describes the device */
+static int erased;
+static int64_t badPage = -1;	/* Programming this address does nothing */
+static volatile sig_atomic_t done;
+
+/* UHID_CMD_STREAM_MODE state */
+static int streamMode;
+static uint16_t frameHdr;
+static int frameHdrFill;
+static int frameFill;
+static uint8_t *frameBuf;
+
+/* What reading the control report returns, the last command decides */
+static int controlReply;
+
+/* UHID_CMD_VERIFY state */
+static int verifyOn;
+static uint32_t verifyFailed;
+static uint32_t verifyFirst;
+
+/* Pending UHID_CMD_DIGEST reply */
+static struct simPart *digestPart;
+static uint32_t digestPage;
+static uint32_t digestLeft;
+
+static struct option long_options[] =
+{
+	{"help",     	  no_argument,       0, 'h'},
+	{"part",     	  required_argument, 0, 'p'},
+	{"freq",     	  required_argument, 0, 'f'},
+	{"name",     	  required_argument, 0, 'n'},
+	{"serial",   	  required_argument, 0, 's'},
+	{"device",   	  required_argument, 0, 'd'},
+	{"prog-us",  	  required_argument, 0, 'u'},
+	{"report-us",	  required_argument, 0, 'r'},
+	{"nak-us",   	  required_argument, 0, 'k'},
+	{"phys",     	  required_argument, 0, 'P'},
+	{"shared",   	  required_argument, 0, 'S'},
+	{"verbose",  	  no_argument,       0, 'v'},
+	{"legacy",   	  no_argument,       0, 'l'},
+	{"caps",     	  required_argument, 0, 'c'},
+	{"info-version",  required_argument, 0, 'i'},
+	{"bad-page",      required_argument, 0, 'b'},
+	{0, 0, 0, 0}
+};
+
+static const char usagemsg[] =
+"uHID virtual bootloader (c) Andrew 'Necromant' Andrianov 2016\n"
+"This is free software subject to GPLv2 license.\n\n"
+"Usage: \n"
+"%s [options]\n"
+"  --part name:size:pageSize:ioSize  - Add a partition (up to 8)\n"
+"  --freq 1600                       - CPU frequency in 10kHz units\n"
+"  --name \"uHID simulator\"           - Product name\n"
+"  --serial uhidsim:0                - Serial number\n"
+"  --device 1d50:6032                - USB VID:PID\n"
+"  --prog-us 0                       - Time to program a page, microseconds\n"
+"  --report-us 0                     - Time to transfer a report, microseconds\n"
+"  --nak-us 0                        - Extra time a report costs when it arrives\n"
+"                                      while a page is being programmed\n"
+"  --phys usb-sim1-2.3/input0        - Physical path, for topology tests\n"
+"  --shared /tmp/tt0                 - Simulators using the same file share the\n"
+"                                      bus: only one transfers at a time\n"
+"  --verbose                         - Log every report\n"
+"  --legacy                          - Act as a version 1 bootloader without\n"
+"                                      any optional features\n"
+"  --caps 0x7f                       - UHID_CAP_* bits to advertise\n"
+"  --info-version 3                  - Info report layout. Partitions with\n"
+"                                      ioSize > 255 need (and default to) 3\n"
+"  --bad-page 0x1000                 - Pages at this partition address don't\n"
+"                                      take what is programmed into them\n"
+"\n"
+"Without --part, an atmega328-like flash:28672:128:128 and\n"
+"eeprom:1024:128:128 layout is created. Needs write access to /dev/uhid.\n"
+;
+
+static int addPart(const char *spec)
+{
+	struct simPart *p = &parts[numParts];
+	char name[UISP_PART_NAME_LEN + 1];
+	unsigned int size, pageSize, ioSize;
+
+	if (numParts == SIM_MAX_PARTS)
+		return -1;
+
+	if (sscanf(spec, "%8[^:]:%u:%u:%u", name, &size, &pageSize, &ioSize) != 4)
+		return -1;
+
+	/* A report id and ioSize bytes have to fit in a uhid event */
+	if (!size || !pageSize || pageSize > 0xffff || !ioSize || ioSize >= UHID_DATA_MAX)
+		return -1;
+
+	/* The name is NUL padded, but not terminated at 8 characters */
+	memset(p->name, 0, UISP_PART_NAME_LEN);
+	memcpy(p->name, name, strnlen(name, UISP_PART_NAME_LEN));
+	p->size = size;
+	p->pageSize = pageSize;
+	p->ioSize = ioSize;
+	p->mem = malloc(size);
+	p->page = malloc(pageSize);
+	if (!p->mem || !p->page)
+		return -1;
+	/* Freshly erased flash */
+	memset(p->mem, 0xff, size);
+	memset(p->page, 0xff, pageSize);
+	numParts++;
+	return 0;
+}
+
+static int infoVersion(void)
+{
+	int i;
+
+	if (infoVer)
+		return infoVer;
+	for (i = 0; i < numParts; i++)
+		if (parts[i].ioSize > 0xff)
+			return 3;
+	return caps ? 2 : 1;
+}
+
+static size_t infoSize(void)
+{
+	size_t len = sizeof(struct uHidDeviceInfo);
+
+	if (infoVersion() >= 3)
+		return len + numParts * sizeof(struct uHidPartInfo) + sizeof(caps) +
+			sizeof(uint16_t);
+	len += numParts * sizeof(struct uHidPartInfoV1);
+	if (infoVersion() >= 2)
+		len += sizeof(caps);
+	return len;
+}
+
+static void descReport(uint8_t *d, size_t *n, int id, int count)
+{
+	d[(*n)++] = 0x85; d[(*n)++] = id;                   /* REPORT_ID */
+	d[(*n)++] = 0x96; d[(*n)++] = count & 0xff;         /* REPORT_COUNT */
+	d[(*n)++] = count >> 8;
+	d[(*n)++] = 0x09; d[(*n)++] = 0x00;                 /* USAGE (Undefined) */
+	d[(*n)++] = 0xb2; d[(*n)++] = 0x02; d[(*n)++] = 0x01; /* FEATURE (Data,Var,Abs,Buf) */
+}
+
+/*
+ * Same layout as g_usb_hid_report_desc in descriptor.c, but with one report
+ * per configured partition. That table is firmware code, sized for two
+ * fixed partitions and built against the firmware's usb.h, so it can't be
+ * shared.
+ */
+static size_t buildDescriptor(uint8_t *d)
+{
+	static const uint8_t head[] = {
+		0x06, 0x00, 0xff,              // USAGE_PAGE (Generic Desktop)
+		0x09, 0x01,                    // USAGE (Vendor Usage 1)
+		0xa1, 0x01,                    // COLLECTION (Application)
+		0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
+		0x26, 0xff, 0x00,              //   LOGICAL_MAXIMUM (255)
+		0x75, 0x08,                    //   REPORT_SIZE (8)
+	};
+	size_t n = sizeof(head);
+	int i;
+	int infoCount = infoSize() - 1;
+
+	memcpy(d, head, n);
+	/* The info report doubles as the 'run' command, which is ioSize long */
+	if (infoCount < parts[0].ioSize)
+		infoCount = parts[0].ioSize;
+	descReport(d, &n, REPORT_ID_INFO, infoCount);
+	for (i = 0; i < numParts; i++)
+		descReport(d, &n, REPORT_ID_PART(i), parts[i].ioSize);
+	if (caps & UHID_CAP_CONTROL)
+		descReport(d, &n, REPORT_ID_PART(numParts), parts[0].ioSize);
+	d[n++] = 0xc0;                 // END_COLLECTION
+	return n;
+}
+
+static int uhidSend(int fd, struct uhid_event *ev)
+{
+	ssize_t ret = write(fd, ev, sizeof(*ev));
+	if (ret < 0) {
+		fprintf(stderr, "uhidsim: write to /dev/uhid failed: %s\n", strerror(errno));
+		return -errno;
+	}
+	return 0;
+}
+
+static int createDevice(int fd)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	strncpy((char *) ev.u.create2.name, simName, sizeof(ev.u.create2.name) - 1);
+	strncpy((char *) ev.u.create2.uniq, simSerial, sizeof(ev.u.create2.uniq) - 1);
+	strncpy((char *) ev.u.create2.phys, simPhys, sizeof(ev.u.create2.phys) - 1);
+	ev.u.create2.rd_size = buildDescriptor(ev.u.create2.rd_data);
+	ev.u.create2.bus = BUS_USB;
+	ev.u.create2.vendor = simVid;
+	ev.u.create2.product = simPid;
+	return uhidSend(fd, &ev);
+}
+
+static void destroyDevice(int fd)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_DESTROY;
+	uhidSend(fd, &ev);
+}
+
+static uint64_t nowUs(void)
+{
+	struct timespec tv;
+	clock_gettime(CLOCK_MONOTONIC, &tv);
+	return tv.tv_sec * 1000000ULL + tv.tv_nsec / 1000;
+}
+
+/*
+ * Programming runs in the background. Reports that arrive before it is done
+ * are held back until it is, plus nakUs to model the host controller giving
+ * up and retrying.
+ */
+static void waitReady(void)
+{
+	uint64_t now = nowUs();
+
+	if (now >= busyUntil)
+		return;
+	stalls++;
+	usleep(busyUntil - now + nakUs);
+}
+
+static void programPage(struct simPart *p, uint32_t addr)
+{
+	uint64_t now = nowUs();
+
+	if (addr != badPage)
+		memcpy(&p->mem[addr], p->page, p->pageSize);
+	/* SPEC: UHID_CMD_VERIFY checks the flash against the page buffer */
+	if (verifyOn && memcmp(&p->mem[addr], p->page, p->pageSize)) {
+		if (!verifyFailed++)
+			verifyFirst = addr;
+	}
+	memset(p->page, 0xff, p->pageSize);
+	p->pages++;
+	busyUntil = ((busyUntil > now) ? busyUntil : now) + progUs;
+}
+
+static int getInfo(uint8_t *data)
+{
+	struct uHidDeviceInfo *inf = (struct uHidDeviceInfo *) data;
+	int i;
+
+	inf->reportId = REPORT_ID_INFO;
+	inf->version = infoVersion();
+	inf->numParts = numParts;
+	inf->cpuFreq = cpuFreq;
+	if (infoVersion() >= 3) {
+		uint16_t maxReport = infoSize() - 1;
+
+		for (i = 0; i < numParts; i++) {
+			struct uHidPartInfo *pi = &inf->parts[i];
+			pi->pageSize = parts[i].pageSize;
+			pi->size = parts[i].size;
+			pi->ioSize = parts[i].ioSize;
+			memcpy(pi->name, parts[i].name, UISP_PART_NAME_LEN);
+			if (maxReport < parts[i].ioSize)
+				maxReport = parts[i].ioSize;
+		}
+		memcpy(&inf->parts[numParts], &caps, sizeof(caps));
+		memcpy((uint8_t *) &inf->parts[numParts] + sizeof(caps), &maxReport,
+		       sizeof(maxReport));
+	} else {
+		struct uHidPartInfoV1 *pv = (struct uHidPartInfoV1 *) inf->parts;
+
+		for (i = 0; i < numParts; i++) {
+			pv[i].pageSize = parts[i].pageSize;
+			pv[i].size = parts[i].size;
+			pv[i].ioSize = parts[i].ioSize;
+			memcpy(pv[i].name, parts[i].name, UISP_PART_NAME_LEN);
+		}
+		if (infoVersion() >= 2)
+			memcpy(&pv[numParts], &caps, sizeof(caps));
+	}
+	/* SPEC: Reading the info report resets the address pointer */
+	ptr = 0;
+	erased = 0;
+	streamMode = UHID_STREAM_RAW;
+	frameHdr = frameHdrFill = frameFill = 0;
+	digestLeft = 0;
+	controlReply = 0;
+	verifyOn = 0;
+	return infoSize();
+}
+
+static int getPart(struct simPart *p, uint8_t *data)
+{
+	uint32_t len = min_t(uint32_t, p->ioSize, p->size - min_t(uint32_t, ptr, p->size));
+
+	data[0] = REPORT_ID_PART(p - parts);
+	memset(&data[1], 0xff, p->ioSize);
+	memcpy(&data[1], &p->mem[ptr], len);
+	ptr += p->ioSize;
+	p->reports_out++;
+	return p->ioSize + 1;
+}
+
+/* Feed one byte of a UHID_STREAM_RLE stream */
+static int streamByte(struct simPart *p, uint8_t b)
+{
+	int len;
+
+	if (frameHdrFill < 2) {
+		frameHdr |= b << (8 * frameHdrFill++);
+		if (frameHdrFill < 2)
+			return 0;
+		len = frameHdr & ~UHID_FRAME_RLE;
+		/* Padding */
+		if (!len)
+			frameHdr = frameHdrFill = 0;
+		if (len > p->pageSize)
+			return -1;
+		if (!(frameHdr & UHID_FRAME_RLE) && len && len != p->pageSize)
+			return -1;
+		return 0;
+	}
+
+	len = frameHdr & ~UHID_FRAME_RLE;
+	frameBuf[frameFill++] = b;
+	if (frameFill < len)
+		return 0;
+
+	if (frameHdr & UHID_FRAME_RLE) {
+		if (rleDecompress(frameBuf, len, p->page, p->pageSize) != p->pageSize)
+			return -1;
+	} else {
+		memcpy(p->page, frameBuf, len);
+	}
+	if (ptr + p->pageSize <= p->size)
+		programPage(p, ptr);
+	ptr += p->pageSize;
+	frameHdr = frameHdrFill = frameFill = 0;
+	return 0;
+}
+
+static int setPart(struct simPart *p, const uint8_t *data, int len)
+{
+	int i;
+
+	p->reports_in++;
+	if ((caps & UHID_CAP_ERASE_ON_ENTRY) && !erased) {
+		memset(p->mem, 0xff, p->size);
+		erased = 1;
+	}
+
+	if (streamMode == UHID_STREAM_RLE) {
+		for (i = 0; i < len; i++)
+			if (streamByte(p, data[i]))
+				return -1;
+		return 0;
+	}
+
+	for (i = 0; i < len && ptr < p->size; i++) {
+		p->page[ptr % p->pageSize] = data[i];
+		ptr++;
+		if ((ptr % p->pageSize) == 0)
+			programPage(p, ptr - p->pageSize);
+	}
+	return 0;
+}
+
+static uint32_t get32le(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static int control(const uint8_t *data, int len)
+{
+	struct simPart *p;
+	int cmd;
+
+	if (len < 2 || data[1] >= numParts)
+		return -1;
+	cmd = data[0];
+	p = &parts[data[1]];
+
+	switch (cmd) {
+	case UHID_CMD_STREAM_MODE:
+		if (!(caps & UHID_CAP_RLE) || len < 3 || data[2] > UHID_STREAM_RLE)
+			return -1;
+		streamMode = data[2];
+		return 0;
+	case UHID_CMD_DIGEST:
+		if (!(caps & UHID_CAP_DIGEST) || len < 10)
+			return -1;
+		controlReply = cmd;
+		digestPart = p;
+		digestPage = get32le(&data[2]);
+		digestLeft = get32le(&data[6]);
+		if (((uint64_t) digestPage + digestLeft) * p->pageSize > p->size)
+			return -1;
+		return 0;
+	case UHID_CMD_STATUS:
+		if (!(caps & UHID_CAP_STATUS))
+			return -1;
+		controlReply = cmd;
+		return 0;
+	case UHID_CMD_VERIFY:
+		if (!(caps & UHID_CAP_WRITE_VERIFY) || len < 3)
+			return -1;
+		controlReply = cmd;
+		verifyOn = data[2];
+		if (verifyOn)
+			verifyFailed = verifyFirst = 0;
+		return 0;
+	case UHID_CMD_SEEK:
+		if (!(caps & UHID_CAP_SEEK) || len < 6)
+			return -1;
+		ptr = get32le(&data[2]);
+		if (ptr > p->size)
+			return -1;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/* Next batch of UHID_CMD_DIGEST CRCs, as many as fit in a control report */
+static int getDigests(uint8_t *data)
+{
+	int ioSize = parts[0].ioSize;
+	int i;
+
+	if (!digestLeft)
+		return -1;
+
+	data[0] = REPORT_ID_PART(numParts);
+	memset(&data[1], 0, ioSize);
+	for (i = 0; i + 4 <= ioSize && digestLeft; i += 4) {
+		struct simPart *p = digestPart;
+		uint32_t crc = CRC32FromBuf(0, &p->mem[digestPage * p->pageSize], p->pageSize);
+		data[1 + i] = crc;
+		data[2 + i] = crc >> 8;
+		data[3 + i] = crc >> 16;
+		data[4 + i] = crc >> 24;
+		digestPage++;
+		digestLeft--;
+	}
+	return ioSize + 1;
+}
+
+static void put32le(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static int getStatus(uint8_t *data)
+{
+	uint64_t now = nowUs();
+	uint32_t left = (busyUntil > now) ? busyUntil - now : 0;
+
+	data[0] = REPORT_ID_PART(numParts);
+	memset(&data[1], 0, parts[0].ioSize);
+	data[1] = left ? UHID_STATUS_BUSY : 0;
+	put32le(&data[2], progUs);
+	put32le(&data[6], left);
+	return parts[0].ioSize + 1;
+}
+
+static int getVerify(uint8_t *data)
+{
+	data[0] = REPORT_ID_PART(numParts);
+	memset(&data[1], 0, parts[0].ioSize);
+	put32le(&data[1], verifyFailed);
+	put32le(&data[5], verifyFirst);
+	return parts[0].ioSize + 1;
+}
+
+/* Models the time a report takes on a (possibly shared) bus */
+static void busBegin(void)
+{
+	if (sharedFd >= 0)
+		flock(sharedFd, LOCK_EX);
+	if (reportUs)
+		usleep(reportUs);
+}
+
+static void busEnd(void)
+{
+	if (sharedFd >= 0)
+		flock(sharedFd, LOCK_UN);
+}
+
+static void handleGetReport(int fd, struct uhid_get_report_req *req)
+{
+	struct uhid_event ev;
+	int rnum = req->rnum;
+	int len = -1;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_GET_REPORT_REPLY;
+	ev.u.get_report_reply.id = req->id;
+
+	/* The control report is served while programming */
+	if (rnum != REPORT_ID_PART(numParts))
+		waitReady();
+
+	if (rnum == REPORT_ID_INFO)
+		len = getInfo(ev.u.get_report_reply.data);
+	else if (rnum >= REPORT_ID_PART(0) && rnum < REPORT_ID_PART(numParts))
+		len = getPart(&parts[rnum - REPORT_ID_PART(0)], ev.u.get_report_reply.data);
+	else if ((caps & UHID_CAP_CONTROL) && rnum == REPORT_ID_PART(numParts) &&
+		 controlReply == UHID_CMD_STATUS)
+		len = getStatus(ev.u.get_report_reply.data);
+	else if ((caps & UHID_CAP_CONTROL) && rnum == REPORT_ID_PART(numParts) &&
+		 controlReply == UHID_CMD_VERIFY)
+		len = getVerify(ev.u.get_report_reply.data);
+	else if ((caps & UHID_CAP_CONTROL) && rnum == REPORT_ID_PART(numParts))
+		len = getDigests(ev.u.get_report_reply.data);
+
+	if (verbose)
+		fprintf(stderr, "uhidsim: GET_REPORT %d -> %d bytes (ptr %u)\n", rnum, len, ptr);
+
+	if (len < 0) {
+		ev.u.get_report_reply.err = EIO;
+	} else {
+		ev.u.get_report_reply.size = len;
+	}
+	uhidSend(fd, &ev);
+}
+
+static void handleSetReport(int fd, struct uhid_set_report_req *req)
+{
+	struct uhid_event ev;
+	int rnum = req->rnum;
+	/* data[0] is the report id, the payload follows */
+	const uint8_t *data = &req->data[1];
+	int len = req->size - 1;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_SET_REPORT_REPLY;
+	ev.u.set_report_reply.id = req->id;
+
+	if (rnum != REPORT_ID_PART(numParts))
+		waitReady();
+
+	if (verbose)
+		fprintf(stderr, "uhidsim: SET_REPORT %d, %d bytes (ptr %u)\n", rnum, len, ptr);
+
+	if (len < 0) {
+		ev.u.set_report_reply.err = EIO;
+	} else if (rnum == REPORT_ID_INFO) {
+		printf("uhidsim: Starting application in partition %d\n", len ? data[0] : 0);
+		uhidSend(fd, &ev);
+		done = 1;
+		return;
+	} else if (rnum >= REPORT_ID_PART(0) && rnum < REPORT_ID_PART(numParts)) {
+		if (setPart(&parts[rnum - REPORT_ID_PART(0)], data, len))
+			ev.u.set_report_reply.err = EIO;
+	} else if ((caps & UHID_CAP_CONTROL) && rnum == REPORT_ID_PART(numParts)) {
+		if (control(data, len))
+			ev.u.set_report_reply.err = EIO;
+	} else {
+		ev.u.set_report_reply.err = EIO;
+	}
+	uhidSend(fd, &ev);
+}
+
+static int eventLoop(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	struct uhid_event ev;
+
+	while (!done) {
+		int ret = poll(&pfd, 1, 500);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -errno;
+		if (ret == 0)
+			continue;
+
+		ret = read(fd, &ev, sizeof(ev));
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -EIO;
+
+		switch (ev.type) {
+		case UHID_START:
+			printf("uhidsim: %s (serial %s) is up\n", simName, simSerial);
+			fflush(stdout);
+			break;
+		case UHID_GET_REPORT:
+			busBegin();
+			handleGetReport(fd, &ev.u.get_report);
+			busEnd();
+			break;
+		case UHID_SET_REPORT:
+			busBegin();
+			handleSetReport(fd, &ev.u.set_report);
+			busEnd();
+			break;
+		default:
+			break;
+		}
+	}
+	return 0;
+}
+
+static void printStats(void)
+{
+	int i;
+
+	for (i = 0; i < numParts; i++) {
+		struct simPart *p = &parts[i];
+		printf("uhidsim: %-8.8s reports in: %llu out: %llu pages programmed: %llu\n",
+		       p->name,
+		       (unsigned long long) p->reports_in,
+		       (unsigned long long) p->reports_out,
+		       (unsigned long long) p->pages);
+	}
+	printf("uhidsim: reports stalled by programming: %llu\n",
+	       (unsigned long long) stalls);
+}
+
+static void onSignal(int sig)
+{
+	done = 1;
+}
+
+static void usage(const char *name)
+{
+	printf(usagemsg, name);
+}
+
+int main(int argc, char **argv)
+{
+	int fd;
+	int ret;
+
+	while (1) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "hp:f:n:s:d:u:r:k:P:S:vlc:i:b:",
+				    long_options, &option_index);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'p':
+			if (addPart(optarg)) {
+				fprintf(stderr, "Bad partition spec: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'f':
+			cpuFreq = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			simName = optarg;
+			break;
+		case 's':
+			simSerial = optarg;
+			break;
+		case 'd':
+			if (sscanf(optarg, "%x:%x", &simVid, &simPid) != 2) {
+				fprintf(stderr, "Bad VID:PID: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'u':
+			progUs = atoi(optarg);
+			break;
+		case 'r':
+			reportUs = atoi(optarg);
+			break;
+		case 'k':
+			nakUs = atoi(optarg);
+			break;
+		case 'P':
+			simPhys = optarg;
+			break;
+		case 'S':
+			sharedFd = open(optarg, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+			if (sharedFd < 0) {
+				fprintf(stderr, "Can't open %s: %s\n", optarg, strerror(errno));
+				return 1;
+			}
+			break;
+		case 'v':
+			verbose++;
+			break;
+		case 'l':
+			caps = 0;
+			break;
+		case 'c':
+			caps = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			infoVer = atoi(optarg);
+			if (infoVer < 1 || infoVer > UHID_INFO_VERSION) {
+				fprintf(stderr, "Bad info version: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'b':
+			badPage = strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!numParts) {
+		addPart("flash:28672:128:128");
+		addPart("eeprom:1024:128:128");
+	}
+
+	/* Versions before 3 only have 8 bits for ioSize and 255 for the report */
+	int i, maxPage = 0;
+	for (i = 0; i < numParts; i++) {
+		if (infoVersion() < 3 && parts[i].ioSize > 0xff) {
+			fprintf(stderr, "ioSize %d needs --info-version 3\n", parts[i].ioSize);
+			return 1;
+		}
+	}
+	if (infoSize() > (infoVersion() < 3 ? 255 : UHID_INFO_MAX - 1)) {
+		fprintf(stderr, "Too many partitions for the info report\n");
+		return 1;
+	}
+
+
+	for (i = 0; i < numParts; i++)
+		maxPage = parts[i].pageSize > maxPage ? parts[i].pageSize : maxPage;
+	frameBuf = malloc(maxPage);
+	if (!frameBuf)
+		return 1;
+
+	fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open /dev/uhid: %s\n", strerror(errno));
+		return 1;
+	}
+
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+
+	ret = createDevice(fd);
+	if (ret == 0)
+		ret = eventLoop(fd);
+
+	destroyDevice(fd);
+	close(fd);
+	printStats();
+	return ret ? 1 : 0;
+}
@@ -30,6 +30,8 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <wchar.h>
+#include <pthread.h>
 
 #ifndef _WIN32
 #include <sys/ioctl.h>
@@ -42,9 +44,27 @@
 
 #include <getopt.h>
 #include <time.h>
+#include <math.h>
+#include <signal.h>
 
 static  int verify = 1;
 static 	const char *partname;
+static  uint64_t offset;
+static  uint64_t length;	/* 0 is up to the end of the partition */
+static  struct uHidDeviceMatch devmatch[2];
+static  int alldevs;
+static  int history = 1;	/* Log every operation, see perf.c */
+static  char *dev_path;		/* Where the device we opened was found */
+static  int wait_run;		/* --wait: --run waits for the board to come back */
+static  double drift_threshold = 0.2;
+static  struct uhidCancel cancel;
+static  struct uhidLimits limits = {
+	.cancel = &cancel,
+};
+static  struct uhidSchedule sched = {
+	.perTT = 1,
+	.cancel = &cancel,
+};
 enum {
 	OP_NONE = 0,
 	OP_INFO,
@@ -61,14 +81,42 @@ static struct option long_options[] =
 	{"part",     	  required_argument, 0, 'p'},
 	{"write",    	  required_argument, 0, 'w'},
 	{"read",     	  required_argument, 0, 'r'},
-	{"rtest",     	  no_argument, 	     0, 't'},
+	{"benchmark",     required_argument, 0, 't'},
+	{"warmup",        required_argument, 0, 'W'},
+	{"bench-write",   no_argument,       0, 'X'},
 	{"verify",   	  required_argument, 0, 'v'},
 	{"product",  	  required_argument, 0, 'P'},
 	{"serial",   	  required_argument, 0, 'S'},
+	{"device",   	  required_argument, 0, 'D'},
 	{"crc",   	      no_argument, 	     0, 'c'},
 	{"info",     	  no_argument,       0, 'i'},
 	{"run",      	  no_argument,       0, 'R'},
 	{"progress",      required_argument, 0, 'b'},
+	{"no-compress",   no_argument,       0, 'Z'},
+	{"fill",          required_argument, 0, 'F'},
+	{"hex-base",      required_argument, 0, 'x'},
+	{"elide-blank",   no_argument,       0, 'E'},
+	{"readback",      no_argument,       0, 'K'},
+	{"all",           no_argument,       0, 'A'},
+	{"jobs",          required_argument, 0, 'j'},
+	{"per-tt",        required_argument, 0, 'T'},
+	{"per-bus",       required_argument, 0, 'B'},
+	{"format",        required_argument, 0, 'f'},
+	{"offset",        required_argument, 0, 'o'},
+	{"length",        required_argument, 0, 'l'},
+	{"no-history",    no_argument,       0, 'H'},
+	{"drift",         required_argument, 0, 'd'},
+	{"drift-threshold", required_argument, 0, 'g'},
+	{"timeout",       required_argument, 0, 'O'},
+	{"snapshot",      required_argument, 0, 'N'},
+	{"restore",       required_argument, 0, 'U'},
+	{"report-timeout", required_argument, 0, 'Y'},
+	{"wait",          no_argument,       0, 'G'},
+	{"status-board",  required_argument, 0, 'k'},
+	{"status",        required_argument, 0, 'm'},
+	{"cache-size",    required_argument, 0, 'C'},
+	{"cache-hash",    no_argument,       0, 'e'},
+	{"clear-cache",   no_argument,       0, 'L'},
     {"debug-timestamp",      	  no_argument,       0, '1'},
 	{0, 0, 0, 0}
 };
@@ -105,8 +153,20 @@ static uint64_t platform_get_timestamp()
 #endif
 #endif
 
+static uint64_t bench_now_us(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return now.QuadPart * 1000000ULL / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#endif
+}
 
-static uint64_t prev_output;
 
 /*
   On windows printf()'s to cmd window are VERY slow
@@ -114,44 +174,121 @@ static uint64_t prev_output;
   or so. Otherwise, THIS will be the bottleneck. Not the mcu
   speed, or usb speed. Lots of rage fly to micro$oft
   for that one.
+
+  The library only records where it is, a separate thread does the
+  rendering, so the transfer loop never waits for the terminal.
 */
 
 #define PRINTF_THROTTLE 200
 
-int should_print(int value, int max)
+/* Slots of a new --status-board, one per device */
+#define STATUS_SLOTS 64
+
+/* How long --run --wait waits for the board without --timeout */
+#define RUN_WAIT_MS 10000
+
+/* NDJSON events go here with --format json, NULL otherwise */
+static FILE *json;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_t thread;
+	int running;
+	int stop;
+	int dirty;
+	const char *label;
+	int value;
+	int max;
+	void (*render)(const char *label, int value, int max);
+} progress = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+};
+
+/* Where the transfers of this thread stood when an operation started */
+struct history_mark {
+	struct uhidXferStats st;
+	uint64_t us;
+};
+
+/* What the current operation is, for the JSON events */
+static struct {
+	const char *name;
+	const char *part;
+	char serial[128];
+	uint64_t start;
+	hid_device *dev;
+	struct history_mark mark;
+} phase;
+
+static void json_string(const char *s)
 {
-	int ret = 0;;
-	uint64_t cur = platform_get_timestamp();
-	if ((value == max) || ((cur - prev_output) > PRINTF_THROTTLE)) { /* Always output when 100% */
-		ret = 1;
-		prev_output = cur;
+	fputc('"', json);
+	for (; s && *s; s++) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\')
+			fprintf(json, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(json, "\\u%04x", c);
+		else
+			fputc(c, json);
 	}
+	fputc('"', json);
+}
 
-	return ret;
+/*
+ * One object per line. extra is either NULL or more members,
+ * e.g. "\"crc\":123"
+ */
+static void json_event(const char *event, uint64_t bytes, int total, uint64_t ms,
+		       int result, const char *extra)
+{
+	if (!json)
+		return;
+	flockfile(json);
+	fprintf(json, "{\"event\":");
+	json_string(event);
+	fprintf(json, ",\"serial\":");
+	json_string(phase.serial);
+	fprintf(json, ",\"part\":");
+	json_string(phase.part);
+	fprintf(json, ",\"phase\":");
+	json_string(phase.name);
+	fprintf(json, ",\"bytes\":%" PRIu64, bytes);
+	if (total >= 0)
+		fprintf(json, ",\"total\":%d", total);
+	fprintf(json, ",\"elapsed_ms\":%" PRIu64 ",\"kbps\":%.1f",
+		ms, ms ? (double) bytes / ms : 0.0);
+	if (strcmp(event, "done") == 0)
+		fprintf(json, ",\"result\":%d", result);
+	if (extra)
+		fprintf(json, ",%s", extra);
+	fprintf(json, "}\n");
+	fflush(json);
+	funlockfile(json);
+}
+
+void progressjson(const char *label, int value, int max)
+{
+	json_event("progress", value, max, platform_get_timestamp() - phase.start, 0, NULL);
 }
 
 void progressplain(const char *label, int value, int max)
 {
-	if (!should_print(value, max))
-		return;
 	printf("%s %d/%d\n", label, value, max);
 }
 
 void progressbar(const char *label, int value, int max)
 {
-	if (!should_print(value, max))
-		return;
-
 	value = max - value;
 	float percent = 100.0 - (float) value * 100.0 / (float) max;
-	int cols;
+	int cols = 80;
 
 #ifndef _WIN32
 	struct winsize w;
-	ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
-	cols = w.ws_col;
-#else
-	cols = 80;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0 && w.ws_col)
+		cols = w.ws_col;
 #endif
 
 	int txt = printf("%s %.02f %% done [", label, percent);
@@ -170,6 +307,164 @@ void progressbar(const char *label, int value, int max)
 
 }
 
+/* Called from the transfer loop, must be cheap */
+static void progress_update(const char *label, int value, int max)
+{
+	pthread_mutex_lock(&progress.lock);
+	progress.label = label;
+	progress.value = value;
+	progress.max = max;
+	progress.dirty = 1;
+	pthread_mutex_unlock(&progress.lock);
+}
+
+/* Renders whatever changed since last time */
+static void progress_render(void)
+{
+	const char *label;
+	int value, max, dirty;
+
+	pthread_mutex_lock(&progress.lock);
+	label = progress.label;
+	value = progress.value;
+	max = progress.max;
+	dirty = progress.dirty;
+	progress.dirty = 0;
+	pthread_mutex_unlock(&progress.lock);
+
+	if (dirty && max && progress.render)
+		progress.render(label, value, max);
+}
+
+static void *progress_thread(void *arg)
+{
+	int stop = 0;
+
+	while (!stop) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += PRINTF_THROTTLE * 1000000L;
+		ts.tv_sec += ts.tv_nsec / 1000000000L;
+		ts.tv_nsec %= 1000000000L;
+
+		pthread_mutex_lock(&progress.lock);
+		if (!progress.stop)
+			pthread_cond_timedwait(&progress.wake, &progress.lock, &ts);
+		stop = progress.stop;
+		pthread_mutex_unlock(&progress.lock);
+		if (!stop)
+			progress_render();
+	}
+	return NULL;
+}
+
+static void history_begin(struct history_mark *m)
+{
+	uhidGetXferStats(&m->st);
+	m->us = bench_now_us();
+}
+
+/* Logs the transfers made since history_begin() as operation op */
+static void history_end(hid_device *dev, const char *path, const char *op,
+			struct history_mark *m, int result)
+{
+	struct uhidXferStats st;
+	int i, ret;
+
+	if (!history || !dev || result < 0)
+		return;
+	uhidGetXferStats(&st);
+	st.bytes -= m->st.bytes;
+	st.reports -= m->st.reports;
+	st.errors -= m->st.errors;
+	st.us -= m->st.us;
+	for (i = 0; i < UHID_LAT_BUCKETS; i++)
+		st.latency[i] -= m->st.latency[i];
+	ret = uhidmgrPerfAppend(dev, path ? path : dev_path, op, partname, &st,
+				bench_now_us() - m->us);
+	if (ret)
+		fprintf(stderr, "Failed to log performance history: %s\n", strerror(-ret));
+}
+
+/* Starts an operation on dev, which may be NULL when there is none yet */
+static void phase_begin(hid_device *dev, const char *name, const char *part)
+{
+	phase.name = name;
+	phase.part = part;
+	phase.start = platform_get_timestamp();
+	phase.serial[0] = 0;
+	phase.dev = dev;
+	history_begin(&phase.mark);
+	if (dev) {
+		wchar_t ws[64];
+		if (hid_get_serial_number_string(dev, ws, 64) == 0) {
+			ws[63] = 0;
+			if (wcstombs(phase.serial, ws, sizeof(phase.serial) - 1) == (size_t) -1)
+				phase.serial[0] = 0;
+		}
+	}
+
+	progress.dirty = 0;
+	progress.value = 0;
+	progress.max = 0;
+	progress.stop = 0;
+	if (progress.render && !progress.running)
+		progress.running = !pthread_create(&progress.thread, NULL, progress_thread, NULL);
+	if (dev)
+		uhidStatusBegin(dev, name, part);
+	json_event("start", 0, -1, 0, 0, NULL);
+}
+
+/* Partition table as extra members for json_event(), caller frees */
+static char *json_info(struct uHidDeviceInfo *inf)
+{
+	/* Room for the longest numbers and names there are */
+	size_t len = 128 + (size_t) inf->numParts * 96, n;
+	char *buf = malloc(len);
+	int i;
+
+	if (!buf)
+		return NULL;
+	n = snprintf(buf, len, "\"version\":%d,\"cpu_mhz\":%.2f,\"caps\":%" PRIu32
+		     ",\"max_report\":%d,\"parts\":[", inf->version, uhidGetFrequencyMhz(inf),
+		     uhidGetCaps(inf), uhidGetMaxReport(inf));
+	for (i = 0; i < inf->numParts; i++) {
+		struct uHidPartInfo *p = &inf->parts[i];
+		char name[UISP_PART_NAME_LEN + 1];
+		int j;
+
+		snprintf(name, sizeof(name), "%.*s", UISP_PART_NAME_LEN, (char *) p->name);
+		for (j = 0; name[j]; j++)
+			if (name[j] == '"' || name[j] == '\\' || (unsigned char) name[j] < 0x20)
+				name[j] = '_';
+		n += snprintf(&buf[n], len - n,
+			      "%s{\"name\":\"%s\",\"size\":%" PRIu32 ",\"page_size\":%d,\"io_size\":%d}",
+			      i ? "," : "", name, p->size, p->pageSize, p->ioSize);
+	}
+	snprintf(&buf[n], len - n, "]");
+	return buf;
+}
+
+static void phase_end(int result, const char *extra)
+{
+	if (progress.running) {
+		pthread_mutex_lock(&progress.lock);
+		progress.stop = 1;
+		pthread_cond_signal(&progress.wake);
+		pthread_mutex_unlock(&progress.lock);
+		pthread_join(progress.thread, NULL);
+		progress.running = 0;
+	}
+	uhidStatusEnd(result);
+	/* The final 100% */
+	progress_render();
+	json_event("done", progress.value, progress.max,
+		   platform_get_timestamp() - phase.start, result, extra);
+	/* A benchmark is many operations, it keeps its own statistics */
+	if (strcmp(phase.name, "benchmark") != 0)
+		history_end(phase.dev, NULL, phase.name, &phase.mark, result);
+}
+
 static void bailout(int code)
 {
 	if (code == 0)
@@ -183,29 +478,478 @@ static void bailout(int code)
 
 }
 
+/* Same as --format json, which --progress json needs to have anywhere to go */
+static void json_open(void)
+{
+	progress.render = progressjson;
+	if (json)
+		return;
+	json = fdopen(dup(STDOUT_FILENO), "w");
+	if (!json) {
+		perror("fdopen");
+		bailout(1);
+	}
+	/* Keep stdout clean, human readable stuff goes to stderr */
+	fflush(stdout);
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+}
+
+static wchar_t *to_wide(const char *s)
+{
+	size_t len = strlen(s) + 1;
+	wchar_t *ret = calloc(len, sizeof(wchar_t));
+
+	if (!ret || mbstowcs(ret, s, len) == (size_t) -1) {
+		fprintf(stderr, "Bad string: %s\n", s);
+		bailout(1);
+	}
+	return ret;
+}
+
 static void check_and_open(hid_device **dev, const char *product, const char *serial)
 {
 	if (*dev)
 		return;
 
-	wchar_t *tmp = NULL;
+	wchar_t *wproduct = product ? to_wide(product) : NULL;
+	wchar_t *wserial = serial ? to_wide(serial) : NULL;
 
-	if (serial) {
-	  tmp = malloc(strlen(serial) * (sizeof(wchar_t) + 1));
-		if (!tmp) {
-			fprintf(stderr, "Out of memory\n");
-			bailout(1);
-		}
-		mbstowcs(tmp, serial, strlen(serial));
+	*dev = uhidOpenMatching(devmatch[0].vendor ? devmatch : NULL, wproduct, wserial,
+				&dev_path);
+	free(wproduct);
+	free(wserial);
+	if (!*dev) {
+		phase_begin(NULL, "open", partname);
+		phase_end(-ENODEV, NULL);
+		bailout(1);
 	}
+}
 
-	*dev = uhidOpen(NULL);
-	if (!*dev)
+
+/* --length, or the rest of the partition after --offset */
+static uint64_t range_length(hid_device *dev, int part)
+{
+	struct uHidDeviceInfo *inf;
+	uint64_t len = length;
+
+	if (len)
+		return len;
+	inf = uhidReadInfo(dev);
+	if (inf && part < inf->numParts && offset < inf->parts[part].size)
+		len = inf->parts[part].size - offset;
+	free(inf);
+	return len;
+}
+
+/* --all jobs log their own history, the device is closed afterwards */
+static int jobVerify(struct uhidJob *job, hid_device *dev)
+{
+	struct history_mark m;
+	int part = uhidLookupPart(dev, partname);
+	if (part < 0)
+		return -ENOENT;
+	history_begin(&m);
+	int ret = uhidVerifyPartFromFile(dev, part, job->arg);
+	history_end(dev, job->path, "verify", &m, ret);
+	return ret;
+}
+
+static int jobWrite(struct uhidJob *job, hid_device *dev)
+{
+	struct history_mark m;
+	int part = uhidLookupPart(dev, partname);
+	if (part < 0)
+		return -ENOENT;
+	history_begin(&m);
+	/* Verified as well, see case 'w' */
+	int ret = uhidWritePartFromFile(dev, part, job->arg);
+	history_end(dev, job->path, "write", &m, ret);
+	return ret;
+}
+
+/* With --all the snapshot argument is a directory, one file per serial */
+static int jobSnapshot(struct uhidJob *job, hid_device *dev)
+{
+	struct history_mark m;
+	wchar_t wserial[64];
+	char serial[64], file[1024], *p;
+
+	wserial[63] = 0;
+	if (hid_get_serial_number_string(dev, wserial, 63) ||
+	    wcstombs(serial, wserial, sizeof(serial) - 1) == (size_t) -1)
+		return -ENODEV;
+	serial[sizeof(serial) - 1] = 0;
+	for (p = serial; *p; p++)
+		if (*p == '/' || *p == '\\')
+			*p = '_';
+	snprintf(file, sizeof(file), "%s/%s.uhs", (const char *) job->arg, serial);
+	history_begin(&m);
+	int ret = uhidSnapshot(dev, file);
+	history_end(dev, job->path, "snapshot", &m, ret);
+	return ret;
+}
+
+static int jobRestore(struct uhidJob *job, hid_device *dev)
+{
+	struct history_mark m;
+	history_begin(&m);
+	int ret = uhidRestore(dev, job->arg);
+	history_end(dev, job->path, "restore", &m, ret);
+	return ret;
+}
+
+static void run_all(int (*fn)(struct uhidJob *job, hid_device *dev), const char *name,
+		    const char *filename)
+{
+	struct hid_device_info *list = uhidListDevices(devmatch[0].vendor ? devmatch : NULL);
+	struct hid_device_info *inf;
+	struct uhidJob *jobs;
+	int i, n = 0;
+
+	if (strcmp(filename, "-") == 0) {
+		fprintf(stderr, "--all can't read the image from stdin, use a file\n");
 		bailout(1);
-	if (tmp)
-		free(tmp);
+	}
+	for (inf = list; inf; inf = inf->next)
+		n++;
+	if (!n) {
+		fprintf(stderr, "No devices found\n");
+		bailout(1);
+	}
+
+	jobs = calloc(n, sizeof(*jobs));
+	if (!jobs) {
+		fprintf(stderr, "Out of memory\n");
+		bailout(1);
+	}
+
+	for (i = 0, inf = list; inf; inf = inf->next, i++) {
+		jobs[i].path = inf->path;
+		jobs[i].run = fn;
+		jobs[i].arg = (void *) filename;
+		jobs[i].name = name;
+	}
+
+	/* Progress bars of many devices would just be garbage */
+	uhidProgressCb(NULL);
+	int failed = uhidRunJobs(jobs, n, &sched);
+	uhidPrintJobStats(jobs, n);
+	for (i = 0, inf = list; json && inf; inf = inf->next, i++) {
+		char extra[160];
+		phase.name = name;
+		phase.part = partname;
+		phase.serial[0] = 0;
+		if (inf->serial_number &&
+		    wcstombs(phase.serial, inf->serial_number, sizeof(phase.serial) - 1) == (size_t) -1)
+			phase.serial[0] = 0;
+		snprintf(extra, sizeof(extra), "\"bus\":%d,\"ports\":\"%s\"",
+			 jobs[i].topo.bus, jobs[i].topo.ports);
+		json_event("done", jobs[i].bytes, -1, jobs[i].endMs - jobs[i].startMs,
+			   jobs[i].result, extra);
+	}
+	printf("%d of %d devices failed\n", failed, n);
+	free(jobs);
+	hid_free_enumeration(list);
+	bailout(failed ? 1 : 0);
+}
+
+/*
+ * --benchmark: warm-up plus N timed passes of info, read, [write] and
+ * verify on one partition. Writes only happen with --bench-write and put
+ * back what was read before the first pass.
+ */
+enum {
+	BENCH_INFO = 0,
+	BENCH_READ,
+	BENCH_WRITE,
+	BENCH_VERIFY,
+	BENCH_NOPS
+};
+
+static const char *bench_names[BENCH_NOPS] = { "info", "read", "write", "verify" };
+
+struct samples {
+	uint64_t *v;
+	int n;
+	int cap;
+};
+
+static struct {
+	int iterations;
+	int warmup;
+	int write;
+	int recording;
+	struct samples op[BENCH_NOPS];
+	struct samples report[2];
+	uint64_t reportBytes[2];
+} bench = {
+	.warmup = 1,
+};
+
+static void samples_add(struct samples *s, uint64_t v)
+{
+	if (s->n == s->cap) {
+		int cap = s->cap ? s->cap * 2 : 256;
+		uint64_t *tmp = realloc(s->v, cap * sizeof(*tmp));
+		if (!tmp)
+			return;
+		s->v = tmp;
+		s->cap = cap;
+	}
+	s->v[s->n++] = v;
+}
+
+static int samples_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+/* Nearest rank, s must be sorted */
+static uint64_t samples_pct(struct samples *s, int pct)
+{
+	int i = (s->n * pct + 99) / 100 - 1;
+	return s->v[i < 0 ? 0 : i];
+}
+
+static void samples_stats(struct samples *s, double *mean, double *stddev)
+{
+	double sum = 0, sq = 0;
+	int i;
+
+	for (i = 0; i < s->n; i++)
+		sum += s->v[i];
+	*mean = sum / s->n;
+	for (i = 0; i < s->n; i++)
+		sq += (s->v[i] - *mean) * (s->v[i] - *mean);
+	*stddev = s->n > 1 ? sqrt(sq / (s->n - 1)) : 0;
+}
+
+static void bench_report(int dir, int part, int len, uint64_t us)
+{
+	if (!bench.recording)
+		return;
+	samples_add(&bench.report[dir], us);
+	bench.reportBytes[dir] += len;
+}
+
+static int bench_pass(hid_device *dev, int part, char *orig, char *buf, int len)
+{
+	struct uHidDeviceInfo *inf;
+	uint64_t start;
+	int ret;
+
+	start = bench_now_us();
+	inf = uhidReadInfo(dev);
+	if (!inf)
+		return -EIO;
+	free(inf);
+	if (bench.recording)
+		samples_add(&bench.op[BENCH_INFO], bench_now_us() - start);
+
+	start = bench_now_us();
+	ret = uhidReadPartInto(dev, part, buf, len);
+	if (ret != len)
+		return ret < 0 ? ret : -EIO;
+	if (bench.recording)
+		samples_add(&bench.op[BENCH_READ], bench_now_us() - start);
+
+	if (bench.write) {
+		start = bench_now_us();
+		ret = uhidWritePart(dev, part, orig, len);
+		if (ret)
+			return ret;
+		if (bench.recording)
+			samples_add(&bench.op[BENCH_WRITE], bench_now_us() - start);
+	}
+
+	start = bench_now_us();
+	ret = uhidVerifyPart(dev, part, orig, len);
+	if (ret)
+		return ret;
+	if (bench.recording)
+		samples_add(&bench.op[BENCH_VERIFY], bench_now_us() - start);
+	return 0;
 }
 
+static void bench_print(const char *name, struct samples *s, uint64_t bytes)
+{
+	char extra[256];
+	double mean, stddev;
+
+	if (!s->n)
+		return;
+	qsort(s->v, s->n, sizeof(*s->v), samples_cmp);
+	samples_stats(s, &mean, &stddev);
+	printf("%-8s %6d %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+	       " %10.1f %6.1f%%", name, s->n, s->v[0], samples_pct(s, 50), samples_pct(s, 90),
+	       samples_pct(s, 99), s->v[s->n - 1], stddev, mean ? stddev * 100 / mean : 0);
+	if (bytes)
+		printf(" %10.1f", bytes / mean * 1000000.0 / 1024.0);
+	printf("\n");
+
+	snprintf(extra, sizeof(extra),
+		 "\"op\":\"%s\",\"samples\":%d,\"min_us\":%" PRIu64 ",\"p50_us\":%" PRIu64
+		 ",\"p90_us\":%" PRIu64 ",\"p99_us\":%" PRIu64 ",\"max_us\":%" PRIu64
+		 ",\"mean_us\":%.1f,\"stddev_us\":%.1f",
+		 name, s->n, s->v[0], samples_pct(s, 50), samples_pct(s, 90),
+		 samples_pct(s, 99), s->v[s->n - 1], mean, stddev);
+	json_event("benchmark", bytes, -1, (uint64_t) (mean / 1000), 0, extra);
+}
+
+static int run_benchmark(hid_device *dev)
+{
+	struct uHidDeviceInfo *inf;
+	char *orig, *buf;
+	int part, len, i, ret = 0;
+
+	if (!partname) {
+		fprintf(stderr, "--benchmark needs a scratch partition, use --part\n");
+		return 1;
+	}
+	part = uhidLookupPart(dev, partname);
+	inf = uhidReadInfo(dev);
+	if (part < 0 || !inf) {
+		fprintf(stderr, "No such part: %s\n", partname);
+		free(inf);
+		return 1;
+	}
+	len = inf->parts[part].size;
+	free(inf);
+
+	/* What's there now is what we write back, so the partition survives */
+	orig = uhidReadPart(dev, part, &len);
+	buf = malloc(len);
+	if (!orig || !buf) {
+		fprintf(stderr, "Failed to read %s\n", partname);
+		free(orig);
+		free(buf);
+		return 1;
+	}
+
+	printf("Benchmarking %s (%d bytes): %d warm-up + %d passes, %s\n", partname, len,
+	       bench.warmup, bench.iterations,
+	       bench.write ? "with writes" : "read only (--bench-write to include writes)");
+
+	progress.render = NULL;
+	uhidReportCb(bench_report);
+	for (i = 0; i < bench.warmup + bench.iterations; i++) {
+		bench.recording = (i >= bench.warmup);
+		ret = bench_pass(dev, part, orig, buf, len);
+		if (ret) {
+			fprintf(stderr, "Pass %d failed: %d\n", i, ret);
+			break;
+		}
+	}
+	uhidReportCb(NULL);
+	bench.recording = 0;
+
+	printf("\n%-8s %6s %10s %10s %10s %10s %10s %10s %7s %10s\n", "op", "n", "min us",
+	       "p50 us", "p90 us", "p99 us", "max us", "stddev us", "cv", "KiB/s");
+	for (i = 0; i < BENCH_NOPS; i++)
+		bench_print(bench_names[i], &bench.op[i], i == BENCH_INFO ? 0 : len);
+	bench_print("get", &bench.report[UHID_REPORT_GET],
+		    bench.report[UHID_REPORT_GET].n ?
+		    bench.reportBytes[UHID_REPORT_GET] / bench.report[UHID_REPORT_GET].n : 0);
+	bench_print("send", &bench.report[UHID_REPORT_SEND],
+		    bench.report[UHID_REPORT_SEND].n ?
+		    bench.reportBytes[UHID_REPORT_SEND] / bench.report[UHID_REPORT_SEND].n : 0);
+
+	for (i = 0; i < BENCH_NOPS; i++)
+		free(bench.op[i].v);
+	free(bench.report[0].v);
+	free(bench.report[1].v);
+	free(orig);
+	free(buf);
+	return ret ? 1 : 0;
+}
+
+/* Device strings can be anything, keep them from breaking the JSON */
+static void json_safe(const wchar_t *ws, char *buf, size_t len)
+{
+	size_t i;
+
+	if (wcstombs(buf, ws, len - 1) == (size_t) -1)
+		buf[0] = 0;
+	buf[len - 1] = 0;
+	for (i = 0; buf[i]; i++)
+		if (buf[i] == '"' || buf[i] == '\\' || (unsigned char) buf[i] < 0x20)
+			buf[i] = '_';
+}
+
+/* --run --wait, the board's new identity goes into the "done" event */
+static int run_and_wait(hid_device *dev, int part)
+{
+	struct uhidReappear r;
+	char extra[512], product[64], serial[64];
+	uint32_t timeout = limits.timeoutMs ? limits.timeoutMs : RUN_WAIT_MS;
+	int ret;
+
+	phase_begin(dev, "run", partname);
+	/* Gone after this, nothing left to log the history with */
+	phase.dev = NULL;
+	ret = uhidRunAndWait(dev, dev_path, part, devmatch[0].vendor ? devmatch : NULL,
+			     timeout, &r);
+	if (ret) {
+		phase_end(ret, NULL);
+		return 1;
+	}
+
+	json_safe(r.productName, product, sizeof(product));
+	json_safe(r.serial, serial, sizeof(serial));
+
+	snprintf(extra, sizeof(extra), "\"vid\":\"%04x\",\"pid\":\"%04x\",\"product\":\"%s\","
+		 "\"new_serial\":\"%s\",\"bootloader\":%s,\"gone_ms\":%" PRIu32
+		 ",\"back_ms\":%" PRIu32, r.vendor, r.product, product, serial,
+		 r.bootloader ? "true" : "false", r.goneMs, r.elapsedMs);
+	phase_end(r.bootloader ? -ENOEXEC : 0, extra);
+	printf("Left the bus after %" PRIu32 " ms, back after %" PRIu32 " ms as %04x:%04x %s %s\n",
+	       r.goneMs, r.elapsedMs, r.vendor, r.product, product, serial);
+	if (r.bootloader) {
+		printf("That is the bootloader, the application didn't start\n");
+		return 1;
+	}
+	return 0;
+}
+
+/* --status, one line per device on the board */
+static int show_status(const char *path)
+{
+	static const char *states[] = { "idle", "running", "done" };
+	struct uhidStatusSlot st;
+	struct timespec tv;
+	uint64_t now;
+	int i, ret, shown = 0;
+
+	ret = uhidStatusOpen(path, STATUS_SLOTS);
+	if (ret) {
+		fprintf(stderr, "Can't open status board %s: %s\n", path, strerror(-ret));
+		return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &tv);
+	now = tv.tv_sec * 1000ULL + tv.tv_nsec / 1000000;
+
+	printf("%4s %7s %-20s %-10s %-8s %-8s %10s %10s %8s %6s %8s\n", "slot", "pid", "serial",
+	       "phase", "part", "state", "bytes", "total", "KiB/s", "result", "age s");
+	for (i = 0; i < uhidStatusSlots(); i++) {
+		const char *state;
+
+		if (uhidStatusRead(i, &st) || !st.pid)
+			continue;
+		state = (st.state <= UHID_STATUS_DONE) ? states[st.state] : "?";
+#ifndef _WIN32
+		if (st.state == UHID_STATUS_RUNNING && kill(st.pid, 0) && errno == ESRCH)
+			state = "died";
+#endif
+		printf("%4d %7d %-20.48s %-10.16s %-8.16s %-8s %10" PRIu64 " %10" PRIu64 " %8.1f %6d %8.1f\n",
+		       i, st.pid, st.serial, st.phase, st.part, state, st.bytes, st.total,
+		       st.rate / 1024.0, st.result, (now - st.updatedMs) / 1000.0);
+		shown++;
+	}
+	if (!shown)
+		printf("Nobody has used the board yet\n");
+	return 0;
+}
 
 const char usagemsg[] =
 "uHID bootloader tool (c) Andrew 'Necromant' Andrianov 2016\n"
@@ -218,9 +962,65 @@ const char usagemsg[] =
 "%s --part eeprom --read  1.bin - Read partition eeprom to 1.bin\n"
 "%s --run [flash]               - Execute code in partition [flash]\n"
 "                                 Optional, if supported by target MCU\n"
+"%s --device 1d50:6032 ...      - Only look for devices with this VID:PID\n"
+"                                 (no vendor name check). Must come first\n"
+"%s --serial 0001 [--product uHID] ...\n"
+"                               - Only open the device with this serial number\n"
+"                                 (and product name). Must come first\n"
+"%s --no-compress --write ...   - Don't compress data, even if the device\n"
+"                                 supports it\n"
+"%s --fill 0xff --write ...     - Pad the last page with this value\n"
+"%s --hex-base 0x8000000 --write/--verify ...\n"
+"                               - Intel HEX address of the start of the\n"
+"                                 partition (default 0)\n"
+"%s --elide-blank --write ...   - Don't write trailing 0xff pages if the\n"
+"                                 device erases the partition by itself\n"
+"%s --readback --write/--verify ...\n"
+"                               - Read back everything instead of comparing\n"
+"                                 page checksums first or letting the device\n"
+"                                 check what it programmed\n"
+"%s --all [--jobs 0] [--per-tt 1] [--per-bus 0] --write/--verify ...\n"
+"                               - Run on all connected devices at once, at\n"
+"                                 most per-tt devices behind the same USB\n"
+"                                 hub TT and per-bus on the same bus (0 is\n"
+"                                 no limit)\n"
+"%s --format json ...           - Print one JSON object per event and line on\n"
+"                                 stdout, everything else goes to stderr\n"
+"%s --part spi --offset 0x10000 --length 4096 --read/--write/--crc ...\n"
+"                               - Work on a part of the partition only.\n"
+"                                 Writes need a page aligned offset\n"
+"%s --part eeprom [--warmup 1] [--bench-write] --benchmark 10\n"
+"                               - Time info, read, verify and (only with\n"
+"                                 --bench-write) write on a scratch partition\n"
+"%s --no-history ...            - Don't log this run to the performance\n"
+"                                 history\n"
+"%s [--drift-threshold 20] --drift 3\n"
+"                               - Flag devices, ports and hubs whose last 3\n"
+"                                 runs were 20%% slower than before\n"
+"%s --timeout 30 [--report-timeout 500] ...\n"
+"                               - Give up on a device after 30 seconds (each\n"
+"                                 device with --all) or on a single report\n"
+"                                 after 500 ms. ^C stops at the next report,\n"
+"                                 press it twice to kill\n"
+"%s --wait --run [--timeout 10] - Start the application and wait until the\n"
+"                                 board is back on the bus, as the app or\n"
+"                                 as the bootloader (which is an error)\n"
+"%s --status-board /dev/shm/uhid ...\n"
+"                               - Publish progress in a shared memory file,\n"
+"                                 one slot per device\n"
+"%s --status /dev/shm/uhid      - Show what everyone on the board is doing\n"
+"%s --snapshot board.uhs        - Save all partitions to one file\n"
+"%s --restore board.uhs         - Write it back, skipping partitions that\n"
+"                                 didn't change. With --all, --snapshot\n"
+"                                 takes a directory\n"
+"%s --cache-size 64 [--cache-hash] --write/--verify ...\n"
+"                               - Keep up to 64M of decoded images (0 is\n"
+"                                 off) and reuse them while the file's size\n"
+"                                 and mtime (and hash) stay the same\n"
+"%s --clear-cache               - Forget all decoded images\n"
 "\n"
-"uHIDtool can read intel hex as well as binary. \n"
-"The filename extension should be .ihx or .hex for it to work\n"
+"uHIDtool can read intel hex and ELF as well as binary, the format is\n"
+"detected from the contents. Use - as the file name for stdin\n"
 ;
 
 
@@ -233,7 +1033,15 @@ static void usage(const char *name)
 	else
 		nm++;
 
-	printf(usagemsg, nm, nm, nm, nm, nm, nm);
+	printf(usagemsg, nm, nm, nm, nm, nm, nm, nm, nm, nm, nm, nm, nm, nm, nm, nm, nm, nm, nm,
+	       nm, nm, nm, nm, nm, nm, nm, nm, nm);
+}
+
+/* The first ^C lets the library stop cleanly, the second one kills us */
+static void interrupted(int sig)
+{
+	signal(sig, SIG_DFL);
+	uhidCancel(&cancel);
 }
 
 int main(int argc, char **argv)
@@ -245,7 +1053,11 @@ int main(int argc, char **argv)
 	const char *product = NULL;
 	const char *serial = NULL;
 	const char *filename;
-	uhidProgressCb(progressbar);
+	char extra[64], *info;
+	uhidProgressCb(progress_update);
+	progress.render = progressbar;
+	uhidSetLimits(&limits);
+	signal(SIGINT, interrupted);
 
 	uint32_t crc;
 	if (argc == 1) {
@@ -256,7 +1068,7 @@ int main(int argc, char **argv)
 	while (1) {
 		int option_index = 0;
 		int c;
-		c = getopt_long (argc, argv, "hp:w:r:p:v:P:S:b:c:t",
+		c = getopt_long (argc, argv, "hp:w:r:p:v:P:S:D:b:c:t:",
 				 long_options, &option_index);
 		if (c == -1)
 			break;
@@ -267,36 +1079,96 @@ int main(int argc, char **argv)
 			break;
 		case 'c':
 			check_and_open(&uhid, product, serial);
-			inf = uhidReadInfo(uhid);
-			uhidGetPartitionCRC(uhid, partname, &crc);
+			phase_begin(uhid, "crc", partname);
+			if (offset || length) {
+				part = uhidLookupPart(uhid, partname);
+				ret = (part < 0) ? -ENOENT :
+					uhidGetRangeCRC(uhid, part, offset, range_length(uhid, part), &crc);
+			} else {
+				ret = uhidGetPartitionCRC(uhid, partname, &crc);
+			}
+			snprintf(extra, sizeof(extra), "\"crc\":%" PRIu32, crc);
+			phase_end(ret, ret ? NULL : extra);
 			printf("\nPartition: %s CRC32: 0x%" PRIx32 "\n", partname, crc);
-			free(inf);
-			bailout(0);
+			bailout(ret ? 1 : 0);
 			break;
 		case 'p':
 			partname = optarg;
 			break;
+		case 'o':
+			offset = strtoull(optarg, NULL, 0);
+			break;
+		case 'l':
+			length = strtoull(optarg, NULL, 0);
+			break;
 		case 't':
-			while(1) {
-				check_and_open(&uhid, product, serial);
-				inf = uhidReadInfo(uhid);
-				part = uhidLookupPart(uhid, partname);
-				if (part < 0) {
-					fprintf(stderr, "No such part");
-					bailout(1);
-				}
-				int blah;
-				char *shit = uhidReadPart(uhid, part, &blah);
-				if (shit)
-					free(shit);
+			bench.iterations = atoi(optarg);
+			if (bench.iterations <= 0) {
+				fprintf(stderr, "Bad iteration count: %s\n", optarg);
+				bailout(1);
 			}
+			check_and_open(&uhid, product, serial);
+			phase_begin(uhid, "benchmark", partname);
+			ret = run_benchmark(uhid);
+			phase_end(ret, NULL);
+			bailout(ret);
+			break;
+		case 'W':
+			bench.warmup = atoi(optarg);
+			break;
+		case 'H':
+			history = 0;
+			break;
+		case 'g':
+			drift_threshold = atof(optarg) / 100.0;
+			break;
+		case 'd':
+			ret = uhidmgrPerfDrift(atoi(optarg), drift_threshold);
+			if (ret < 0)
+				fprintf(stderr, "Bad --drift: %s\n", strerror(-ret));
+			bailout(ret ? 1 : 0);
+			break;
+		case 'O':
+			limits.timeoutMs = atof(optarg) * 1000;
+			sched.jobTimeoutMs = limits.timeoutMs;
+			uhidSetLimits(&limits);
+			break;
+		case 'Y':
+			limits.reportTimeoutMs = atoi(optarg);
+			sched.reportTimeoutMs = limits.reportTimeoutMs;
+			uhidSetLimits(&limits);
+			break;
+		case 'X':
+			bench.write = 1;
 			break;
 		case 'P':
 			product = optarg;
 			break;
+		case 'S':
+			serial = optarg;
+			break;
+		case 'D':
+		{
+			unsigned int vid, pid;
+			if (sscanf(optarg, "%x:%x", &vid, &pid) != 2) {
+				fprintf(stderr, "Bad VID:PID: %s\n", optarg);
+				bailout(1);
+			}
+			devmatch[0].vendor = vid;
+			devmatch[0].product = pid;
+			break;
+		}
 		case 'i':
 			check_and_open(&uhid, product, serial);
+			phase_begin(uhid, "info", NULL);
 			inf = uhidReadInfo(uhid);
+			if (!inf) {
+				phase_end(-EIO, NULL);
+				bailout(1);
+			}
+			info = json_info(inf);
+			phase_end(0, info);
+			free(info);
 			uhidPrintInfo(uhid, inf);
 			free(inf);
 			bailout(0);
@@ -310,12 +1182,26 @@ int main(int argc, char **argv)
 				bailout(1);
 			}
 			printf("Reading partition %d (%s) to %s\n", part, partname, filename);
-			ret = uhidReadPartToFile(uhid, part, filename);
+			phase_begin(uhid, "read", partname);
+			if (offset || length)
+				ret = uhidReadRangeToFile(uhid, part, offset,
+							  range_length(uhid, part), filename);
+			else
+				ret = uhidReadPartToFile(uhid, part, filename);
+			phase_end(ret, NULL);
 			printf("\n");
 			bailout(ret);
 			break;
 		case 'w':
 			filename = optarg;
+			/*
+			 * The library verifies what it wrote: on the device if it
+			 * can, otherwise from the image it already has in memory
+			 */
+			if (verify)
+				uhidSetFlags(uhidGetFlags() | UHID_FLAG_VERIFY);
+			if (alldevs)
+				run_all(jobWrite, "write", filename);
 			check_and_open(&uhid, product, serial);
 			part = uhidLookupPart(uhid, partname);
 			if (part < 0) {
@@ -323,15 +1209,25 @@ int main(int argc, char **argv)
 				bailout(1);
 			}
 			printf("Writing partition %d (%s) from %s\n", part, partname, filename);
-			ret = uhidWritePartFromFile(uhid, part, filename);
+			phase_begin(uhid, "write", partname);
+			if (offset)
+				ret = uhidWriteRangeFromFile(uhid, part, offset, filename);
+			else
+				ret = uhidWritePartFromFile(uhid, part, filename);
+			phase_end(ret, NULL);
 			printf("\n");
+			if (ret > 0)
+				printf("Something bad during verification\n");
 			if (ret)
 				bailout(ret);
 
-			if (!verify)
-				break;
+			if (uhidGetFlags() & UHID_FLAG_VERIFY)
+				printf("Verification completed successfully\n");
+			break;
 		case 'v':
 			filename = optarg;
+			if (alldevs)
+				run_all(jobVerify, "verify", filename);
 			check_and_open(&uhid, product, serial);
 			part = uhidLookupPart(uhid, partname);
 			if (part < 0) {
@@ -339,24 +1235,123 @@ int main(int argc, char **argv)
 				bailout(1);
 			}
 			printf("Verifying partition %d (%s) from %s\n", part, partname, filename);
+			phase_begin(uhid, "verify", partname);
 			ret = uhidVerifyPartFromFile(uhid, part, filename);
+			phase_end(ret, NULL);
 			if (ret ==0 )
 				printf("Verification completed successfully\n");
 			else
 				printf("Something bad during verification\n");
 			bailout(ret);
+		case 'N':
+			filename = optarg;
+			if (alldevs)
+				run_all(jobSnapshot, "snapshot", filename);
+			check_and_open(&uhid, product, serial);
+			printf("Saving all partitions to %s\n", filename);
+			phase_begin(uhid, "snapshot", NULL);
+			ret = uhidSnapshot(uhid, filename);
+			phase_end(ret, NULL);
+			printf("\n");
+			bailout(ret ? 1 : 0);
+			break;
+		case 'U':
+			filename = optarg;
+			if (verify)
+				uhidSetFlags(uhidGetFlags() | UHID_FLAG_VERIFY);
+			if (alldevs)
+				run_all(jobRestore, "restore", filename);
+			check_and_open(&uhid, product, serial);
+			printf("Restoring %s\n", filename);
+			phase_begin(uhid, "restore", NULL);
+			ret = uhidRestore(uhid, filename);
+			phase_end(ret, NULL);
+			printf("\n");
+			bailout(ret ? 1 : 0);
+			break;
+		case 'G':
+			wait_run = 1;
+			break;
+		case 'k':
+			ret = uhidStatusOpen(optarg, STATUS_SLOTS);
+			if (ret) {
+				fprintf(stderr, "Can't open status board %s: %s\n", optarg, strerror(-ret));
+				bailout(1);
+			}
+			break;
+		case 'm':
+			bailout(show_status(optarg));
+			break;
 		case 'R':
 			check_and_open(&uhid, product, serial);
-			uhidCloseAndRun(uhid, part);
-			bailout(0);
+			part = partname ? uhidLookupPart(uhid, partname) : 0;
+			if (part < 0) {
+				fprintf(stderr, "No such partition: %s\n", partname);
+				bailout(1);
+			}
+			if (!wait_run) {
+				uhidCloseAndRun(uhid, part);
+				bailout(0);
+			}
+			ret = run_and_wait(uhid, part);
+			bailout(ret);
+			break;
+		case 'Z':
+			uhidSetFlags(uhidGetFlags() | UHID_FLAG_NO_COMPRESS);
+			break;
+		case 'F':
+			uhidSetFillByte(strtoul(optarg, NULL, 0));
+			break;
+		case 'x':
+			uhidSetHexBase(strtoul(optarg, NULL, 0));
+			break;
+		case 'E':
+			uhidSetFlags(uhidGetFlags() | UHID_FLAG_ELIDE_BLANK);
+			break;
+		case 'K':
+			uhidSetFlags(uhidGetFlags() | UHID_FLAG_READBACK);
+			break;
+		case 'C':
+			uhidSetCacheLimit(strtoull(optarg, NULL, 0) << 20);
+			break;
+		case 'e':
+			uhidSetFlags(uhidGetFlags() | UHID_FLAG_CACHE_HASH);
+			break;
+		case 'L':
+			ret = uhidCacheClear();
+			if (ret)
+				fprintf(stderr, "Can't clear the image cache: %s\n", strerror(-ret));
+			bailout(ret ? 1 : 0);
+			break;
+		case 'A':
+			alldevs = 1;
+			break;
+		case 'j':
+			sched.maxJobs = atoi(optarg);
+			break;
+		case 'T':
+			sched.perTT = atoi(optarg);
+			break;
+		case 'B':
+			sched.perBus = atoi(optarg);
 			break;
 		case 'b':
 			if (strcmp(optarg, "bar")==0)
-				uhidProgressCb(progressbar);
+				progress.render = progressbar;
 			else if (strcmp(optarg, "plain")==0)
-				uhidProgressCb(progressplain);
+				progress.render = progressplain;
+			else if (strcmp(optarg, "json")==0)
+				json_open();
 			else if (strcmp(optarg, "none")==0)
-				uhidProgressCb(NULL);
+				progress.render = NULL;
+			break;
+		case 'f':
+			if (strcmp(optarg, "json") == 0) {
+				json_open();
+			} else if (strcmp(optarg, "text") != 0 && strcmp(optarg, "json") != 0) {
+				fprintf(stderr, "Unknown format: %s\n", optarg);
+				bailout(1);
+			}
 			break;
 		/* Debugging shit */
 		case '1':